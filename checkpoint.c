@@ -0,0 +1,346 @@
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <libgen.h>
+#include "checkpoint.h"
+#include "world.h"
+
+/* Layout of a checkpoint:
+ *   CheckpointHeader
+ *   the particles, world.numParticles of them
+ *   header.numSections times: tag[SECTION_TAG_SIZE], uint64_t size,
+ *                             and size bytes of the section
+ *   CHECKPOINT_END */
+#define CHECKPOINT_MAGIC "HSCHKPT"
+#define CHECKPOINT_END "HSCHKEND"
+#define CHECKPOINT_VERSION 4
+#define CHECKPOINT_BYTE_ORDER 0x01020304
+
+#define MAX_SECTIONS 16
+#define SECTION_TAG_SIZE 32
+
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t byteOrder;
+	uint32_t particleSize;
+	uint64_t seed; /* Of the random streams, see rng.h */
+	int64_t iteration; /* Number of iterations done */
+	int32_t numParticles;
+	int32_t twoDimensional;
+	double worldSize;
+	uint32_t numSections;
+} CheckpointHeader;
+
+typedef struct {
+	char tag[SECTION_TAG_SIZE];
+	CheckpointSaver save;
+	CheckpointLoader load;
+	void *data;
+} Section;
+
+/* A section of the checkpoint we restarted from, waiting for its task */
+typedef struct {
+	char tag[SECTION_TAG_SIZE];
+	char *bytes;
+	size_t size;
+	bool used;
+} StoredSection;
+
+static Section sections[MAX_SECTIONS];
+static int numSections = 0;
+
+static bool restarted = false;
+static StoredSection stored[MAX_SECTIONS];
+static int numStored = 0;
+
+static volatile sig_atomic_t terminated = 0;
+
+
+void checkpointWrite(FILE *f, const void *data, size_t size)
+{
+	/* Errors get picked up by ferror() at the end */
+	fwrite(data, 1, size, f);
+}
+bool checkpointRead(FILE *f, void *data, size_t size)
+{
+	return fread(data, 1, size, f) == size;
+}
+
+static void writeSections(FILE *f)
+{
+	for (int i = 0; i < numSections; i++) {
+		Section *s = &sections[i];
+		checkpointWrite(f, s->tag, SECTION_TAG_SIZE);
+
+		/* Fill in the size afterwards */
+		uint64_t size = 0;
+		long sizePos = ftell(f);
+		checkpointWrite(f, &size, sizeof(size));
+		s->save(f, s->data);
+		long end = ftell(f);
+		size = end - sizePos - sizeof(size);
+		fseek(f, sizePos, SEEK_SET);
+		checkpointWrite(f, &size, sizeof(size));
+		fseek(f, end, SEEK_SET);
+	}
+}
+
+/* fsync() the directory of filename, so the rename sticks too. */
+static bool syncDirectory(const char *filename)
+{
+	char *copy = asprintfOrDie("%s", filename);
+	int fd = open(dirname(copy), O_RDONLY);
+	free(copy);
+	if (fd < 0)
+		return false;
+	bool ok = fsync(fd) == 0;
+	close(fd);
+	return ok;
+}
+
+/* Writes the checkpoint to filename.tmp, and renames that to filename when
+ * it's all on disk. Returns false on failure, with errno set. */
+static bool writeCheckpoint(const char *filename)
+{
+	char *tmp = asprintfOrDie("%s.tmp", filename);
+	FILE *f = fopen(tmp, "w");
+	if (f == NULL) {
+		free(tmp);
+		return false;
+	}
+
+	CheckpointHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+	header.version = CHECKPOINT_VERSION;
+	header.byteOrder = CHECKPOINT_BYTE_ORDER;
+	header.particleSize = sizeof(Particle);
+	header.seed = randomSeed();
+	/* We get called at the end of the iteration */
+	header.iteration = getIteration() + 1;
+	header.numParticles = world.numParticles;
+	header.twoDimensional = world.twoDimensional;
+	header.worldSize = world.worldSize;
+	header.numSections = numSections;
+
+	checkpointWrite(f, &header, sizeof(header));
+	checkpointWrite(f, world.particles,
+			world.numParticles * sizeof(*world.particles));
+	writeSections(f);
+	checkpointWrite(f, CHECKPOINT_END, 8);
+
+	bool ok = !ferror(f) && fflush(f) == 0 && fsync(fileno(f)) == 0;
+	int err = errno;
+	ok = (fclose(f) == 0) && ok;
+	ok = ok && rename(tmp, filename) == 0;
+	if (ok)
+		syncDirectory(filename);
+	else
+		errno = err;
+	free(tmp);
+	return ok;
+}
+
+void loadCheckpoint(const char *filename)
+{
+	assert(!restarted);
+	FILE *f = fopen(filename, "r");
+	if (f == NULL)
+		die("Couldn't open checkpoint %s: %s\n", filename,
+							strerror(errno));
+
+	CheckpointHeader header;
+	if (!checkpointRead(f, &header, sizeof(header))
+			|| memcmp(header.magic, CHECKPOINT_MAGIC,
+						sizeof(header.magic)) != 0)
+		die("%s is not a checkpoint!\n", filename);
+	if (header.version != CHECKPOINT_VERSION
+			|| header.byteOrder != CHECKPOINT_BYTE_ORDER
+			|| header.particleSize != sizeof(Particle))
+		die("Checkpoint %s was written by an incompatible version or "
+						"machine!\n", filename);
+	if (header.numParticles < 0 || header.numSections > MAX_SECTIONS)
+		die("Checkpoint %s is corrupt!\n", filename);
+
+	if (!allocWorld(header.numParticles, header.worldSize,
+						header.twoDimensional))
+		dieMem();
+	if (!checkpointRead(f, world.particles,
+			world.numParticles * sizeof(*world.particles)))
+		die("Checkpoint %s is truncated!\n", filename);
+
+	for (uint32_t i = 0; i < header.numSections; i++) {
+		StoredSection *s = &stored[numStored++];
+		uint64_t size;
+		if (!checkpointRead(f, s->tag, SECTION_TAG_SIZE)
+				|| !checkpointRead(f, &size, sizeof(size)))
+			die("Checkpoint %s is truncated!\n", filename);
+		s->tag[SECTION_TAG_SIZE - 1] = '\0';
+		s->size = size;
+		s->bytes = malloc(MAX(s->size, 1));
+		if (s->bytes == NULL)
+			dieMem();
+		if (!checkpointRead(f, s->bytes, s->size))
+			die("Checkpoint %s is truncated!\n", filename);
+		s->used = false;
+	}
+
+	char end[8];
+	if (!checkpointRead(f, end, sizeof(end))
+			|| memcmp(end, CHECKPOINT_END, sizeof(end)) != 0)
+		die("Checkpoint %s is corrupt!\n", filename);
+	fclose(f);
+
+	setIteration(header.iteration);
+	/* The random streams continue where they were, they only depend on 
+	 * the seed and the counters of the tasks. */
+	seedRandomWith(header.seed);
+	restarted = true;
+	printf("Restarting from %s at iteration %ld with %d particles\n",
+			filename, (long) header.iteration, world.numParticles);
+}
+
+bool restartedFromCheckpoint(void)
+{
+	return restarted;
+}
+
+/* Hand the stored section with the given tag to its loader, if we have
+ * one. */
+static void restoreSection(const Section *section)
+{
+	for (int i = 0; i < numStored; i++) {
+		StoredSection *s = &stored[i];
+		if (strcmp(s->tag, section->tag) != 0)
+			continue;
+
+		FILE *f = fmemopen(s->bytes, MAX(s->size, 1), "r");
+		if (f == NULL)
+			dieMem();
+		bool ok = section->load(f, section->data)
+					&& ftell(f) == (long) s->size;
+		fclose(f);
+		if (!ok)
+			die("Section %s of the checkpoint doesn't fit the "
+					"current settings!\n", s->tag);
+		s->used = true;
+		return;
+	}
+}
+
+void addCheckpointSection(const char *tag, CheckpointSaver save,
+					CheckpointLoader load, void *data)
+{
+	assert(strlen(tag) < SECTION_TAG_SIZE);
+	assert(numSections < MAX_SECTIONS);
+	for (int i = 0; i < numSections; i++)
+		assert(strcmp(sections[i].tag, tag) != 0);
+
+	Section *s = &sections[numSections++];
+	memset(s->tag, 0, SECTION_TAG_SIZE);
+	strcpy(s->tag, tag);
+	s->save = save;
+	s->load = load;
+	s->data = data;
+
+	restoreSection(s);
+}
+
+void removeCheckpointSection(const char *tag)
+{
+	for (int i = 0; i < numSections; i++) {
+		if (strcmp(sections[i].tag, tag) != 0)
+			continue;
+		sections[i] = sections[--numSections];
+		return;
+	}
+	assert(false); /* No such section */
+}
+
+
+
+/* CHECKPOINT TASK */
+
+static void onTerminate(int sig)
+{
+	UNUSED(sig);
+	terminated = 1;
+}
+
+static void *checkpointStart(void *initialData)
+{
+	CheckpointConfig *cc = (CheckpointConfig*) initialData;
+
+	if (restarted) {
+		for (int i = 0; i < numStored; i++) {
+			if (!stored[i].used)
+				fprintf(stderr, "Section %s of the checkpoint "
+						"is not used by anything!\n",
+						stored[i].tag);
+			free(stored[i].bytes);
+		}
+		numStored = 0;
+	}
+
+	if (cc->filename != NULL) {
+		struct sigaction sa;
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_handler = &onTerminate;
+		sigemptyset(&sa.sa_mask);
+		if (sigaction(SIGTERM, &sa, NULL) != 0)
+			die("Couldn't install the SIGTERM handler!\n");
+	}
+	return cc;
+}
+
+static TaskSignal checkpointTick(void *state)
+{
+	CheckpointConfig *cc = (CheckpointConfig*) state;
+	if (cc->filename == NULL)
+		return TASK_OK;
+
+	long done = getIteration() + 1;
+	bool stop = terminated;
+	if (!stop && (cc->interval <= 0 || done % cc->interval != 0))
+		return TASK_OK;
+
+	if (!writeCheckpoint(cc->filename)) {
+		fprintf(stderr, "Couldn't write checkpoint %s: %s\n",
+					cc->filename, strerror(errno));
+		/* Keep going when we can, maybe the next one works */
+		return stop ? TASK_ERROR : TASK_OK;
+	}
+	printf("\nWrote checkpoint %s after %ld iterations\n",
+						cc->filename, done);
+	if (stop)
+		printf("Stopping because of SIGTERM\n");
+	return stop ? TASK_STOP : TASK_OK;
+}
+
+static void checkpointStop(void *state)
+{
+	CheckpointConfig *cc = (CheckpointConfig*) state;
+	if (cc->filename != NULL)
+		signal(SIGTERM, SIG_DFL);
+	free(cc);
+}
+
+Task makeCheckpointTask(CheckpointConfig *conf)
+{
+	CheckpointConfig *cc = malloc(sizeof(*cc));
+	if (cc == NULL)
+		dieMem();
+	memcpy(cc, conf, sizeof(*cc));
+
+	Task ret = {
+		.initialData = cc,
+		.start = &checkpointStart,
+		.tick  = &checkpointTick,
+		.stop  = &checkpointStop,
+	};
+	return ret;
+}
@@ -0,0 +1,68 @@
+#ifndef _CHECKPOINT_H_
+#define _CHECKPOINT_H_
+
+/* Binary checkpoints of the full simulation state, to restart long runs
+ * after they got killed.
+ *
+ * A checkpoint holds the world (with the image counters of the particles),
+ * the iteration, the seed of the random streams, and a section for
+ * every task with state of its own: the counters of the simulation, the
+ * accumulators of the samplers, ... Tasks add their section in start()
+ * and remove it again in stop().
+ *
+ * The data is raw binary in the byte order and type sizes of the machine
+ * that wrote it. Those get checked when reading, and so does the version
+ * of the format, so a checkpoint we can't read gets refused instead of
+ * misread. */
+
+#include <stdio.h>
+#include "system.h"
+
+typedef struct {
+	/* File to write the checkpoints to, or NULL to not write any. A
+	 * checkpoint first goes to filename.tmp, which then gets renamed,
+	 * so there always is a complete checkpoint at filename. */
+	const char *filename;
+
+	/* Write a checkpoint every this many iterations. Set to 0 or less
+	 * to only write one when we get a SIGTERM, which also stops the
+	 * simulation. */
+	long interval;
+} CheckpointConfig;
+
+/* Writes the checkpoints. This has to come after all other tasks in the
+ * sequence, so they all finished their iteration when it ticks, and they
+ * all added their section when it starts. */
+Task makeCheckpointTask(CheckpointConfig *conf);
+
+/* Allocates the world, and fills it and the iteration from the given
+ * checkpoint. The rest of the checkpoint gets kept around, and goes to
+ * the tasks as they start. Dies if the file isn't a valid checkpoint. */
+void loadCheckpoint(const char *filename);
+
+/* True if the world came from a checkpoint, so the simulation has to
+ * continue from the particles as they are. */
+bool restartedFromCheckpoint(void);
+
+
+/* Sections */
+
+/* Write the state in data to f with checkpointWrite(). */
+typedef void (*CheckpointSaver)(FILE *f, void *data);
+/* Read the state written by the saver back into data with
+ * checkpointRead(). Returns false if it doesn't fit (eg it was written
+ * with different settings). */
+typedef bool (*CheckpointLoader)(FILE *f, void *data);
+
+/* Adds a section with the given (unique) tag to every checkpoint from now
+ * on. When we restarted from a checkpoint that has this section, load()
+ * gets called with it right away. Dies if that fails. */
+void addCheckpointSection(const char *tag, CheckpointSaver save,
+					CheckpointLoader load, void *data);
+void removeCheckpointSection(const char *tag);
+
+void checkpointWrite(FILE *f, const void *data, size_t size);
+/* Returns false if the section didn't have size bytes left. */
+bool checkpointRead(FILE *f, void *data, size_t size);
+
+#endif
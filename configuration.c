@@ -0,0 +1,285 @@
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include "configuration.h"
+#include "world.h"
+
+#define CONFIGURATION_MAGIC "HSCONF1"
+#define CONFIGURATION_BYTE_ORDER 0x01020304
+
+/* Followed by the x, y and z of every particle as doubles */
+typedef struct {
+	char magic[8];
+	uint32_t byteOrder;
+	int32_t numParticles;
+	int32_t twoDimensional;
+	double worldSize;
+} ConfigurationHeader;
+
+static bool loaded = false;
+
+/* Unit cells with a basis. The cell is a box of cell[d] times the lattice 
+ * constant along axis d, and the sites are at the fractional coordinates 
+ * in basis. */
+#define MAX_BASIS 4
+#define SQRT3 1.7320508075688772
+#define SQRT8_3 1.6329931618554521 /* sqrt(8/3) */
+
+typedef struct {
+	const char *name;
+	bool twoDimensional;
+	double cell[3];
+	int numBasis;
+	double basis[MAX_BASIS][3];
+} Lattice;
+
+static const Lattice lattices[] = {
+	{"fcc", false, {1, 1, 1}, 4,
+		{{0, 0, 0}, {0.5, 0.5, 0}, {0.5, 0, 0.5}, {0, 0.5, 0.5}}},
+	{"bcc", false, {1, 1, 1}, 2, {{0, 0, 0}, {0.5, 0.5, 0.5}}},
+	/* Orthohexagonal cell of two layers, A at z = 0 and B at z = 1/2 */
+	{"hcp", false, {1, SQRT3, SQRT8_3}, 4,
+		{{0, 0, 0}, {0.5, 0.5, 0}, {0.5, 1/6.0, 0.5}, {0, 2/3.0, 0.5}}},
+	{"triangular", true, {1, SQRT3, 1}, 2, {{0, 0, 0}, {0.5, 0.5, 0}}},
+	{"square", true, {1, 1, 1}, 1, {{0, 0, 0}}},
+};
+#define NUM_LATTICES ((int) (sizeof(lattices) / sizeof(lattices[0])))
+
+
+static void loadBinary(FILE *f, const char *filename)
+{
+	ConfigurationHeader header;
+	if (fread(&header, sizeof(header), 1, f) != 1)
+		die("Configuration %s is truncated!\n", filename);
+	if (header.byteOrder != CONFIGURATION_BYTE_ORDER)
+		die("Configuration %s was written by a machine with another "
+						"byte order!\n", filename);
+	if (header.numParticles < 0 || !(header.worldSize > 0))
+		die("Configuration %s is corrupt!\n", filename);
+
+	if (!allocWorld(header.numParticles, header.worldSize,
+						header.twoDimensional))
+		dieMem();
+	for (int i = 0; i < world.numParticles; i++) {
+		double xyz[3];
+		if (fread(xyz, sizeof(xyz), 1, f) != 1)
+			die("Configuration %s is truncated!\n", filename);
+		world.particles[i].pos = (Vec3) {xyz[0], xyz[1], xyz[2]};
+	}
+}
+
+/* Reads the next line into *line, dies at the end of the file. */
+static void readLine(FILE *f, char **line, size_t *size,
+						const char *filename)
+{
+	if (getline(line, size, f) < 0)
+		die("Configuration %s ends too soon!\n", filename);
+}
+
+static void loadXYZ(FILE *f, const char *filename, bool twoDimensional)
+{
+	char *line = NULL;
+	size_t size = 0;
+
+	readLine(f, &line, &size, filename);
+	char *end;
+	long n = strtol(line, &end, 10);
+	if (end == line || n < 0 || n > INT32_MAX)
+		die("First line of %s is not a number of particles!\n",
+								filename);
+
+	/* Only cubic (or square) worlds */
+	readLine(f, &line, &size, filename);
+	const char *lattice = strstr(line, "Lattice=\"");
+	double a[9];
+	if (lattice == NULL || sscanf(lattice, "Lattice=\"%lf %lf %lf %lf "
+				"%lf %lf %lf %lf %lf", &a[0], &a[1], &a[2],
+				&a[3], &a[4], &a[5], &a[6], &a[7], &a[8]) != 9)
+		die("Comment line of %s has no Lattice=\"...\" with the world "
+						"size!\n", filename);
+	double L = a[0];
+	if (!(L > 0) || a[1] != 0 || a[2] != 0 || a[3] != 0 || a[4] != L
+			|| a[5] != 0 || a[6] != 0 || a[7] != 0
+			|| (!twoDimensional && a[8] != L))
+		die("The world of %s is not a cube (or a square for 2D)!\n",
+								filename);
+
+	if (!allocWorld(n, L, twoDimensional))
+		dieMem();
+	for (int i = 0; i < n; i++) {
+		readLine(f, &line, &size, filename);
+		double x, y, z = 0;
+		int k = sscanf(line, "%*s %lf %lf %lf", &x, &y, &z);
+		if (k < (twoDimensional ? 2 : 3))
+			die("Can't read particle %d of %s: %s", i, filename,
+									line);
+		/* [0, L) in the file, centered around 0 here */
+		world.particles[i].pos = (Vec3) {x - L/2, y - L/2,
+					twoDimensional ? 0 : z - L/2};
+	}
+	free(line);
+}
+
+void loadConfiguration(const char *filename, bool twoDimensional)
+{
+	assert(!loaded);
+	FILE *f = fopen(filename, "r");
+	if (f == NULL)
+		die("Couldn't open configuration %s: %s\n", filename,
+							strerror(errno));
+
+	char magic[8];
+	bool binary = fread(magic, sizeof(magic), 1, f) == 1
+		&& memcmp(magic, CONFIGURATION_MAGIC, sizeof(magic)) == 0;
+	rewind(f);
+	if (binary)
+		loadBinary(f, filename);
+	else
+		loadXYZ(f, filename, twoDimensional);
+	fclose(f);
+
+	loaded = true;
+	printf("Loaded %d particles from %s\n", world.numParticles, filename);
+}
+
+/* Smallest distance between two sites of a lattice with cells of the given 
+ * size, which are at least a site distance big. */
+static double latticeMinDistance(const Lattice *lat, const double size[3])
+{
+	int dims = lat->twoDimensional ? 2 : 3;
+	int zRange = (dims == 3 ? 1 : 0);
+	double min2 = INFINITY;
+	for (int i = 0; i < lat->numBasis; i++)
+	for (int j = 0; j < lat->numBasis; j++)
+	for (int cx = -1; cx <= 1; cx++)
+	for (int cy = -1; cy <= 1; cy++)
+	for (int cz = -zRange; cz <= zRange; cz++) {
+		if (i == j && cx == 0 && cy == 0 && cz == 0)
+			continue;
+		int c[3] = {cx, cy, cz};
+		double d2 = 0;
+		for (int d = 0; d < dims; d++)
+			d2 += SQUARE((c[d] + lat->basis[j][d]
+						- lat->basis[i][d]) * size[d]);
+		min2 = MIN(min2, d2);
+	}
+	return sqrt(min2);
+}
+
+void latticeConfiguration(const char *name, int numParticles,
+				double worldSize, bool twoDimensional)
+{
+	assert(!loaded);
+	const Lattice *lat = NULL;
+	for (int i = 0; i < NUM_LATTICES; i++)
+		if (strcmp(lattices[i].name, name) == 0)
+			lat = &lattices[i];
+	if (lat == NULL)
+		die("Unknown lattice %s!\n", name);
+	if (lat->twoDimensional != twoDimensional)
+		die("The %s lattice is not for a %dD world!\n", name,
+						twoDimensional ? 2 : 3);
+
+	/* The lattice constant that would give exactly numParticles sites, 
+	 * and enough cells along every axis to have at least that many */
+	int dims = twoDimensional ? 2 : 3;
+	double cellVolume = 1;
+	for (int d = 0; d < dims; d++)
+		cellVolume *= lat->cell[d];
+	double a = pow(pow(worldSize, dims) * lat->numBasis
+			/ (MAX(numParticles, 1) * cellVolume), 1.0 / dims);
+	int n[3] = {1, 1, 1};
+	double size[3] = {0, 0, 0};
+	for (int d = 0; d < dims; d++) {
+		n[d] = ceil(worldSize / (a * lat->cell[d]) - 1e-9);
+		size[d] = worldSize / n[d];
+	}
+	long numSites = (long) n[0] * n[1] * n[2] * lat->numBasis;
+	assert(numSites >= numParticles);
+
+	double minDist = latticeMinDistance(lat, size);
+	if (minDist < 1)
+		die("A %s lattice of %d x %d x %d cells can't hold %d "
+				"particles in this world, they would be %f "
+				"apart!\n",
+				name, n[0], n[1], n[2], numParticles, minDist);
+
+	if (!allocWorld(numParticles, worldSize, twoDimensional))
+		dieMem();
+	/* Take every (numSites / numParticles)th site, so the vacancies are 
+	 * spread out */
+	for (int i = 0; i < numParticles; i++) {
+		long site = i * numSites / numParticles;
+		int b = site % lat->numBasis;
+		long c = site / lat->numBasis;
+		int idx[3] = {c / (n[1] * n[2]), (c / n[2]) % n[1], c % n[2]};
+		double pos[3] = {0, 0, 0};
+		for (int d = 0; d < dims; d++)
+			pos[d] = (idx[d] + lat->basis[b][d]) * size[d]
+							- worldSize / 2;
+		world.particles[i].pos = (Vec3) {pos[0], pos[1], pos[2]};
+	}
+
+	loaded = true;
+	printf("Put %d particles on a %s lattice of %d x %d x %d cells (%ld "
+			"sites), %f apart\n", numParticles, name, n[0], n[1],
+			n[2], numSites, minDist);
+}
+
+bool configurationLoaded(void)
+{
+	return loaded;
+}
+
+static void saveBinary(FILE *f)
+{
+	ConfigurationHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, CONFIGURATION_MAGIC, sizeof(header.magic));
+	header.byteOrder = CONFIGURATION_BYTE_ORDER;
+	header.numParticles = world.numParticles;
+	header.twoDimensional = world.twoDimensional;
+	header.worldSize = world.worldSize;
+	fwrite(&header, sizeof(header), 1, f);
+
+	for (int i = 0; i < world.numParticles; i++) {
+		Vec3 pos = world.particles[i].pos;
+		double xyz[3] = {pos.x, pos.y, pos.z};
+		fwrite(xyz, sizeof(xyz), 1, f);
+	}
+}
+
+static void saveXYZ(FILE *f)
+{
+	double L = world.worldSize;
+	/* Some thickness along z for 2D, for the tools that want it */
+	double Lz = world.twoDimensional ? 1 : L;
+	fprintf(f, "%d\n", world.numParticles);
+	fprintf(f, "Lattice=\"%.17g 0 0 0 %.17g 0 0 0 %.17g\" "
+			"Properties=species:S:1:pos:R:3\n", L, L, Lz);
+	for (int i = 0; i < world.numParticles; i++) {
+		Vec3 pos = world.particles[i].pos;
+		fprintf(f, "A %.17g %.17g %.17g\n", pos.x + L/2, pos.y + L/2,
+				world.twoDimensional ? 0 : pos.z + L/2);
+	}
+}
+
+bool saveConfiguration(const char *filename)
+{
+	FILE *f = fopen(filename, "w");
+	if (f == NULL)
+		return false;
+
+	size_t len = strlen(filename);
+	if (len >= 4 && strcmp(filename + len - 4, ".xyz") == 0)
+		saveXYZ(f);
+	else
+		saveBinary(f);
+
+	bool ok = !ferror(f);
+	int err = errno;
+	ok = (fclose(f) == 0) && ok;
+	if (!ok)
+		errno = err;
+	return ok;
+}
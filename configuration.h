@@ -0,0 +1,44 @@
+#ifndef _CONFIGURATION_H_
+#define _CONFIGURATION_H_
+
+/* Configurations of particles to start from instead of inserting the
+ * particles at random: read from files, or generated on a lattice.
+ *
+ * Two formats:
+ *  - Text (extended) XYZ: the number of particles, a comment line with
+ *    Lattice="L 0 0 0 L 0 0 0 L" for a periodic world of size L, and a
+ *    line "<species> x y z" for every particle, with the coordinates in
+ *    [0, L). Other tools read these, and they are easy to write.
+ *  - Binary: a small header and the positions as raw doubles, in the byte
+ *    order of the machine that wrote it. Fast and exact for big worlds.
+ * The binary format gets recognised by its header, anything else is read
+ * as XYZ. */
+
+#include "system.h"
+
+/* Allocates the world and fills it with the particles in the given file.
+ * Text files don't say whether the world is two dimensional, so that
+ * comes from twoDimensional, the binary format has it in the header.
+ * Dies if the file can't be read. */
+void loadConfiguration(const char *filename, bool twoDimensional);
+
+/* Allocates a world of the given size with the particles on the named
+ * lattice: "fcc", "bcc" or "hcp" in 3D, "triangular" or "square" in 2D.
+ * The unit cells get stretched a bit along the axes to fit the cubic (or
+ * square) world, and when the lattice has more sites than there are
+ * particles, the empty sites are spread out evenly. Dies if the lattice
+ * doesn't exist in the given dimension, or if it can't hold the
+ * particles at this density without overlaps. */
+void latticeConfiguration(const char *lattice, int numParticles,
+				double worldSize, bool twoDimensional);
+
+/* True if the world came from loadConfiguration() or
+ * latticeConfiguration(). */
+bool configurationLoaded(void);
+
+/* Writes the particles of the world to the given file: as XYZ if the name
+ * ends in .xyz, in the binary format otherwise. Returns false on failure,
+ * with errno set. */
+bool saveConfiguration(const char *filename);
+
+#endif
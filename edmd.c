@@ -0,0 +1,486 @@
+#include "edmd.h"
+#include "monteCarlo.h"
+#include "world.h"
+#include "spgrid.h"
+#include "checkpoint.h"
+#include <string.h>
+#include <time.h>
+
+#define DIAMETER 1 /* Particles have diameter 1, mass 1, and kT = 1 */
+
+typedef struct {
+	double time;
+	int i; /* Particle the event belongs to */
+	int j; /* Other particle of a collision, or -1 - wall for a box 
+		  crossing, where wall is 2 * axis (+ 1 for the upper wall). */
+	int counterI; /* Collision counters of i and j at prediction time */
+	int counterJ;
+} Event;
+
+typedef struct {
+	EventDrivenConfig conf;
+	double time; /* Simulation time */
+	long collisions;
+	long crossings;
+	long staleEvents; /* Events that were out of date when popped */
+	double virialSum; /* Sum of r_ij . dv_i over all collisions */
+	clock_t cpuTime; /* Spent in ticks */
+} EventDrivenState;
+
+/* Per particle state. The velocity and the time are together because the 
+ * collision prediction always needs both. */
+typedef struct {
+	Vec3 vel;
+	double time; /* The position of the particle is at this time */
+} Motion;
+static Motion *motion;
+static int *counter; /* Number of collisions */
+static int (*cell)[3]; /* Box coordinates */
+
+/* Event calendar: a binary min heap on the event time */
+static Event *heap;
+static int heapSize = 0;
+static int heapCapacity = 0;
+
+
+static void heapPush(Event e)
+{
+	if (UNLIKELY(heapSize >= heapCapacity)) {
+		heapCapacity = MAX(2 * heapCapacity, 16);
+		heap = realloc(heap, heapCapacity * sizeof(*heap));
+		if (heap == NULL)
+			dieMem();
+	}
+
+	int k = heapSize++;
+	while (k > 0) {
+		int parent = (k - 1) / 2;
+		if (heap[parent].time <= e.time)
+			break;
+		heap[k] = heap[parent];
+		k = parent;
+	}
+	heap[k] = e;
+}
+
+static Event heapPop(void)
+{
+	assert(heapSize > 0);
+	Event top = heap[0];
+	Event last = heap[--heapSize];
+
+	int k = 0;
+	while (true) {
+		int child = 2 * k + 1;
+		if (child >= heapSize)
+			break;
+		if (child + 1 < heapSize
+				&& heap[child + 1].time < heap[child].time)
+			child++;
+		if (last.time <= heap[child].time)
+			break;
+		heap[k] = heap[child];
+		k = child;
+	}
+	heap[k] = last;
+	return top;
+}
+
+static __inline__ Vec3 positionAt(int i, double t)
+{
+	return add(world.particles[i].pos, scale(motion[i].vel,
+							t - motion[i].time));
+}
+
+static int cellBox(const int c[3])
+{
+	return spgrid.xOffset[c[0] + 1] + spgrid.yOffset[c[1] + 1]
+						+ spgrid.zOffset[c[2] + 1];
+}
+
+/* Bring the position of particle i (and its copy in the grid) up to 
+ * time t. */
+static void updateParticle(int i, double t)
+{
+	Particle *p = &world.particles[i];
+	p->pos = gridPeriodic(positionAt(i, t));
+	motion[i].time = t;
+	setParticleBox(p, cellBox(cell[i]));
+}
+
+/* Time at which particle i leaves its box, and through which wall. */
+static double crossingTime(int i, int *wall)
+{
+	int dims = world.twoDimensional ? 2 : 3;
+	Vec3 pv = world.particles[i].pos;
+	double pos[3] = {pv.x, pv.y, pv.z};
+	Vec3 vv = motion[i].vel;
+	double v[3] = {vv.x, vv.y, vv.z};
+	double gs[3] = {spgrid.gridSize.x, spgrid.gridSize.y,
+							spgrid.gridSize.z};
+	double bs = spgrid.boxSize;
+
+	double best = INFINITY;
+	*wall = -1;
+	for (int a = 0; a < dims; a++) {
+		if (v[a] == 0)
+			continue;
+		/* Position relative to the lower wall. This can be a rounding 
+		 * error outside of [0, bs], so wrap around the middle of the 
+		 * box instead of around the wall. */
+		double middle = -gs[a] / 2 + (cell[i][a] + 0.5) * bs;
+		double rel = _fastPeriodic(gs[a], pos[a] - middle) + bs / 2;
+		double dt;
+		int w;
+		if (v[a] > 0) {
+			dt = MAX(bs - rel, 0) / v[a];
+			w = 2 * a + 1;
+		} else {
+			dt = MAX(rel, 0) / -v[a];
+			w = 2 * a;
+		}
+		if (dt < best) {
+			best = dt;
+			*wall = w;
+		}
+	}
+	return motion[i].time + best;
+}
+
+/* Find the first event of particle i after time 'now', and schedule it. */
+static void predict(int i, double now)
+{
+	int wall;
+	double tEvent = MAX(crossingTime(i, &wall), now);
+	int partner = -1 - wall;
+	assert(wall >= 0);
+
+	Vec3 ri = positionAt(i, now);
+	Vec3 vi = motion[i].vel;
+	Vec3 gs = spgrid.gridSize;
+	const double *x = spgrid.slotX, *y = spgrid.slotY, *z = spgrid.slotZ;
+	double d2 = SQUARE(DIAMETER);
+
+	/* Anything we can hit before we leave our box is in one of the 
+	 * neighbouring boxes. */
+	int c[3] = {cell[i][0], cell[i][1], cell[i][2]};
+	for (int n = -1; n < spgrid.stencilSize; n++) {
+		int box;
+		if (n < 0) {
+			box = cellBox(c);
+		} else {
+			const int *o = spgrid.stencil[n];
+			int nc[3] = {c[0] + o[0], c[1] + o[1], c[2] + o[2]};
+			box = cellBox(nc);
+		}
+
+		int start = box << spgrid.boxCapacityShift;
+		int end = start + spgrid.boxCount[box];
+		for (int s = start; s < end; s++) {
+			int j = spgrid.slotParticle[s];
+			if (j == i)
+				continue;
+			/* The slots hold the positions at motion[j].time */
+			const Motion *mj = &motion[j];
+			double dtj = now - mj->time;
+			Vec3 r;
+			r.x = x[s] + mj->vel.x * dtj - ri.x;
+			r.y = y[s] + mj->vel.y * dtj - ri.y;
+			r.z = z[s] + mj->vel.z * dtj - ri.z;
+			r = fastPeriodic(gs, r);
+			Vec3 v = sub(mj->vel, vi);
+			double b = dot(r, v);
+			if (b >= 0)
+				continue; /* Moving apart */
+			double r2 = length2(r);
+			/* The collision comes after (r2 - d2) / (-2 b), so 
+			 * don't bother if that's already too late. */
+			if (r2 - d2 > -2 * b * (tEvent - now))
+				continue;
+			double v2 = length2(v);
+			double disc = SQUARE(b) - v2 * (r2 - d2);
+			if (disc < 0)
+				continue; /* Missing each other */
+			/* Stable form of (-b - sqrt(disc)) / v2. A pair that is 
+			 * a rounding error too close collides right away. */
+			double dt = 0;
+			if (r2 > d2)
+				dt = (r2 - d2) / (-b + sqrt(disc));
+			if (now + dt < tEvent) {
+				tEvent = now + dt;
+				partner = j;
+			}
+		}
+	}
+
+	Event e = {
+		.time = tEvent,
+		.i = i,
+		.j = partner,
+		.counterI = counter[i],
+		.counterJ = partner >= 0 ? counter[partner] : 0,
+	};
+	heapPush(e);
+}
+
+static void collide(EventDrivenState *eds, int i, int j, double t)
+{
+	updateParticle(i, t);
+	updateParticle(j, t);
+
+	Vec3 r = nearestImageVector(world.particles[i].pos,
+					world.particles[j].pos);
+	Vec3 v = sub(motion[j].vel, motion[i].vel);
+	double b = dot(r, v);
+	Vec3 dv = scale(r, b / length2(r));
+	motion[i].vel = add(motion[i].vel, dv);
+	motion[j].vel = sub(motion[j].vel, dv);
+
+	/* (r_i - r_j) . dv_i = -b */
+	eds->virialSum -= b;
+	eds->collisions++;
+
+	counter[i]++;
+	counter[j]++;
+	predict(i, t);
+	predict(j, t);
+}
+
+static void crossWall(EventDrivenState *eds, int i, int wall, double t)
+{
+	Particle *p = &world.particles[i];
+	p->pos = gridPeriodic(positionAt(i, t));
+	motion[i].time = t;
+
+	int a = wall / 2;
+	int nb[3] = {spgrid.nbx, spgrid.nby, spgrid.nbz};
+	int dir = (wall % 2) ? 1 : -1;
+	cell[i][a] = (cell[i][a] + dir + nb[a]) % nb[a];
+	setParticleBox(p, cellBox(cell[i]));
+	eds->crossings++;
+
+	/* The trajectory didn't change, so the events of others involving 
+	 * i are still fine. */
+	predict(i, t);
+}
+
+static void processEvent(EventDrivenState *eds, Event e)
+{
+	int i = e.i;
+	int j = e.j;
+
+	if (e.counterI != counter[i]) {
+		/* i got a newer event when its counter changed */
+		eds->staleEvents++;
+		return;
+	}
+	if (j >= 0 && e.counterJ != counter[j]) {
+		/* This was the only event of i */
+		eds->staleEvents++;
+		predict(i, e.time);
+		return;
+	}
+
+	if (j >= 0)
+		collide(eds, i, j, e.time);
+	else
+		crossWall(eds, i, -1 - j, e.time);
+}
+
+/* Maxwell-Boltzmann velocities at temperature 1 with zero total momentum */
+static void initVelocities(void)
+{
+	int n = world.numParticles;
+	int dims = world.twoDimensional ? 2 : 3;
+	Vec3 total = {0, 0, 0};
+	for (int i = 0; i < n; i++) {
+		Rng rng = rngStream(RNG_VELOCITIES, i, 0);
+		motion[i].vel = randNormVec(&rng, 1);
+		if (world.twoDimensional)
+			motion[i].vel.z = 0;
+		total = add(total, motion[i].vel);
+	}
+
+	Vec3 mean = scale(total, 1.0 / n);
+	double v2 = 0;
+	for (int i = 0; i < n; i++) {
+		motion[i].vel = sub(motion[i].vel, mean);
+		v2 += length2(motion[i].vel);
+	}
+
+	double factor = sqrt(dims * n / v2);
+	for (int i = 0; i < n; i++)
+		motion[i].vel = scale(motion[i].vel, factor);
+}
+
+/* Every particle is at the time of the state between ticks, so the 
+ * velocities are all we need on top of the positions. The event calendar 
+ * gets predicted again on a restart. */
+static void eventDrivenSave(FILE *f, void *data)
+{
+	EventDrivenState *eds = (EventDrivenState*) data;
+	checkpointWrite(f, &eds->time, sizeof(eds->time));
+	checkpointWrite(f, &eds->collisions, sizeof(eds->collisions));
+	checkpointWrite(f, &eds->crossings, sizeof(eds->crossings));
+	checkpointWrite(f, &eds->staleEvents, sizeof(eds->staleEvents));
+	checkpointWrite(f, &eds->virialSum, sizeof(eds->virialSum));
+	for (int i = 0; i < world.numParticles; i++)
+		checkpointWrite(f, &motion[i].vel, sizeof(motion[i].vel));
+}
+static bool eventDrivenLoad(FILE *f, void *data)
+{
+	EventDrivenState *eds = (EventDrivenState*) data;
+	if (!checkpointRead(f, &eds->time, sizeof(eds->time))
+			|| !checkpointRead(f, &eds->collisions,
+						sizeof(eds->collisions))
+			|| !checkpointRead(f, &eds->crossings,
+						sizeof(eds->crossings))
+			|| !checkpointRead(f, &eds->staleEvents,
+						sizeof(eds->staleEvents))
+			|| !checkpointRead(f, &eds->virialSum,
+						sizeof(eds->virialSum)))
+		return false;
+	for (int i = 0; i < world.numParticles; i++) {
+		if (!checkpointRead(f, &motion[i].vel, sizeof(motion[i].vel)))
+			return false;
+		motion[i].time = eds->time;
+		counter[i] = 0;
+	}
+
+	heapSize = 0;
+	for (int i = 0; i < world.numParticles; i++)
+		predict(i, eds->time);
+	return true;
+}
+
+static void *eventDrivenTaskStart(void *initialData)
+{
+	assert(initialData != NULL);
+	EventDrivenConfig *edc = (EventDrivenConfig*) initialData;
+
+	allocFilledGrid(edc->boxSize);
+	/* Particles in neighbouring boxes are less than two boxes apart. 
+	 * With at least 4 boxes, that's less than half the grid, so the 
+	 * nearest image in predict() is the one that can collide. */
+	if (spgrid.nbx < 4 || spgrid.nby < 4
+			|| (!world.twoDimensional && spgrid.nbz < 4))
+		die("Event driven dynamics needs at least 4 boxes per "
+							"dimension!\n");
+
+	int n = world.numParticles;
+	motion = calloc(n, sizeof(*motion));
+	counter = calloc(n, sizeof(*counter));
+	cell = malloc(n * sizeof(*cell));
+	if (motion == NULL || counter == NULL || cell == NULL)
+		dieMem();
+
+	initVelocities();
+
+	/* Take over the boxes from the grid, so they're ours from now on */
+	Vec3 gs = spgrid.gridSize;
+	for (int i = 0; i < n; i++) {
+		Particle *p = &world.particles[i];
+		cell[i][0] = (p->pos.x + gs.x/2) / spgrid.boxSize;
+		cell[i][1] = (p->pos.y + gs.y/2) / spgrid.boxSize;
+		cell[i][2] = (p->pos.z + gs.z/2) / spgrid.boxSize;
+		setParticleBox(p, cellBox(cell[i]));
+	}
+
+	for (int i = 0; i < n; i++)
+		predict(i, 0);
+
+	EventDrivenState *state = calloc(1, sizeof(*state));
+	if (state == NULL)
+		dieMem();
+	state->conf = *edc;
+	addCheckpointSection("eventDriven", &eventDrivenSave,
+						&eventDrivenLoad, state);
+
+	free(edc);
+	return state;
+}
+
+/* Advance the simulation by one time slice */
+static TaskSignal eventDrivenTaskTick(void *state)
+{
+	assert(state != NULL);
+	EventDrivenState *eds = (EventDrivenState*) state;
+	clock_t startClock = clock();
+
+	double end = eds->time + eds->conf.timeSlice;
+	while (heapSize > 0 && heap[0].time < end)
+		processEvent(eds, heapPop());
+
+	/* Bring everybody up to date for the samplers and the renderer. 
+	 * This doesn't change any trajectory, so the events stay valid. */
+	for (int i = 0; i < world.numParticles; i++)
+		updateParticle(i, end);
+	eds->time = end;
+
+	eds->cpuTime += clock() - startClock;
+	return TASK_OK;
+}
+
+static void eventDrivenTaskStop(void *state)
+{
+	EventDrivenState *eds = (EventDrivenState*) state;
+	int n = world.numParticles;
+	int dims = world.twoDimensional ? 2 : 3;
+	removeCheckpointSection("eventDriven");
+
+	double seconds = ((double) eds->cpuTime) / CLOCKS_PER_SEC;
+	printf("Collisions: %ld (%f per particle per unit time",
+			eds->collisions,
+			2.0 * eds->collisions / (n * eds->time));
+	/* A short run can take less than a tick of the CPU clock */
+	if (seconds > 0)
+		printf(", %.0f per CPU second", eds->collisions / seconds);
+	printf(")\n");
+	printf("Box crossings: %ld, stale events: %ld\n",
+			eds->crossings, eds->staleEvents);
+
+	if (eds->time > 0) {
+		double v2 = 0;
+		for (int i = 0; i < n; i++)
+			v2 += length2(motion[i].vel);
+		double kT = v2 / (dims * n);
+		double betaPOverRho = 1 + eds->virialSum
+					/ (dims * n * kT * eds->time);
+		printf("Pressure: beta P / rho = %f (kT = %f)\n",
+							betaPOverRho, kT);
+	}
+
+	free(motion);
+	free(counter);
+	free(cell);
+	free(heap);
+	motion = NULL;
+	counter = NULL;
+	cell = NULL;
+	heap = NULL;
+	heapSize = heapCapacity = 0;
+
+	freeGrid();
+	free(eds);
+}
+
+
+Task makeEventDrivenTask(EventDrivenConfig *edc)
+{
+	if (edc->boxSize <= 0)
+		die("Box size is zero (or negative)!\n");
+
+	if (edc->timeSlice <= 0)
+		die("Time slice is zero (or negative)!\n");
+
+	EventDrivenConfig *edcCopy = malloc(sizeof(*edcCopy));
+	memcpy(edcCopy, edc, sizeof(*edcCopy));
+
+	Task ret = {
+		.initialData = edcCopy,
+		.start = &eventDrivenTaskStart,
+		.tick  = &eventDrivenTaskTick,
+		.stop  = &eventDrivenTaskStop,
+	};
+	return ret;
+}
@@ -0,0 +1,29 @@
+#ifndef _EDMD_H_
+#define _EDMD_H_
+
+/* Event driven molecular dynamics of hard spheres.
+ *
+ * Particles fly in straight lines between events. There are two kinds of 
+ * events: two particles colliding (elastically), and a particle crossing 
+ * the wall of its spgrid box. The box crossings keep the particles in the 
+ * correct boxes, so a particle only has to look for collisions with the 
+ * particles in the neighbouring boxes.
+ * Every particle has exactly one pending event in a binary heap: the 
+ * earliest one it can find. Events aren't removed from the heap when they 
+ * become invalid. Instead, every particle counts its collisions, and an 
+ * event that comes out of the heap is dropped if the counters it was 
+ * predicted with are out of date.
+ * Positions are only brought up to date when the velocity of a particle 
+ * changes (or it crosses a box wall), and at the end of every tick. */
+
+#include "system.h"
+
+typedef struct
+{
+	double boxSize; /* Particles have diameter == 1. */
+	double timeSlice; /* Simulation time to advance every tick */
+} EventDrivenConfig;
+
+Task makeEventDrivenTask(EventDrivenConfig *edc);
+
+#endif
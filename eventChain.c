@@ -0,0 +1,207 @@
+#include "eventChain.h"
+#include "monteCarlo.h"
+#include "world.h"
+#include "spgrid.h"
+#include "checkpoint.h"
+#include <string.h>
+
+#define DIAMETER 1 /* Particles have diameter 1 */
+
+typedef struct {
+	EventChainConfig conf;
+	double maxStep; /* Longest single displacement collisionAlongAxis() 
+			   can handle */
+	long sweeps;
+	long chains; /* Number of chains done */
+	long events; /* Number of displacements that ended in a collision 
+			or at the end of a chain */
+	double liftSum; /* Sum of the lift distances along the chain axis */
+	/* For the error on the pressure: sum of the estimates of beta P / rho 
+	 * of every sweep, and of their squares. */
+	double sweepPressureSum;
+	double sweepPressureSum2;
+} EventChainState;
+
+static void eventChainSave(FILE *f, void *data)
+{
+	EventChainState *ecs = (EventChainState*) data;
+	checkpointWrite(f, &ecs->sweeps, sizeof(ecs->sweeps));
+	checkpointWrite(f, &ecs->chains, sizeof(ecs->chains));
+	checkpointWrite(f, &ecs->events, sizeof(ecs->events));
+	checkpointWrite(f, &ecs->liftSum, sizeof(ecs->liftSum));
+	checkpointWrite(f, &ecs->sweepPressureSum,
+					sizeof(ecs->sweepPressureSum));
+	checkpointWrite(f, &ecs->sweepPressureSum2,
+					sizeof(ecs->sweepPressureSum2));
+}
+static bool eventChainLoad(FILE *f, void *data)
+{
+	EventChainState *ecs = (EventChainState*) data;
+	return checkpointRead(f, &ecs->sweeps, sizeof(ecs->sweeps))
+		&& checkpointRead(f, &ecs->chains, sizeof(ecs->chains))
+		&& checkpointRead(f, &ecs->events, sizeof(ecs->events))
+		&& checkpointRead(f, &ecs->liftSum, sizeof(ecs->liftSum))
+		&& checkpointRead(f, &ecs->sweepPressureSum,
+					sizeof(ecs->sweepPressureSum))
+		&& checkpointRead(f, &ecs->sweepPressureSum2,
+					sizeof(ecs->sweepPressureSum2));
+}
+
+static void *eventChainTaskStart(void *initialData)
+{
+	assert(initialData != NULL);
+	EventChainConfig *ecc = (EventChainConfig*) initialData;
+
+	allocFilledGrid(ecc->boxSize);
+
+	/* Keep the ray queries within their box columns and away from 
+	 * ambiguous nearest images, see collisionAlongAxis(). */
+	double minGridSize = MIN(spgrid.gridSize.x, spgrid.gridSize.y);
+	if (!world.twoDimensional)
+		minGridSize = MIN(minGridSize, spgrid.gridSize.z);
+	double maxStep = MIN(spgrid.boxSize, 0.99 * minGridSize / 2 - DIAMETER);
+	if (maxStep <= 0)
+		die("World too small for event chains!\n");
+
+	EventChainState *state = calloc(1, sizeof(*state));
+	if (state == NULL)
+		dieMem();
+	state->conf = *ecc;
+	state->maxStep = maxStep;
+	addCheckpointSection("eventChain", &eventChainSave, &eventChainLoad,
+								state);
+
+	free(ecc);
+	return state;
+}
+
+static void moveAlongAxis(Particle *p, int axis, double dist)
+{
+	switch (axis) {
+	case 0: p->pos.x += dist; break;
+	case 1: p->pos.y += dist; break;
+	case 2: p->pos.z += dist; break;
+	default: assert(false);
+	}
+	reboxParticle(p);
+}
+
+static double axisComponent(Vec3 v, int axis)
+{
+	switch (axis) {
+	case 0: return v.x;
+	case 1: return v.y;
+	case 2: return v.z;
+	default: assert(false);
+	}
+	return 0;
+}
+
+/* Run a single chain. Returns the sum of its lift distances. */
+static double eventChain(EventChainState *ecs)
+{
+	Rng rng = rngStream(RNG_EVENT_CHAIN, 0, ecs->chains);
+	int axis = randIndex(&rng, world.twoDimensional ? 2 : 3);
+	Particle *p = &world.particles[randIndex(&rng, world.numParticles)];
+	double remaining = ecs->conf.chainLength;
+	double lifts = 0;
+
+	while (remaining > 0) {
+		double step = MIN(remaining, ecs->maxStep);
+		Particle *hit;
+		double dist = collisionAlongAxis(p, axis, DIAMETER, step, &hit);
+
+		moveAlongAxis(p, axis, dist);
+		remaining -= dist;
+		if (hit == NULL) {
+			/* Just the end of the step, not an event */
+			if (remaining <= 0)
+				ecs->events++;
+			continue;
+		}
+
+		lifts += axisComponent(nearestImageVector(p->pos, hit->pos),
+									axis);
+		ecs->events++;
+		p = hit;
+	}
+
+	ecs->chains++;
+	return lifts;
+}
+
+/* Run chains until there have been (about) as many events as particles. */
+static TaskSignal eventChainTaskTick(void *state)
+{
+	assert(state != NULL);
+	EventChainState *ecs = (EventChainState*) state;
+
+	long start = ecs->events;
+	long chains = 0;
+	double lifts = 0;
+	while (ecs->events - start < world.numParticles) {
+		lifts += eventChain(ecs);
+		chains++;
+	}
+
+	ecs->liftSum += lifts;
+	double pressure = 1 + lifts / (chains * ecs->conf.chainLength);
+	ecs->sweepPressureSum += pressure;
+	ecs->sweepPressureSum2 += SQUARE(pressure);
+	ecs->sweeps++;
+
+	return TASK_OK;
+}
+
+static void eventChainTaskStop(void *state)
+{
+	EventChainState *ecs = (EventChainState*) state;
+	removeCheckpointSection("eventChain");
+
+	printf("Event chains: %ld chains, %f events per chain\n",
+			ecs->chains, ((double) ecs->events) / ecs->chains);
+
+	if (ecs->sweeps > 0) {
+		double volume = spgrid.gridSize.x * spgrid.gridSize.y;
+		if (!world.twoDimensional)
+			volume *= spgrid.gridSize.z;
+		double rho = world.numParticles / volume;
+
+		double betaPOverRho = 1 + ecs->liftSum
+				/ (ecs->chains * ecs->conf.chainLength);
+		/* Naive error from the spread of the sweep estimates, which 
+		 * ignores the correlation between sweeps. */
+		long n = ecs->sweeps;
+		double mean = ecs->sweepPressureSum / n;
+		double var = ecs->sweepPressureSum2 / n - SQUARE(mean);
+		double err = n > 1 ? sqrt(MAX(var, 0) / (n - 1)) : 0;
+		printf("Pressure: beta P / rho = %f +- %f, "
+				"beta P sigma^%d = %f\n", betaPOverRho, err,
+				world.twoDimensional ? 2 : 3,
+				rho * betaPOverRho);
+	}
+
+	freeGrid();
+	free(ecs);
+}
+
+
+Task makeEventChainTask(EventChainConfig *ecc)
+{
+	if (ecc->boxSize <= 0)
+		die("Box size is zero (or negative)!\n");
+
+	if (ecc->chainLength <= 0)
+		die("Chain length is zero (or negative)!\n");
+
+	EventChainConfig *eccCopy = malloc(sizeof(*eccCopy));
+	memcpy(eccCopy, ecc, sizeof(*eccCopy));
+
+	Task ret = {
+		.initialData = eccCopy,
+		.start = &eventChainTaskStart,
+		.tick  = &eventChainTaskTick,
+		.stop  = &eventChainTaskStop,
+	};
+	return ret;
+}
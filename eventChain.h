@@ -0,0 +1,28 @@
+#ifndef _EVENTCHAIN_H_
+#define _EVENTCHAIN_H_
+
+/* Event-chain Monte Carlo for hard spheres (Bernard, Krauth & Wilson).
+ *
+ * Instead of trying small random displacements, a chain picks a random 
+ * particle and an axis, and slides the particle along that axis until it 
+ * touches another one. That one then continues in the same direction with 
+ * the remaining length, and so on, until the total displacement of the 
+ * chain equals the chain length. All moves get accepted, and dense 
+ * systems decorrelate a lot faster than with the local moves of 
+ * monteCarlo.c.
+ * As a bonus, the pressure follows from the chain statistics:
+ *   beta P / rho = 1 + < sum of the lift distances along the axis > / l
+ * where a lift distance is the distance between the centres of the 
+ * touching particles that pass on the chain, and l the chain length. */
+
+#include "system.h"
+
+typedef struct
+{
+	double boxSize; /* Particles have diameter == 1. */
+	double chainLength; /* Total displacement of every chain */
+} EventChainConfig;
+
+Task makeEventChainTask(EventChainConfig *ecc);
+
+#endif
@@ -7,22 +7,39 @@
 #include <sys/resource.h>
 #include <string.h>
 #include <errno.h>
+#include <getopt.h>
 #include "system.h"
 #include "world.h"
 #include "render.h"
 #include "math.h"
 #include "monteCarlo.h"
+#include "eventChain.h"
+#include "edmd.h"
 #include "measure.h"
 #include "samplers.h"
+#include "checkpoint.h"
+#include "configuration.h"
 
 /* Defaults */
 #define DEF_MEASURE_FILE 		"data"
 #define DEF_RENDER_FRAMERATE 		30.0
 #define DEF_PAIR_CORRELATION_BINS 	1000
+#define DEF_PAIR_CORRELATION_MAX_R 	5.0
+#define DEF_MSD_BLOCK_LENGTH 		16
+#define DEF_MSD_COARSENING 		2
 #define DEF_DELTA		 	1
+#define DEF_TUNE_WINDOW			10
 #define RADIUS		 		0.5
 #define DISK_AREA 			(M_PI * SQUARE(RADIUS))
 #define SPHERE_VOLUME 			(4.0/3.0*M_PI * CUBE(RADIUS))
+/* Densities where -l compress inserts the particles at random, before 
+ * growing them to the requested one */
+#define COMPRESSION_START_3D		0.3
+#define COMPRESSION_START_2D		0.5
+
+/* Long options without a short version */
+#define OPT_RESTART			256
+#define OPT_SEED			257
 
 
 /* Static global configuration variables */
@@ -34,6 +51,10 @@ static RenderConf renderConf = {
 static MonteCarloConfig monteCarloConfig = {
 	.boxSize = 1, /* Particles have diameter 1 */
 	.delta = DEF_DELTA,
+	.numThreads = 1,
+	.targetAcceptance = 0, /* Keep delta fixed by default */
+	.tuneWindow = DEF_TUNE_WINDOW,
+	.sweepOrder = SWEEP_RANDOM,
 };
 static MeasurementConf measConf = {
 	.measureTime = -1, /* Go on indefinitely. */
@@ -52,24 +73,111 @@ static double packingDensity;
 static int numParticles;
 static int numBoxes = -1; /* guard */
 static int pairCorrelationBins = DEF_PAIR_CORRELATION_BINS;
+static double pairCorrelationMaxR = DEF_PAIR_CORRELATION_MAX_R;
+static int samplerThreads = 1;
+static bool livePairCorrelation = false;
+/* Only g(r) gets sampled when none of the others are asked for */
+static bool samplePairCorrelation = false;
+static double structureFactorMaxK = -1;
+static bool sampleMSD = false;
+static double coordinationCutoff = -1;
+static double chainLength = -1; /* Use Metropolis moves by default */
+static double timeSlice = -1; /* Idem */
+static CheckpointConfig checkpointConf = {
+	.filename = NULL, /* Don't write checkpoints by default. */
+	.interval = -1, /* Only on SIGTERM. */
+};
+static const char *restartFile = NULL;
+static const char *configurationFile = NULL;
+static const char *finalConfigurationFile = NULL;
+static const char *layout = NULL; /* Random insertion by default */
 
 static void printUsage(void)
 {
 	printf("Usage: main <num particles> <packing density> [flags]\n");
+	printf("       main -i <configuration> [flags]\n");
+	printf("       main --restart <checkpoint> [flags]\n");
 	printf("\n");
 	printf("Flags:\n");
 	printf(" -2        2D instead of 3D\n");
 	printf(" -d <flt>  Delta to use in Monte Carlo algorithm\n");
 	printf("             default: %f\n", monteCarloConfig.delta);
+	printf(" -a <flt>  tune delta toward this Acceptance ratio during\n");
+	printf("           the relaxation (-w), and keep it fixed after\n");
+	printf("           that. -d is where it starts (and the upper\n");
+	printf("           bound with -L)\n");
+	printf("             default: don't tune\n");
+	printf(" -A <num>  sweeps between two Adjustments of delta\n");
+	printf("             default: %d\n", DEF_TUNE_WINDOW);
+	printf(" -w <num>  relax (Wait) this many iterations before\n");
+	printf("           measuring\n");
+	printf("             default: don't wait\n");
 	printf(" -I <num>  sample Interval\n");
 	printf("             default: don't sample\n");
 	printf(" -P <num>  measurement Period\n");
 	printf("             default: sample indefinitely\n");
 	printf(" -D <path> Data file for the measurement\n");
 	printf("             default: %s\n", DEF_MEASURE_FILE);
+	printf(" -W        Write the data file from a separate thread\n");
+	printf(" -F        Fsync the data file when the measurement stops\n");
 	printf(" -B <num>  number of Bins for the pair correlation\n");
 	printf("             default: %d\n", pairCorrelationBins);
+	printf(" -g <flt>  maximal distance for the pair correlation g(r)\n");
+	printf("             default: %f, or half the world size if that\n"
+	       "             is smaller\n", pairCorrelationMaxR);
+	printf(" -G        sample the pair correlation g(r). This is the\n");
+	printf("           default when no other sampler is given\n");
+	printf(" -S <flt>  sample the Structure factor S(k) up to the given\n");
+	printf("           |k|\n");
+	printf(" -m        sample the Mean squared displacement\n");
+	printf(" -z <flt>  sample the coordination numbers (Z) with the\n");
+	printf("           given neighbour cutoff\n");
+	printf(" -T <num>  number of Threads for the pairs of the samplers\n");
+	printf("           and the structure factor\n");
+	printf("             default: %d\n", samplerThreads);
+	printf(" -L        keep a Live pair histogram during the Monte Carlo\n");
+	printf("           moves instead of binning all pairs per sample\n");
+	printf("             default: bin all pairs per sample\n");
 	printf(" -b <num>  number of Boxes per dimension\n");
+	printf(" -v <flt>  use Verlet lists with the given skin\n");
+	printf("             default: only use cell lists\n");
+	printf(" -R <num>  Reorder the particles in memory along a space\n");
+	printf("           filling curve, checking every <num> sweeps\n");
+	printf("             default: never\n");
+	printf(" -s <str>  order of the particles in a single threaded\n");
+	printf("           Sweep: random (N random picks), cells (box by\n");
+	printf("           box) or storage (blocks of memory, use with -R)\n");
+	printf("             default: random\n");
+	printf(" -t <num>  number of Threads for the Monte Carlo sweeps\n");
+	printf("             default: 1\n");
+	printf(" -e <flt>  use Event-chain Monte Carlo with the given chain\n");
+	printf("           length instead of single particle moves\n");
+	printf("             default: single particle moves\n");
+	printf(" -M <flt>  event driven Molecular dynamics instead of Monte\n");
+	printf("           Carlo, advancing the given time per iteration\n");
+	printf("             default: Monte Carlo\n");
+	printf(" -i <path> start from the Input configuration in the given\n");
+	printf("           file (XYZ or binary) instead of inserting\n");
+	printf("           <num particles> at random at <packing density>\n");
+	printf(" -l <str>  initial Layout of the particles: random,\n");
+	printf("           compress (random at a low density, then\n");
+	printf("           grown), or the lattice fcc, bcc or hcp (3D)\n");
+	printf("           or triangular or square (2D)\n");
+	printf("             default: random\n");
+	printf(" -o <path> write the final configuration to the given file\n");
+	printf("           (XYZ if it ends in .xyz, binary otherwise)\n");
+	printf(" -c <path> write a Checkpoint to this file when we get a\n");
+	printf("           SIGTERM (which also stops the simulation)\n");
+	printf(" -k <num>  also write the checkpoint every <num> iterations\n");
+	printf("             default: only on SIGTERM\n");
+	printf(" --restart <path>\n");
+	printf("           continue from the given checkpoint, instead of\n");
+	printf("           starting <num particles> at <packing density>.\n");
+	printf("           Give the same flags as the original run.\n");
+	printf(" --seed <num>\n");
+	printf("           seed of the random numbers. The same seed gives\n");
+	printf("           the same run, with any number of threads (-t)\n");
+	printf("             default: from the time and the PID\n");
 	printf(" -r        Render\n");
 	printf(" -f <flt>  desired Framerate when rendering.\n");
 	printf("             default: %f)\n", DEF_RENDER_FRAMERATE);
@@ -80,7 +188,16 @@ static void parseArguments(int argc, char **argv)
 {
 	int c;
 
-	while ((c = getopt(argc, argv, ":2d:I:P:D:rf:B:b:")) != -1)
+	static const struct option longOptions[] = {
+		{"restart", required_argument, NULL, OPT_RESTART},
+		{"seed", required_argument, NULL, OPT_SEED},
+		{NULL, 0, NULL, 0},
+	};
+
+	while ((c = getopt_long(argc, argv,
+			":2d:I:P:D:WFrf:B:g:GS:mz:T:Lb:v:R:t:e:M:c:k:i:o:l:"
+			"a:A:w:s:",
+			longOptions, NULL)) != -1)
 	{
 		switch (c)
 		{
@@ -92,6 +209,32 @@ static void parseArguments(int argc, char **argv)
 			if (monteCarloConfig.delta <= 0)
 				die("Invalid Monte Carlo delta %s\n", optarg);
 			break;
+		case 'a':
+			monteCarloConfig.targetAcceptance = atof(optarg);
+			if (monteCarloConfig.targetAcceptance <= 0
+				|| monteCarloConfig.targetAcceptance >= 1)
+				die("Invalid acceptance ratio %s\n", optarg);
+			break;
+		case 'A':
+			monteCarloConfig.tuneWindow = atoi(optarg);
+			if (monteCarloConfig.tuneWindow <= 0)
+				die("Invalid tuning window %s\n", optarg);
+			break;
+		case 's':
+			if (strcmp(optarg, "random") == 0)
+				monteCarloConfig.sweepOrder = SWEEP_RANDOM;
+			else if (strcmp(optarg, "cells") == 0)
+				monteCarloConfig.sweepOrder = SWEEP_CELLS;
+			else if (strcmp(optarg, "storage") == 0)
+				monteCarloConfig.sweepOrder = SWEEP_STORAGE;
+			else
+				die("Unknown sweep order %s\n", optarg);
+			break;
+		case 'w':
+			measConf.measureWait = atol(optarg);
+			if (measConf.measureWait < 0)
+				die("Invalid relaxation time %s\n", optarg);
+			break;
 		case 'I':
 			measConf.measureInterval = atoi(optarg);
 			if (measConf.measureInterval <= 0)
@@ -105,6 +248,12 @@ static void parseArguments(int argc, char **argv)
 		case 'D':
 			measConf.measureFile = optarg;
 			break;
+		case 'W':
+			measConf.asyncWriter = true;
+			break;
+		case 'F':
+			measConf.syncFile = true;
+			break;
 		case 'f':
 			renderConf.framerate = atof(optarg);
 			if (renderConf.framerate < 0)
@@ -118,13 +267,96 @@ static void parseArguments(int argc, char **argv)
 			if (pairCorrelationBins <= 0)
 				die("Invalid number of pair correlation bins %s\n", optarg);
 			break;
+		case 'g':
+			pairCorrelationMaxR = atof(optarg);
+			if (pairCorrelationMaxR <= 0)
+				die("Invalid pair correlation distance %s\n",
+									optarg);
+			break;
+		case 'G':
+			samplePairCorrelation = true;
+			break;
+		case 'S':
+			structureFactorMaxK = atof(optarg);
+			if (structureFactorMaxK <= 0)
+				die("Invalid structure factor range %s\n",
+									optarg);
+			break;
+		case 'm':
+			sampleMSD = true;
+			break;
+		case 'z':
+			coordinationCutoff = atof(optarg);
+			if (coordinationCutoff <= 0)
+				die("Invalid coordination cutoff %s\n",
+									optarg);
+			break;
+		case 'T':
+			samplerThreads = atoi(optarg);
+			if (samplerThreads <= 0)
+				die("Invalid number of threads %s\n", optarg);
+			break;
+		case 'L':
+			livePairCorrelation = true;
+			break;
 		case 'b':
 			numBoxes = atoi(optarg);
 			break;
+		case 'v':
+			monteCarloConfig.verletSkin = atof(optarg);
+			if (monteCarloConfig.verletSkin <= 0)
+				die("Invalid Verlet skin %s\n", optarg);
+			break;
+		case 'R':
+			monteCarloConfig.reorderInterval = atoi(optarg);
+			if (monteCarloConfig.reorderInterval <= 0)
+				die("Invalid reorder interval %s\n", optarg);
+			break;
+		case 't':
+			monteCarloConfig.numThreads = atoi(optarg);
+			if (monteCarloConfig.numThreads <= 0)
+				die("Invalid number of threads %s\n", optarg);
+			break;
+		case 'e':
+			chainLength = atof(optarg);
+			if (chainLength <= 0)
+				die("Invalid chain length %s\n", optarg);
+			break;
+		case 'M':
+			timeSlice = atof(optarg);
+			if (timeSlice <= 0)
+				die("Invalid time slice %s\n", optarg);
+			break;
 		case 'h':
 			printUsage();
 			exit(0);
 			break;
+		case 'c':
+			checkpointConf.filename = optarg;
+			break;
+		case 'k':
+			checkpointConf.interval = atol(optarg);
+			if (checkpointConf.interval <= 0)
+				die("Invalid checkpoint interval %s\n",
+									optarg);
+			break;
+		case 'i':
+			configurationFile = optarg;
+			break;
+		case 'o':
+			finalConfigurationFile = optarg;
+			break;
+		case 'l':
+			layout = optarg;
+			if (strcmp(layout, "random") == 0)
+				layout = NULL;
+			break;
+		case OPT_RESTART:
+			restartFile = optarg;
+			break;
+		case OPT_SEED:
+			seedRandomWith(strtoull(optarg, NULL, 0));
+			break;
 		case ':':
 			printUsage();
 			die("Option -%c requires an argument\n", optopt);
@@ -142,24 +374,73 @@ static void parseArguments(int argc, char **argv)
 	argc -= optind;
 	argv += optind;
 
-	if (argc < 2) {
+	/* The checkpoint or configuration has the particles and the world */
+	bool worldFromFile = restartFile != NULL || configurationFile != NULL;
+	int numRequired = (worldFromFile ? 0 : 2);
+	if (argc < numRequired) {
 		printUsage();
 		die("\nNot enough required arguments!\n");
 	}
 
 	errno = 0;
-	numParticles = strtol(argv[0], NULL, 10);
-	packingDensity = strtod(argv[1], NULL);
+	if (!worldFromFile) {
+		numParticles = strtol(argv[0], NULL, 10);
+		packingDensity = strtod(argv[1], NULL);
+	}
 	if (errno != 0 || numParticles < 0 || packingDensity < 0) {
 		printUsage();
 		die("\nError parsing the required options, or they don't "
 				"make sense!\n");
 	}
 
-	if (argc > 2) {
+	if (argc > numRequired) {
 		printUsage();
 		die("\nFound unrecognised garbage at the command line!\n");
 	}
+
+	if (structureFactorMaxK <= 0 && !sampleMSD && coordinationCutoff <= 0)
+		samplePairCorrelation = true;
+	if (livePairCorrelation && !samplePairCorrelation)
+		die("The live pair histogram is only for the pair "
+							"correlation!\n");
+	if (restartFile != NULL && configurationFile != NULL)
+		die("Can't restart from a checkpoint and a configuration at "
+								"once!\n");
+	if (worldFromFile && layout != NULL)
+		die("The layout only applies to new worlds, not to ones from "
+							"a file!\n");
+	if (chainLength > 0 && timeSlice > 0)
+		die("Can't do event chains and molecular dynamics at once!\n");
+	if ((chainLength > 0 || timeSlice > 0)
+			&& (monteCarloConfig.numThreads > 1
+				|| monteCarloConfig.verletSkin > 0
+				|| monteCarloConfig.reorderInterval > 0
+				|| monteCarloConfig.targetAcceptance > 0
+				|| monteCarloConfig.sweepOrder != SWEEP_RANDOM
+				|| livePairCorrelation))
+		die("Flags -t, -v, -R, -a, -s and -L only apply to single "
+							"particle moves!\n");
+	if (monteCarloConfig.targetAcceptance > 0 && measConf.measureWait <= 0)
+		die("Tuning delta needs a relaxation time (-w)!\n");
+	monteCarloConfig.tuneSweeps = measConf.measureWait;
+}
+
+/* Fills the world with the particles as the layout says */
+static void layOutWorld(double worldSize)
+{
+	if (layout != NULL && strcmp(layout, "compress") == 0) {
+		if (!allocWorld(numParticles, worldSize, twoDimensional))
+			dieMem();
+		compressWorld(twoDimensional ? COMPRESSION_START_2D
+		                             : COMPRESSION_START_3D,
+				monteCarloConfig.boxSize,
+				monteCarloConfig.delta);
+	} else if (layout != NULL) {
+		latticeConfiguration(layout, numParticles, worldSize,
+							twoDimensional);
+	} else {
+		allocWorld(numParticles, worldSize, twoDimensional);
+	}
 }
 
 int main(int argc, char **argv)
@@ -169,14 +450,25 @@ int main(int argc, char **argv)
 	parseArguments(argc, argv);
 
 	double worldSize;
-	if (twoDimensional) {
+	if (restartFile != NULL || configurationFile != NULL) {
+		if (restartFile != NULL)
+			loadCheckpoint(restartFile);
+		else
+			loadConfiguration(configurationFile, twoDimensional);
+		numParticles = world.numParticles;
+		worldSize = world.worldSize;
+		twoDimensional = world.twoDimensional;
+	} else if (twoDimensional) {
 		double area = numParticles * DISK_AREA / packingDensity;
 		worldSize = sqrt(area);
 	} else {
 		double volume = numParticles * SPHERE_VOLUME / packingDensity;
 		worldSize = cbrt(volume);
 	}
-	
+
+	/* After loadCheckpoint(), which brings its own seed */
+	printf("Random seed %llu\n", (unsigned long long) randomSeed());
+
 	if (numBoxes > 0) {
 		/* explicit number of boxes requested. */
 		monteCarloConfig.boxSize = worldSize / numBoxes;
@@ -186,35 +478,98 @@ int main(int argc, char **argv)
 					monteCarloConfig.boxSize, 2*RADIUS);
 	}
 
-	allocWorld(numParticles, worldSize, twoDimensional);
+	if (restartFile == NULL && configurationFile == NULL)
+		layOutWorld(worldSize);
+
+	double pairCorrelationRange = MIN(pairCorrelationMaxR, worldSize / 2);
+	if (livePairCorrelation) {
+		monteCarloConfig.pairHistogramBins = pairCorrelationBins;
+		monteCarloConfig.pairHistogramMaxR = pairCorrelationRange;
+	}
 
 	/* Render task */
 	Task renderTask = makeRenderTask(&renderConf);
 
-	/* Monte Carlo task */
-	Task monteCarloTask = makeMonteCarloTask(&monteCarloConfig);
+	/* Simulation task */
+	Task simulationTask;
+	if (chainLength > 0) {
+		EventChainConfig eventChainConfig = {
+			.boxSize = monteCarloConfig.boxSize,
+			.chainLength = chainLength,
+		};
+		simulationTask = makeEventChainTask(&eventChainConfig);
+	} else if (timeSlice > 0) {
+		EventDrivenConfig eventDrivenConfig = {
+			.boxSize = monteCarloConfig.boxSize,
+			.timeSlice = timeSlice,
+		};
+		simulationTask = makeEventDrivenTask(&eventDrivenConfig);
+	} else {
+		simulationTask = makeMonteCarloTask(&monteCarloConfig);
+	}
 
 	/* Measurement task */
 	PairCorrelationConfig pairCorrelationConf = {
 		.numBins = pairCorrelationBins,
-		.maxR = worldSize / 2,
+		.maxR = pairCorrelationRange,
+		.live = livePairCorrelation,
 		.rho = numParticles / (twoDimensional ? SQUARE(worldSize)
 		                                      : CUBE(worldSize)),
 	};
+	StructureFactorConfig structureFactorConf = {
+		.maxK = structureFactorMaxK,
+		.numThreads = samplerThreads,
+	};
+	MSDConfig msdConf = {
+		.blockLength = DEF_MSD_BLOCK_LENGTH,
+		.coarsening = DEF_MSD_COARSENING,
+	};
+	CoordinationConfig coordinationConf = {
+		.cutoff = coordinationCutoff,
+	};
 	Measurement measurement;
 	measurement.measConf = measConf;
-	measurement.sampler = pairCorrelationSampler(&pairCorrelationConf);
+	measurement.measConf.pairThreads = samplerThreads;
+	int n = 0;
+	if (samplePairCorrelation)
+		measurement.samplers[n++] = pairCorrelationSampler(
+							&pairCorrelationConf);
+	if (coordinationCutoff > 0)
+		measurement.samplers[n++] = coordinationSampler(
+							&coordinationConf);
+	if (structureFactorMaxK > 0)
+		measurement.samplers[n++] = structureFactorSampler(
+							&structureFactorConf);
+	if (sampleMSD)
+		measurement.samplers[n++] = msdSampler(&msdConf);
+	measurement.numSamplers = n;
 	Task measTask = measurementTask(&measurement);
 
+	/* Checkpoint task. Also needed to check and free the sections of 
+	 * the checkpoint after a restart. */
+	bool checkpoints = checkpointConf.filename != NULL
+					|| restartFile != NULL;
+	Task checkpointTask;
+	if (checkpoints)
+		checkpointTask = makeCheckpointTask(&checkpointConf);
+
 	/* Combined task */
-	Task *tasks[3];
+	Task *tasks[4];
 	tasks[0] = (render ? &renderTask : NULL);
-	tasks[1] = &monteCarloTask;
+	tasks[1] = &simulationTask;
 	tasks[2] = &measTask;
-	Task task = sequence(tasks, 3);
+	tasks[3] = (checkpoints ? &checkpointTask : NULL);
+	Task task = sequence(tasks, 4);
 
 	bool everythingOK = run(&task);
 
+	if (finalConfigurationFile != NULL
+			&& !saveConfiguration(finalConfigurationFile)) {
+		fprintf(stderr, "Couldn't write configuration %s: %s\n",
+				finalConfigurationFile, strerror(errno));
+		everythingOK = false;
+	}
+
 	if (!everythingOK)
 		return 1;
 	return 0;
@@ -6,19 +6,12 @@
 #include <stdlib.h>
 #include <math.h>
 #include <assert.h>
-#include "tinymt/tinymt64.h"
+#include "rng.h"
 
 #ifndef M_PI
 #define M_PI	3.14159265358979323846
 #endif
 
-/* tiny MT state */
-extern tinymt64_t tinymt;
-void seedRandomWith(uint64_t seed);
-/* Automatically seeds random number generator based on current time and 
- * PID of process */
-void seedRandom(void);
-
 typedef struct Vec3
 {
 	double x, y, z;
@@ -268,9 +261,9 @@ static __inline__ Vec3 periodic(Vec3 period, Vec3 v)
 {
 	Vec3 res;
 	Vec3 hp = scale(period, 1 / 2.0); /* Half Period */
-	res.x = hp.x + floor((v.x - hp.x) / period.x) * period.x;
-	res.y = hp.y + floor((v.y - hp.y) / period.y) * period.y;
-	res.z = hp.z + floor((v.z - hp.z) / period.z) * period.z;
+	res.x = v.x - floor((v.x + hp.x) / period.x) * period.x;
+	res.y = v.y - floor((v.y + hp.y) / period.y) * period.y;
+	res.z = v.z - floor((v.z + hp.z) / period.z) * period.z;
 
 	assert(-period.x/2.0 <= res.x   &&   res.x < period.x/2.0);
 	assert(-period.y/2.0 <= res.y   &&   res.y < period.y/2.0);
@@ -363,54 +356,14 @@ static __inline__ Vec3 fromCilindrical(double r, double phi, double height)
 	return res;
 }
 
-/* Returns a uniform random number x, where 0 <= x < 1. */
-static __inline__ double rand01(void)
-{
-	return tinymt64_generate_double01(&tinymt);
-}
-
-/* Returns a unifor random index x, where 0 <= x < numElements. */
-static __inline__ int randIndex(int numElements)
-{
-	return (int) (numElements * rand01());
-}
-
-/* These are static *globals* so that inlining randNorm multiple times in a 
- * single function can optimize out the caching of the results! 
- * TODO: verify this */
-static double _randNormCache;
-static bool _randNormCached = false;
-/* Returns a number sampled from a standard normal distribution. */
-static __inline__ double randNorm(void)
-{
-	if (_randNormCached) {
-		_randNormCached = false;
-		return _randNormCache;
-	}
-
-	/* Box-Muller transform */
-	/* 0 < u1,u2 <= 1 */
-	double u1 = tinymt64_generate_doubleOC(&tinymt);
-	double u2 = tinymt64_generate_doubleOC(&tinymt);
-
-	double sqrtLog = sqrt(-2 * log(u1));
-	double c = cos(2*M_PI * u2);
-	/* TODO: This is faster than a sin()? */
-	double s = (u2 < 0.5 ? 1 : -1) * sqrt(1 - c*c);
-
-	_randNormCache = sqrtLog * s;
-	_randNormCached = true;
-	return sqrtLog * c;
-}
-
 /* Returns a vector with components sampled from a standard normal 
  * distribution. */
-static __inline__ Vec3 randNormVec(double stdDev)
+static __inline__ Vec3 randNormVec(Rng *rng, double stdDev)
 {
 	Vec3 res;
-	res.x = randNorm() * stdDev;
-	res.y = randNorm() * stdDev;
-	res.z = randNorm() * stdDev;
+	res.x = randNorm(rng) * stdDev;
+	res.y = randNorm(rng) * stdDev;
+	res.z = randNorm(rng) * stdDev;
 	return res;
 }
 
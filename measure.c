@@ -1,53 +1,533 @@
 #include "measure.h"
 #include "render.h"
+#include "world.h"
+#include "checkpoint.h"
 #include <string.h>
-#include <unistd.h>
-#include <sys/stat.h>
-#include <sys/types.h>
-#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
 
-/* STUFF FOR REDIRECTING STDOUT. POSIX-ONLY. */
+/* OUTPUT FILE */
+
+/* Size of the buffer of the output file. The samplers mostly write at the 
+ * end, so this only gets flushed a couple of times. */
+#define MEASURE_FILE_BUFFER (1 << 20)
+
+
+/* ASYNCHRONOUS WRITER
+ *
+ * With MeasurementConf.asyncWriter, the measurement file gets written by a 
+ * thread of its own, so a slow disk doesn't stall the simulation. The 
+ * samplers still just fprintf() to SamplerData.out: that FILE is a cookie 
+ * stream that copies whatever stdio flushes into a ring of chunks. The 
+ * writer thread drains full chunks to the file with one big write() each.
+ *
+ * The ring has a single producer (the measurement task) and a single 
+ * consumer (the writer thread), so it needs no locks: the producer fills 
+ * chunk 'head' and publishes it by bumping head, the consumer writes chunk 
+ * 'tail' and releases it by bumping tail. Both only wait (by sleeping a 
+ * bit) when the ring is full or empty, respectively. When the producer has 
+ * to wait for a free chunk, the disk is what limits us, and that gets 
+ * counted in the statistics printed at the end. */
+
+#define WRITER_CHUNK_SIZE (1 << 20)
+#define WRITER_NUM_CHUNKS 16
+/* Time to sleep when waiting for the other side of the ring */
+#define WRITER_POLL_NS (200 * 1000)
 
 typedef struct {
-	int newfd; /* fd we want to switch to */
-} StreamState;
+	int fd;
+	const char *filename;
+	bool sync; /* fsync() the file when closing */
+	bool verbose;
+
+	char *chunks; /* WRITER_NUM_CHUNKS chunks of WRITER_CHUNK_SIZE */
+	size_t chunkFill[WRITER_NUM_CHUNKS];
+	/* Chunks tail up to head (exclusive, modulo WRITER_NUM_CHUNKS) are 
+	 * full and waiting for the writer. The producer fills chunk head 
+	 * up to 'fill'. Only the producer changes head, only the writer 
+	 * changes tail. */
+	unsigned long head;
+	unsigned long tail;
+	size_t fill;
+	bool done; /* Set by the producer when nothing more is coming */
+	bool failed; /* Set by the writer when a write() failed */
+	int writeErrno;
+
+	pthread_t thread;
+
+	/* Statistics */
+	long bytes;
+	long chunksWritten;
+	long stalls; /* Times the producer found the ring full */
+	double stallTime; /* Seconds the producer waited in total */
+	int maxQueued; /* Most full chunks ever waiting for the writer */
+} AsyncWriter;
+
+static void writerSleep(void)
+{
+	struct timespec ts = { .tv_sec = 0, .tv_nsec = WRITER_POLL_NS };
+	nanosleep(&ts, NULL);
+}
 
-static StreamState makeStreamState(const char *filename)
+static double writerClock(void)
 {
-	StreamState s;
-	s.newfd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-	if (s.newfd < 0) {
-		perror("Error opening file");
-		assert(false);
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+static bool writeAll(int fd, const char *buf, size_t n)
+{
+	while (n > 0) {
+		ssize_t written = write(fd, buf, n);
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		buf += written;
+		n -= written;
+	}
+	return true;
+}
+
+static void *writerThread(void *data)
+{
+	AsyncWriter *w = (AsyncWriter*) data;
+	unsigned long tail = w->tail;
+
+	for (;;) {
+		unsigned long head = __atomic_load_n(&w->head,
+							__ATOMIC_ACQUIRE);
+		if (tail == head) {
+			/* Check done before looking at head again, so we 
+			 * can't miss the last chunk. */
+			if (__atomic_load_n(&w->done, __ATOMIC_ACQUIRE)
+					&& tail == __atomic_load_n(&w->head,
+							__ATOMIC_ACQUIRE))
+				break;
+			writerSleep();
+			continue;
+		}
+
+		int c = tail % WRITER_NUM_CHUNKS;
+		if (!w->failed && !writeAll(w->fd,
+					w->chunks + c * WRITER_CHUNK_SIZE,
+					w->chunkFill[c])) {
+			/* Keep draining, so the producer doesn't hang */
+			w->failed = true;
+			w->writeErrno = errno;
+		}
+		tail++;
+		__atomic_store_n(&w->tail, tail, __ATOMIC_RELEASE);
 	}
-	return s;
+	return NULL;
 }
 
-/* Switch the current stdout to the stream given in s.
- * At the end of this function: s->fd is an fd to stdout as it was when 
- * calling this fuction; s->pos is the position in that stream an that 
- * time.
- * If s is NULL, or s.newfd < 0: do noting. */
-static void switchStdout(StreamState *s)
+/* Hand the chunk being filled to the writer, and wait for the next one to 
+ * be free. */
+static void writerPublish(AsyncWriter *w)
 {
-	if (s == NULL  ||  s->newfd < 0)
+	unsigned long head = w->head;
+	w->chunkFill[head % WRITER_NUM_CHUNKS] = w->fill;
+	w->bytes += w->fill;
+	w->chunksWritten++;
+	head++;
+	__atomic_store_n(&w->head, head, __ATOMIC_RELEASE);
+	w->fill = 0;
+
+	unsigned long tail = __atomic_load_n(&w->tail, __ATOMIC_ACQUIRE);
+	w->maxQueued = MAX(w->maxQueued, (int) (head - tail));
+	if (head - tail < WRITER_NUM_CHUNKS)
 		return;
-	
-	fflush(stdout);
-	int oldStdout = dup(1);
-	dup2(s->newfd, 1);
-	close(s->newfd);
-	s->newfd = oldStdout;
+
+	/* Ring is full: the disk can't keep up */
+	w->stalls++;
+	double start = writerClock();
+	while (head - __atomic_load_n(&w->tail, __ATOMIC_ACQUIRE)
+						>= WRITER_NUM_CHUNKS)
+		writerSleep();
+	w->stallTime += writerClock() - start;
+}
+
+static ssize_t writerWrite(void *cookie, const char *buf, size_t size)
+{
+	AsyncWriter *w = (AsyncWriter*) cookie;
+	size_t left = size;
+	while (left > 0) {
+		int c = w->head % WRITER_NUM_CHUNKS;
+		size_t n = MIN(left, WRITER_CHUNK_SIZE - w->fill);
+		memcpy(w->chunks + c * WRITER_CHUNK_SIZE + w->fill, buf, n);
+		w->fill += n;
+		buf += n;
+		left -= n;
+		if (w->fill == WRITER_CHUNK_SIZE)
+			writerPublish(w);
+	}
+	return size;
+}
+
+static int writerClose(void *cookie)
+{
+	AsyncWriter *w = (AsyncWriter*) cookie;
+	if (w->fill > 0)
+		writerPublish(w);
+	__atomic_store_n(&w->done, true, __ATOMIC_RELEASE);
+	pthread_join(w->thread, NULL);
+
+	int ret = 0;
+	if (w->failed) {
+		fprintf(stderr, "Error writing measurement file %s: %s\n",
+				w->filename, strerror(w->writeErrno));
+		ret = EOF;
+	}
+	if (w->sync && fsync(w->fd) != 0) {
+		perror("Error syncing measurement file");
+		ret = EOF;
+	}
+	if (close(w->fd) != 0)
+		ret = EOF;
+
+	if (w->verbose) {
+		printf("Async writer: %.1f MiB in %ld chunks, at most %d of "
+				"%d chunks queued\n",
+				w->bytes / (double) (1 << 20),
+				w->chunksWritten, w->maxQueued,
+				WRITER_NUM_CHUNKS);
+		printf("Async writer: producer stalled %ld times for %f "
+				"seconds on a full ring\n",
+				w->stalls, w->stallTime);
+	}
+
+	free(w->chunks);
+	free(w);
+	return ret;
 }
 
-/* Flushes the new stream in s and closes it. */
-static void stopRedirection(StreamState *s)
+static FILE *openAsyncFile(const MeasurementConf *conf)
 {
-	if (s == NULL  ||  s->newfd < 0)
+	AsyncWriter *w = calloc(1, sizeof(*w));
+	if (w == NULL)
+		dieMem();
+	w->chunks = malloc(WRITER_NUM_CHUNKS * WRITER_CHUNK_SIZE);
+	if (w->chunks == NULL)
+		dieMem();
+	w->filename = conf->measureFile;
+	w->sync = conf->syncFile;
+	w->verbose = conf->verbose;
+
+	w->fd = open(conf->measureFile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (w->fd < 0)
+		die("Couldn't open measurement file %s: %s\n",
+				conf->measureFile, strerror(errno));
+
+	cookie_io_functions_t io = {
+		.read = NULL,
+		.write = &writerWrite,
+		.seek = NULL,
+		.close = &writerClose,
+	};
+	FILE *f = fopencookie(w, "w", io);
+	if (f == NULL)
+		dieMem();
+	if (setvbuf(f, NULL, _IOFBF, MEASURE_FILE_BUFFER) != 0)
+		die("Couldn't set up the buffer of measurement file %s\n",
+							conf->measureFile);
+
+	if (pthread_create(&w->thread, NULL, &writerThread, w) != 0)
+		die("Couldn't start the writer thread\n");
+	return f;
+}
+
+
+/* Opens the file for the output of the samplers, or returns stdout if 
+ * there is no measureFile. */
+static FILE *openMeasureFile(const MeasurementConf *conf)
+{
+	const char *filename = conf->measureFile;
+	if (filename == NULL)
+		return stdout;
+	if (conf->asyncWriter)
+		return openAsyncFile(conf);
+
+	FILE *f = fopen(filename, "w");
+	if (f == NULL)
+		die("Couldn't open measurement file %s: %s\n", filename,
+							strerror(errno));
+	if (setvbuf(f, NULL, _IOFBF, MEASURE_FILE_BUFFER) != 0)
+		die("Couldn't set up the buffer of measurement file %s\n",
+								filename);
+	return f;
+}
+
+/* For the async writer, this also waits for everything to hit the file. */
+static void closeMeasureFile(FILE *f, const MeasurementConf *conf)
+{
+	if (f == stdout) {
+		fflush(f);
 		return;
-	close(s->newfd);
-	s->newfd = 0;
+	}
+	if (conf->syncFile && !conf->asyncWriter
+			&& (fflush(f) != 0 || fsync(fileno(f)) != 0))
+		perror("Error syncing measurement file");
+	if (fclose(f) != 0)
+		perror("Error writing measurement file");
+}
+
+
+
+
+/* SHARED PAIR PASS */
+
+/* The pairs within range are found with a cell list of our own, with 
+ * cells of at least the range, instead of with the spgrid: the spgrid is 
+ * sized for the simulation, and the range is usually a lot bigger than 
+ * that. The cells get rebuilt for every sample with a counting sort, which 
+ * also puts the positions in cell order.
+ * The x planes of cells are dealt out over the threads. Every thread 
+ * collects its pairs in a buffer of its own, and hands that to the 
+ * samplers whenever it's full. */
+#define PAIR_PASS_MAX_STENCIL 13
+#define PAIR_PASS_BATCH 1024
+
+typedef struct pairPass PairPass;
+typedef struct {
+	PairPass *pp;
+	int index;
+	int n;
+	int i[PAIR_PASS_BATCH], j[PAIR_PASS_BATCH];
+	double r2[PAIR_PASS_BATCH];
+	pthread_t thread;
+} PairPassWorker;
+
+struct pairPass {
+	double range2; /* Compare squared distances */
+	int numThreads;
+	PairPassWorker *workers;
+
+	/* The samplers that want the pairs */
+	int numConsumers;
+	Sampler *consumers[MAX_SAMPLERS];
+	void *consumerStates[MAX_SAMPLERS];
+	SamplerData *sd;
+
+	int nc[3]; /* Number of cells per dimension */
+	int numCells;
+	double invCellSize;
+	int halfStencilSize; /* Every pair of neighbouring cells once */
+	int halfStencil[PAIR_PASS_MAX_STENCIL][3];
+	int *cellStart; /* Cell c holds sorted positions cellStart[c] up to 
+			   (but not including) cellStart[c + 1] */
+	int *particleCell;
+	int *sortedParticle; /* Index in world.particles of a sorted one */
+	double *x, *y, *z; /* Positions, sorted by cell */
+};
+
+static PairPass *allocPairPass(double range, int numThreads)
+{
+	double ws = world.worldSize;
+	if (range > ws / 2)
+		die("Pair range %f is more than half the world size %f!\n",
+								range, ws);
+
+	PairPass *pp = calloc(1, sizeof(*pp));
+	if (pp == NULL)
+		dieMem();
+	pp->range2 = SQUARE(range);
+
+	/* With less than 3 cells, the cells at offset -1 and +1 would be 
+	 * the same one, so then just use a single cell. */
+	int n = floor(ws / range);
+	if (n < 3)
+		n = 1;
+	pp->nc[0] = pp->nc[1] = n;
+	pp->nc[2] = world.twoDimensional ? 1 : n;
+	pp->numCells = pp->nc[0] * pp->nc[1] * pp->nc[2];
+	pp->invCellSize = n / ws;
+
+	/* Half of the neighbour offsets: the lexicographically positive 
+	 * ones. */
+	pp->halfStencilSize = 0;
+	for (int dx = -1; dx <= 1; dx++)
+	for (int dy = -1; dy <= 1; dy++)
+	for (int dz = -1; dz <= 1; dz++) {
+		if ((pp->nc[0] == 1 && dx != 0) || (pp->nc[1] == 1 && dy != 0)
+					|| (pp->nc[2] == 1 && dz != 0))
+			continue;
+		if (dx < 0 || (dx == 0 && (dy < 0 || (dy == 0 && dz <= 0))))
+			continue;
+		int *o = pp->halfStencil[pp->halfStencilSize++];
+		o[0] = dx;
+		o[1] = dy;
+		o[2] = dz;
+	}
+	assert(pp->halfStencilSize <= PAIR_PASS_MAX_STENCIL);
+
+	int N = world.numParticles;
+	pp->cellStart = malloc((pp->numCells + 1) * sizeof(*pp->cellStart));
+	pp->particleCell = malloc(N * sizeof(*pp->particleCell));
+	pp->sortedParticle = malloc(N * sizeof(*pp->sortedParticle));
+	pp->x = malloc(N * sizeof(*pp->x));
+	pp->y = malloc(N * sizeof(*pp->y));
+	pp->z = malloc(N * sizeof(*pp->z));
+	if (pp->cellStart == NULL || pp->particleCell == NULL
+			|| pp->sortedParticle == NULL
+			|| pp->x == NULL || pp->y == NULL || pp->z == NULL)
+		dieMem();
+
+	pp->numThreads = MAX(numThreads, 1);
+	pp->workers = calloc(pp->numThreads, sizeof(*pp->workers));
+	if (pp->workers == NULL)
+		dieMem();
+	for (int t = 0; t < pp->numThreads; t++) {
+		pp->workers[t].pp = pp;
+		pp->workers[t].index = t;
+	}
+	return pp;
+}
+
+static void freePairPass(PairPass *pp)
+{
+	free(pp->workers);
+	free(pp->cellStart);
+	free(pp->particleCell);
+	free(pp->sortedParticle);
+	free(pp->x);
+	free(pp->y);
+	free(pp->z);
+	free(pp);
+}
+
+static int pairPassCellCoord(const PairPass *pp, double x, int d)
+{
+	int c = (x + world.worldSize / 2) * pp->invCellSize;
+	/* Rounding at the upper edge */
+	return MAX(0, MIN(c, pp->nc[d] - 1));
+}
+
+/* Sort the particle positions into the cells. */
+static void pairPassFillCells(PairPass *pp)
+{
+	int N = world.numParticles;
+	int *start = pp->cellStart;
+	const int *nc = pp->nc;
+
+	memset(start, 0, (pp->numCells + 1) * sizeof(*start));
+	for (int i = 0; i < N; i++) {
+		Vec3 pos = world.particles[i].pos;
+		int cx = pairPassCellCoord(pp, pos.x, 0);
+		int cy = pairPassCellCoord(pp, pos.y, 1);
+		int cz = pairPassCellCoord(pp, pos.z, 2);
+		int c = (cx * nc[1] + cy) * nc[2] + cz;
+		pp->particleCell[i] = c;
+		start[c + 1]++;
+	}
+	for (int c = 0; c < pp->numCells; c++)
+		start[c + 1] += start[c];
+
+	/* Use start[c] as fill pointer, and shift it back afterwards */
+	for (int i = 0; i < N; i++) {
+		int k = start[pp->particleCell[i]]++;
+		Vec3 pos = world.particles[i].pos;
+		pp->sortedParticle[k] = i;
+		pp->x[k] = pos.x;
+		pp->y[k] = pos.y;
+		pp->z[k] = pos.z;
+	}
+	for (int c = pp->numCells; c > 0; c--)
+		start[c] = start[c - 1];
+	start[0] = 0;
+}
+
+/* Hand the buffered pairs of this worker to the samplers. */
+static void pairPassFlush(PairPassWorker *w)
+{
+	PairPass *pp = w->pp;
+	PairBatch batch = {
+		.n = w->n,
+		.i = w->i,
+		.j = w->j,
+		.r2 = w->r2,
+	};
+	for (int c = 0; c < pp->numConsumers; c++)
+		pp->consumers[c]->pairs(pp->sd, pp->consumerStates[c],
+							w->index, &batch);
+	w->n = 0;
+}
+
+/* Buffer all pairs within range between the sorted positions [s1, e1) and 
+ * [s2, e2). If both ranges are the same, only the distinct pairs. */
+static void pairPassCellPairs(PairPassWorker *w, int s1, int e1,
+							int s2, int e2)
+{
+	const PairPass *pp = w->pp;
+	const double *x = pp->x, *y = pp->y, *z = pp->z;
+	double ws = world.worldSize;
+	double range2 = pp->range2;
+	bool same = s1 == s2;
+
+	for (int k1 = s1; k1 < e1; k1++) {
+		for (int k2 = same ? k1 + 1 : s2; k2 < e2; k2++) {
+			double dx = _fastPeriodic(ws, x[k2] - x[k1]);
+			double dy = _fastPeriodic(ws, y[k2] - y[k1]);
+			double dz = _fastPeriodic(ws, z[k2] - z[k1]);
+			double r2 = dx*dx + dy*dy + dz*dz;
+			if (r2 >= range2)
+				continue;
+			w->i[w->n] = pp->sortedParticle[k1];
+			w->j[w->n] = pp->sortedParticle[k2];
+			w->r2[w->n] = r2;
+			if (++w->n == PAIR_PASS_BATCH)
+				pairPassFlush(w);
+		}
+	}
+}
+
+/* Do the pairs of the x planes of cells that belong to this worker. */
+static void *pairPassWork(void *arg)
+{
+	PairPassWorker *w = (PairPassWorker*) arg;
+	const PairPass *pp = w->pp;
+	const int *start = pp->cellStart;
+	const int *nc = pp->nc;
+
+	for (int cx = w->index; cx < nc[0]; cx += pp->numThreads)
+	for (int cy = 0; cy < nc[1]; cy++)
+	for (int cz = 0; cz < nc[2]; cz++) {
+		int c = (cx * nc[1] + cy) * nc[2] + cz;
+		pairPassCellPairs(w, start[c], start[c + 1],
+						start[c], start[c + 1]);
+
+		for (int n = 0; n < pp->halfStencilSize; n++) {
+			const int *o = pp->halfStencil[n];
+			int nx = (cx + o[0] + nc[0]) % nc[0];
+			int ny = (cy + o[1] + nc[1]) % nc[1];
+			int nz = (cz + o[2] + nc[2]) % nc[2];
+			int c2 = (nx * nc[1] + ny) * nc[2] + nz;
+			pairPassCellPairs(w, start[c], start[c + 1],
+						start[c2], start[c2 + 1]);
+		}
+	}
+	if (w->n > 0)
+		pairPassFlush(w);
+	return NULL;
+}
+
+static void runPairPass(PairPass *pp)
+{
+	pairPassFillCells(pp);
+
+	for (int t = 1; t < pp->numThreads; t++)
+		if (pthread_create(&pp->workers[t].thread, NULL,
+					&pairPassWork, &pp->workers[t]) != 0)
+			die("Couldn't create pair pass thread!\n");
+	pairPassWork(&pp->workers[0]);
+	for (int t = 1; t < pp->numThreads; t++)
+		pthread_join(pp->workers[t].thread, NULL);
 }
 
 
@@ -57,73 +537,96 @@ static void stopRedirection(StreamState *s)
 
 typedef struct measTaskState
 {
-	Sampler sampler;
-	void *samplerState;
+	int numSamplers;
+	Sampler samplers[MAX_SAMPLERS];
+	void *samplerStates[MAX_SAMPLERS];
 	SamplerData samplerData;
+	PairPass *pairPass; /* NULL if no sampler wants pairs */
 	enum {RELAXING, SAMPLING} measStatus;
 	MeasurementConf measConf;
 	double intervalTime; /* Time since last sample (or start). */
-	StreamState streamState; /* For stdout redirection */
 } MeasTaskState;
 
-/* Returns the state pointer that gets returned from sampler.start(), or 
- * NULL if sampler.start == NULL */
-static void *samplerStart(MeasTaskState *measState)
+/* Start all samplers, and the pair pass if any of them wants pairs. */
+static void samplerStart(MeasTaskState *measState)
 {
-	Sampler *sampler = &measState->sampler;
-	StreamState *streamState = &measState->streamState;
-	void *ret;
+	FILE *out = measState->samplerData.out;
 
-	switchStdout(streamState); /* Switch stdout to file */
 	if (measState->measConf.measureHeader != NULL)
-		printf("%s", measState->measConf.measureHeader);
+		fprintf(out, "%s", measState->measConf.measureHeader);
 
-	if (sampler->header != NULL)
-		printf("%s", sampler->header);
+	double pairRange = 0;
+	for (int i = 0; i < measState->numSamplers; i++) {
+		Sampler *sampler = &measState->samplers[i];
 
-	if (sampler->start == NULL)
-		ret = NULL;
-	else
-		ret = sampler->start(&measState->samplerData, 
-					sampler->samplerConf);
+		if (sampler->header != NULL)
+			fprintf(out, "%s", sampler->header);
 
-	switchStdout(streamState); /* Switch stdout back */
+		if (sampler->start == NULL)
+			measState->samplerStates[i] = NULL;
+		else
+			measState->samplerStates[i] = sampler->start(
+						&measState->samplerData,
+						sampler->samplerConf);
 
-	return ret;
+		if (sampler->pairs != NULL)
+			pairRange = MAX(pairRange, sampler->pairRange);
+	}
+
+	measState->pairPass = NULL;
+	if (pairRange <= 0)
+		return;
+	PairPass *pp = allocPairPass(pairRange,
+				measState->samplerData.pairThreads);
+	for (int i = 0; i < measState->numSamplers; i++) {
+		if (measState->samplers[i].pairs == NULL)
+			continue;
+		pp->consumers[pp->numConsumers] = &measState->samplers[i];
+		pp->consumerStates[pp->numConsumers] =
+						measState->samplerStates[i];
+		pp->numConsumers++;
+	}
+	pp->sd = &measState->samplerData;
+	measState->pairPass = pp;
 }
 
-/* Sample and return sampler.sample(), or do nothing if sampler.sample == 
- * NULL and return SAMPLER_OK. Note that this would be a pretty useless sampler 
- * in the latter case... */
+/* Hand the pairs to the samplers that want them, and then sample all 
+ * samplers. Returns the most severe signal of the samplers. */
 static SamplerSignal samplerSample(MeasTaskState *measState)
 {
-	Sampler *sampler = &measState->sampler;
-	StreamState *streamState = &measState->streamState;
-
-	if (sampler->sample == NULL)
-		return SAMPLER_OK;
-
-	switchStdout(streamState); /* Switch stdout to file */
-	SamplerSignal ret = sampler->sample(&measState->samplerData, 
-				measState->samplerState);
-	switchStdout(streamState); /* Switch stdout back */
+	SamplerSignal ret = SAMPLER_OK;
+
+	if (measState->pairPass != NULL)
+		runPairPass(measState->pairPass);
+
+	for (int i = 0; i < measState->numSamplers; i++) {
+		Sampler *sampler = &measState->samplers[i];
+		if (sampler->sample == NULL)
+			continue;
+		SamplerSignal signal = sampler->sample(
+					&measState->samplerData,
+					measState->samplerStates[i]);
+		ret = MAX(ret, signal);
+	}
 
 	return ret;
 }
 
-/* Stop the sampler if we were currently sampling, do nothing otherwise or 
- * if sampler.stop == NULL */
+/* Stop the samplers if we were currently sampling, do nothing otherwise */
 static void samplerStop(MeasTaskState *measState)
 {
-	Sampler *sampler = &measState->sampler;
-	StreamState *streamState = &measState->streamState;
-
-	if (sampler->stop == NULL  ||  measState->measStatus != SAMPLING)
+	if (measState->measStatus != SAMPLING)
 		return;
 
-	switchStdout(streamState); /* Switch stdout to file */
-	sampler->stop(&measState->samplerData, measState->samplerState);
-	switchStdout(streamState); /* Switch stdout back */
+	for (int i = 0; i < measState->numSamplers; i++) {
+		Sampler *sampler = &measState->samplers[i];
+		if (sampler->stop != NULL)
+			sampler->stop(&measState->samplerData,
+					measState->samplerStates[i]);
+	}
+
+	if (measState->pairPass != NULL)
+		freePairPass(measState->pairPass);
 }
 
 
@@ -131,6 +634,63 @@ static void samplerStop(MeasTaskState *measState)
 
 
 
+/* CHECKPOINTS */
+
+/* Where the measurement is, and the state of every sampler if we're 
+ * sampling. */
+static void measSave(FILE *f, void *data)
+{
+	MeasTaskState *measState = (MeasTaskState*) data;
+	int status = measState->measStatus;
+	checkpointWrite(f, &status, sizeof(status));
+	checkpointWrite(f, &measState->intervalTime,
+					sizeof(measState->intervalTime));
+	checkpointWrite(f, &measState->samplerData.sample,
+					sizeof(measState->samplerData.sample));
+	checkpointWrite(f, &measState->numSamplers,
+					sizeof(measState->numSamplers));
+	if (measState->measStatus != SAMPLING)
+		return;
+
+	for (int i = 0; i < measState->numSamplers; i++) {
+		Sampler *sampler = &measState->samplers[i];
+		if (sampler->save != NULL)
+			sampler->save(&measState->samplerData,
+					measState->samplerStates[i], f);
+	}
+}
+static bool measLoad(FILE *f, void *data)
+{
+	MeasTaskState *measState = (MeasTaskState*) data;
+	int status, numSamplers;
+	if (!checkpointRead(f, &status, sizeof(status))
+			|| !checkpointRead(f, &measState->intervalTime,
+					sizeof(measState->intervalTime))
+			|| !checkpointRead(f, &measState->samplerData.sample,
+					sizeof(measState->samplerData.sample))
+			|| !checkpointRead(f, &numSamplers, sizeof(numSamplers))
+			|| numSamplers != measState->numSamplers)
+		return false;
+	if (status != SAMPLING)
+		return true;
+
+	if (measState->measStatus != SAMPLING) {
+		samplerStart(measState);
+		measState->measStatus = SAMPLING;
+	}
+	for (int i = 0; i < measState->numSamplers; i++) {
+		Sampler *sampler = &measState->samplers[i];
+		if (sampler->load != NULL && !sampler->load(
+					&measState->samplerData,
+					measState->samplerStates[i], f))
+			return false;
+	}
+	return true;
+}
+
+
+
+
 /* MEASUREMENT TASK STUFF */
 
 typedef struct {
@@ -153,17 +713,16 @@ static void *measStart(void *initialData)
 	assert(meas != NULL);
 	MeasTaskState *state = malloc(sizeof(*state));
 
-	if (meas->measConf.measureFile != NULL) {
-		state->streamState = makeStreamState(
-				meas->measConf.measureFile);
-	} else {
-		state->streamState.newfd = -1;
-	}
+	state->samplerData.out = openMeasureFile(&meas->measConf);
 
 	state->intervalTime = (meas->measConf.measureWait > 0 ?
 			0 : meas->measConf.measureInterval);
 			/* TODO (So we start sampling immediately) */
-	state->sampler = meas->sampler; /* struct copy */
+	assert(meas->numSamplers <= MAX_SAMPLERS);
+	state->numSamplers = meas->numSamplers;
+	memcpy(state->samplers, meas->samplers,
+			meas->numSamplers * sizeof(*meas->samplers));
+	state->pairPass = NULL;
 	state->measConf = meas->measConf; /* struct copy */
 	state->measStatus = (meas->measConf.measureWait > 0 ?
 				RELAXING : SAMPLING);
@@ -171,10 +730,12 @@ static void *measStart(void *initialData)
 	state->samplerData.strBufSize = meas->measConf.renderStrBufSize;
 	state->samplerData.string = mid->strBuf;
 	state->samplerData.sampleInterval = meas->measConf.measureInterval;
+	state->samplerData.pairThreads = MAX(meas->measConf.pairThreads, 1);
 
 	/* If we don't wait to relax: start sampler now */
 	if (state->measStatus == SAMPLING)
-		state->samplerState = samplerStart(state);
+		samplerStart(state);
+	addCheckpointSection("measurement", &measSave, &measLoad, state);
 
 	free(initialData);
 	return state;
@@ -212,7 +773,7 @@ static TaskSignal measTick(void *state)
 				printf("\nStarting measurement.\n");
 
 			/* Start the sampler */
-			measState->samplerState = samplerStart(measState);
+			samplerStart(measState);
 
 			measState->measStatus = SAMPLING;
 			/* bit of a hack to start sampling immediately: */
@@ -277,9 +838,11 @@ static void measStop(void *state)
 		return;
 
 	MeasTaskState *measState = (MeasTaskState*) state;
+	removeCheckpointSection("measurement");
 	samplerStop(measState);
 
-	stopRedirection(&measState->streamState);
+	closeMeasureFile(measState->samplerData.out,
+			&measState->measConf);
 
 	free(measState->samplerData.string);
 	free(measState);
@@ -319,3 +882,79 @@ Task measurementTask(Measurement *measurement)
 	return task;
 }
 
+
+
+
+/* ONLINE BLOCKING ANALYSIS */
+
+/* Levels with less blocks than this don't give a usable error. */
+#define BLOCKING_MIN_BLOCKS 16
+
+void blockingInit(Blocking *b)
+{
+	memset(b, 0, sizeof(*b));
+}
+
+void blockingAdd(Blocking *b, double x)
+{
+	for (int l = 0; l < BLOCKING_MAX_LEVELS; l++) {
+		BlockingLevel *level = &b->level[l];
+		level->n++;
+		double delta = x - level->mean;
+		level->mean += delta / level->n;
+		level->m2 += delta * (x - level->mean);
+		b->numLevels = MAX(b->numLevels, l + 1);
+
+		if (!level->hasPending) {
+			level->pending = x;
+			level->hasPending = true;
+			return;
+		}
+		x = (level->pending + x) / 2;
+		level->hasPending = false;
+	}
+}
+
+/* Naive standard error of the mean from the blocks of a level. */
+static double blockingLevelError(const BlockingLevel *level)
+{
+	if (level->n < 2)
+		return 0;
+	return sqrt(level->m2 / (level->n * (level->n - 1.0)));
+}
+
+/* The error of a level is on the plateau when the next level doesn't 
+ * give a significantly bigger one. The error on the error estimate of 
+ * level l is error_l / sqrt(2 (n_l - 1)). */
+BlockingResult blockingResult(const Blocking *b)
+{
+	BlockingResult r = {
+		.mean = b->level[0].mean,
+		.error = 0,
+		.tau = 0,
+		.converged = false,
+	};
+	if (b->level[0].n < 2)
+		return r;
+
+	for (int l = 0; l + 1 < b->numLevels; l++) {
+		const BlockingLevel *next = &b->level[l + 1];
+		if (next->n < BLOCKING_MIN_BLOCKS)
+			break;
+		double err = blockingLevelError(&b->level[l]);
+		double errNext = blockingLevelError(next);
+		r.error = MAX(r.error, err);
+		double errOfErr = err / sqrt(2 * (b->level[l].n - 1.0));
+		if (errNext <= err + errOfErr) {
+			r.converged = true;
+			break;
+		}
+	}
+	if (!r.converged)
+		r.error = MAX(r.error, blockingLevelError(&b->level[0]));
+
+	double err0 = blockingLevelError(&b->level[0]);
+	if (err0 > 0)
+		r.tau = SQUARE(r.error / err0) / 2;
+	return r;
+}
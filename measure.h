@@ -2,6 +2,7 @@
 #define _MEASURE_H_
 
 #include <stdlib.h>
+#include <stdio.h>
 #include "task.h"
 
 /* Configuration of a generic measurement */
@@ -36,6 +37,18 @@ typedef struct {
 	 * Each line should start with a '#'.
 	 * If you don't need or want a header, make this NULL. */
 	const char *measureHeader;
+
+	/* Number of threads for the shared pair pass, see Sampler.pairs. 0 
+	 * means 1. */
+	int pairThreads;
+
+	/* Write the measurement file from a thread of its own, through a 
+	 * ring buffer, so a slow disk doesn't hold up the simulation. Has no 
+	 * effect when writing to stdout. */
+	bool asyncWriter;
+
+	/* fsync() the measurement file when the measurement stops. */
+	bool syncFile;
 } MeasurementConf;
 
 typedef struct {
@@ -52,8 +65,27 @@ typedef struct {
 
 	/* The time interval at which you are called. */
 	double sampleInterval;
+
+	/* Write your output here instead of to stdout. This is the 
+	 * (buffered) measurement file, opened once for the whole 
+	 * measurement, and shared by all its samplers. */
+	FILE *out;
+
+	/* Number of threads the pairs of the pair pass come from (thread 
+	 * indices go from 0 up to this), see Sampler.pairs. */
+	int pairThreads;
 } SamplerData;
 
+/* A batch of pairs from the shared pair pass: particles world.particles[
+ * i[k]] and world.particles[j[k]] are sqrt(r2[k]) apart (nearest image), 
+ * for k up to n. Every distinct pair within the range of the pass comes 
+ * by exactly once per sample. */
+typedef struct {
+	int n;
+	const int *i, *j;
+	const double *r2;
+} PairBatch;
+
 typedef enum
 {
 	SAMPLER_OK,	/* Sampler ticked correctly and does not want to stop. */
@@ -88,14 +120,85 @@ typedef struct {
 	 * the sampler. Each line should start with '#'. No such header is 
 	 * printed when this is NULL. */
 	const char *header;
+
+	/* Optional, for samplers that need all pairs of particles within 
+	 * some range. Instead of every such sampler looping over the pairs 
+	 * itself, the measurement finds the pairs within the largest 
+	 * pairRange of all its samplers once per sample, and hands them to 
+	 * pairs() of every sampler in batches, before calling sample().
+	 * The batches come from sd->pairThreads threads at once, so 
+	 * pairs() must only touch state that belongs to the given thread.
+	 * Pairs farther than pairRange of this sampler are in there too, 
+	 * filter them out yourself. pairRange must be at most half the 
+	 * world size. NULL if the sampler doesn't want pairs. */
+	void (*pairs)(SamplerData *sd, void *state, int thread,
+						const PairBatch *batch);
+	double pairRange;
+
+	/* Optional, for checkpoints (see checkpoint.h): save() writes the 
+	 * accumulated state with checkpointWrite(), and load() reads it 
+	 * back into the state of a freshly started sampler, with 
+	 * checkpointRead(). load() returns false if the saved state doesn't 
+	 * fit the settings of this sampler. NULL if the sampler has nothing 
+	 * worth saving, it then starts over after a restart. */
+	void (*save)(SamplerData *sd, void *state, FILE *f);
+	bool (*load)(SamplerData *sd, void *state, FILE *f);
 } Sampler;
 
-/* Everything we need to know about a measurement. */
+#define MAX_SAMPLERS 8
+
+/* Everything we need to know about a measurement. The samplers all sample 
+ * at the same time, and write to the same file, in this order. */
 typedef struct {
 	MeasurementConf measConf;
-	Sampler sampler;
+	int numSamplers;
+	Sampler samplers[MAX_SAMPLERS];
 } Measurement;
 
+
+
+/* ONLINE ERROR ESTIMATES
+ *
+ * Blocking analysis (Flyvbjerg & Petersen, J. Chem. Phys. 91, 461 (1989)) 
+ * of a series of correlated samples of an observable, without storing the 
+ * series: level l keeps the running mean and variance of the averages of 
+ * 2^l consecutive samples, and half a pair to build the next average from. 
+ * The naive standard error of the mean grows with l until the blocks are 
+ * longer than the correlation time, and then stays put. That plateau is 
+ * the real standard error.
+ * A sampler can keep a Blocking for every observable it measures, feed it 
+ * every sample, and report the result at stop(). */
+
+/* Enough levels for 2^64 samples. */
+#define BLOCKING_MAX_LEVELS 64
+
+typedef struct {
+	long n; /* Number of blocks */
+	double mean; /* Running mean and sum of squared deviations of the */
+	double m2;   /* block averages (Welford) */
+	double pending; /* First half of the next block of the next level */
+	bool hasPending;
+} BlockingLevel;
+
+typedef struct {
+	int numLevels; /* Number of levels that got at least one block */
+	BlockingLevel level[BLOCKING_MAX_LEVELS];
+} Blocking;
+
+typedef struct {
+	double mean;
+	double error; /* Standard error of the mean */
+	double tau; /* Integrated correlation time in samples, 1/2 for 
+		       uncorrelated samples */
+	bool converged; /* False if the error didn't reach a plateau, in 
+			   which case it's only a lower bound. */
+} BlockingResult;
+
+void blockingInit(Blocking *b);
+void blockingAdd(Blocking *b, double x);
+BlockingResult blockingResult(const Blocking *b);
+
+
 /* Generate a task that performs the given measurement. If the measurement 
  * config has a valid renderStrBufSize, this task wil also render the 
  * string created by the sampler. */
@@ -1,108 +1,812 @@
 #include "monteCarlo.h"
 #include "world.h"
 #include "spgrid.h"
+#include "verlet.h"
+#include "pairHistogram.h"
+#include "checkpoint.h"
+#include "configuration.h"
 #include <string.h>
+#include <pthread.h>
 
 #define DIAMETER 1 /* Particles have diameter 1 */
 
-static bool collidesHelper(Particle *p1, Particle *p2)
-{
-	/* Returns TRUE if there is NO collision! */
-	return nearestImageDistance2(p1->pos, p2->pos) >= SQUARE(DIAMETER);
-}
-static bool collides(Particle *p)
+/* Sort the particles again when the locality of their order in memory is 
+ * this many times worse than right after the previous sort. */
+#define REORDER_DEGRADATION 2.0
+
+static bool collides(Vec3 pos, const Particle *skip)
 {
-	return !forEveryNeighbourOf(p, &collidesHelper);
+	return overlapsAnyParticle(pos, DIAMETER, skip);
 }
 
-static void fillWorld(void)
+/* Inserts all particles at random positions where they don't come closer 
+ * than the given diameter to the ones already there. */
+static void fillWorld(double diameter)
 {
 	double ws = world.worldSize;
 
 	for (int i = 0; i < world.numParticles; i++) {
 		Particle *p = &world.particles[i];
-		p->pos = (Vec3) {0, 0, 0};
-		addToGrid(p);
+		Rng rng = rngStream(RNG_INSERTION, i, 0);
+		Vec3 pos = {0, 0, 0};
 		do {
-			p->pos.x = ws * (rand01() - 1/2.0);
-			p->pos.y = ws * (rand01() - 1/2.0);
+			pos.x = ws * (rand01(&rng) - 1/2.0);
+			pos.y = ws * (rand01(&rng) - 1/2.0);
 			if (!world.twoDimensional)
-				p->pos.z = ws * (rand01() - 1/2.0);
+				pos.z = ws * (rand01(&rng) - 1/2.0);
+			pos = gridPeriodic(pos);
+		} while (overlapsAnyParticle(pos, diameter, NULL));
 
-			reboxParticle(p);
-		} while (collides(p));
+		p->pos = pos;
+		addToGrid(p);
 	}
 }
 
-typedef struct {
-	MonteCarloConfig conf;
-	long attempted; /* Attempted number of MC moves */
-	long accepted; /* Number of accepted MC moves */
-} MonteCarloState;
-static void *monteCarloTaskStart(void *initialData)
+static void countOverlap(Particle *p1, Particle *p2, void *data)
 {
-	assert(initialData != NULL);
-	MonteCarloConfig *mcc = (MonteCarloConfig*) initialData;
+	long *overlaps = (long*) data;
+	if (nearestImageDistance2(p1->pos, p2->pos) < SQUARE(DIAMETER))
+		(*overlaps)++;
+}
 
-	int nb = floor(world.worldSize / mcc->boxSize);
+/* Hard spheres can't start out overlapping, the moves would never get 
+ * them apart. */
+static void checkOverlaps(void)
+{
+	long overlaps = 0;
+	forEveryPairD(&countOverlap, &overlaps);
+	if (overlaps > 0)
+		die("The configuration has %ld overlapping pairs!\n",
+								overlaps);
+}
 
-	if (nb < 0)
+/* Allocates an empty grid over the whole world, with boxes of at least 
+ * boxSize. */
+static void allocGridOfBoxSize(double boxSize, bool verbose)
+{
+	int nb = floor(world.worldSize / boxSize);
+
+	if (nb < 1)
 		die("World so small (or boxSize so big) that I can't fit a "
 				"single box in there!\n");
 
 	/* adjust boxsize to get the correct world size! */
 	double trueBoxSize = world.worldSize / nb;
-	printf("Requested boxsize %f, actual box size %f\n",
-						mcc->boxSize, trueBoxSize);
+	if (verbose)
+		printf("Requested boxsize %f, actual box size %f\n",
+						boxSize, trueBoxSize);
 	if (world.twoDimensional) {
-		printf("Allocating grid for 2D world, %d boxes/dim.\n", nb);
+		if (verbose)
+			printf("Allocating grid for 2D world, %d boxes/dim.\n",
+									nb);
 		allocGrid(nb, nb, 1, trueBoxSize);
 	} else {
-		printf("Allocating grid for 3D world, %d boxes/dim.\n", nb);
+		if (verbose)
+			printf("Allocating grid for 3D world, %d boxes/dim.\n",
+									nb);
 		allocGrid(nb, nb, nb, trueBoxSize);
 	}
-	
-	fillWorld();
+}
+
+/* The world got compressed by compressWorld() */
+static bool compressed = false;
+
+void allocFilledGrid(double boxSize)
+{
+	allocGridOfBoxSize(boxSize, true);
+
+	if (restartedFromCheckpoint()) {
+		addAllToGrid();
+	} else if (configurationLoaded() || compressed) {
+		addAllToGrid();
+		checkOverlaps();
+	} else {
+		fillWorld(DIAMETER);
+	}
+}
+
+typedef struct checkerboard Checkerboard;
+
+typedef struct {
+	MonteCarloConfig conf;
+	long attempted; /* Attempted number of MC moves */
+	long accepted; /* Number of accepted MC moves */
+	long sweeps; /* Number of sweeps done */
+	double sortedLocality; /* particleOrderLocality() after last sort */
+	long numSorts; /* Number of times we sorted the particles */
+	Checkerboard *checkerboard; /* NULL for single threaded sweeps */
+	double maxDelta; /* Upper bound of conf.delta while tuning */
+	long windowAttempted; /* attempted and accepted at the start of the */
+	long windowAccepted;  /* current tuning window */
+	int *order; /* Particles in the order of the sweep, NULL for 
+		       SWEEP_RANDOM */
+} MonteCarloState;
+
+/* Multithreaded sweeps with a checkerboard domain decomposition.
+ *
+ * The world is cut into nd^d domains (nd even), which get 2^d colours like 
+ * a checkerboard, so domains of the same colour are a full domain apart. 
+ * For every colour in turn, the threads do MC moves in all domains of that 
+ * colour at the same time. A move that would take a particle out of its 
+ * domain is rejected. That keeps particles in different domains of the 
+ * same colour more than a diameter apart, and the particles in the other 
+ * domains don't move at all, so the domains can't influence each other.
+ *
+ * Within a domain, every move picks a random particle of that domain and 
+ * satisfies detailed balance on its own. Fixed domain walls would make 
+ * the chain non-ergodic though, so every sweep shifts the whole 
+ * decomposition by a random offset and goes through the colours in a 
+ * random order.
+ *
+ * Domains are at least two grid boxes wide, so the boxes a thread moves 
+ * particles in (and the neighbouring boxes it reads for the overlap test) 
+ * are never touched by another thread. The boxes get enough room 
+ * reserved beforehand so moving between boxes never reallocates the grid.
+ */
+
+#define MAX_COLOURS 8
+
+typedef struct {
+	Checkerboard *cb;
+	int index;
+	pthread_t thread;
+	long attempted; /* Counters of this sweep, summed up by the main */
+	long accepted;  /* thread afterwards. */
+} Worker;
+
+struct checkerboard {
+	double delta;
+	int numThreads;
+	Worker *workers; /* Worker 0 is the main thread itself */
+	pthread_barrier_t barrier;
+	bool quit;
+
+	int nd[3]; /* Number of domains along each dimension */
+	Vec3 domainSize;
+	Vec3 offset; /* Shift of the domain walls during this sweep */
+	int numColours;
+	int domainsPerColour;
+	int *colourDomains[MAX_COLOURS]; /* The domains of every colour */
+	int colour; /* Colour the workers are working on */
+	long sweep; /* Number of the sweep, for the random streams */
+
+	/* The particles in domain d during this sweep are
+	 * domainParticles[domainStart[d]] up to (but not including)
+	 * domainParticles[domainStart[d + 1]]. */
+	int *domainStart;
+	int *domainParticles;
+	int *particleDomain;
+};
+
+static int numDomains(const Checkerboard *cb)
+{
+	return cb->nd[0] * cb->nd[1] * cb->nd[2];
+}
+
+/* Index of the domain along one dimension, for a coordinate within the 
+ * grid [-size/2, size/2). */
+static __inline__ int domainCoord(double x, double size, double offset,
+						double domainSize, int nd)
+{
+	double u = x + size / 2 + offset;
+	if (u >= size)
+		u -= size;
+	int d = u / domainSize;
+	return MIN(d, nd - 1); /* Rounding */
+}
+
+static __inline__ int domainOf(const Checkerboard *cb, Vec3 pos)
+{
+	Vec3 gs = spgrid.gridSize;
+	int dx = domainCoord(pos.x, gs.x, cb->offset.x, cb->domainSize.x,
+								cb->nd[0]);
+	int dy = domainCoord(pos.y, gs.y, cb->offset.y, cb->domainSize.y,
+								cb->nd[1]);
+	int dz = 0;
+	if (cb->nd[2] > 1)
+		dz = domainCoord(pos.z, gs.z, cb->offset.z,
+						cb->domainSize.z, cb->nd[2]);
+	return (dx * cb->nd[1] + dy) * cb->nd[2] + dz;
+}
+
+/* Do as many moves in domain d as there are particles in it. */
+static void moveInDomain(Worker *w, int d)
+{
+	Checkerboard *cb = w->cb;
+	const int *parts = cb->domainParticles + cb->domainStart[d];
+	int n = cb->domainStart[d + 1] - cb->domainStart[d];
+	double delta = cb->delta;
+	/* Whichever thread gets the domain draws the same numbers */
+	Rng rng = rngStream(RNG_DOMAIN, d, cb->sweep);
+
+	for (int k = 0; k < n; k++) {
+		Particle *p = &world.particles[parts[randIndex(&rng, n)]];
+		Vec3 newPos = p->pos;
+
+		newPos.x += delta * (rand01(&rng) - 1/2.0);
+		newPos.y += delta * (rand01(&rng) - 1/2.0);
+		if (!world.twoDimensional)
+			newPos.z += delta * (rand01(&rng) - 1/2.0);
+		newPos = gridPeriodic(newPos);
+
+		if (domainOf(cb, newPos) != d || collides(newPos, p))
+			continue;
+
+		p->pos = newPos;
+		reboxParticle(p);
+		w->accepted++;
+	}
+	w->attempted += n;
+}
+
+static void workOnColour(Worker *w)
+{
+	Checkerboard *cb = w->cb;
+	const int *domains = cb->colourDomains[cb->colour];
+	for (int k = w->index; k < cb->domainsPerColour; k += cb->numThreads)
+		moveInDomain(w, domains[k]);
+}
+
+static void *workerMain(void *arg)
+{
+	Worker *w = (Worker*) arg;
+	Checkerboard *cb = w->cb;
+
+	while (true) {
+		pthread_barrier_wait(&cb->barrier);
+		if (cb->quit)
+			break;
+		workOnColour(w);
+		pthread_barrier_wait(&cb->barrier);
+	}
+	return NULL;
+}
+
+/* Upper bound on the number of particles that fit in a grid box: the 
+ * spheres around them fit in a cube that's a diameter bigger, and can't be 
+ * packed denser than close packing in there. */
+static int maxParticlesPerBox(void)
+{
+	double side = spgrid.boxSize / DIAMETER + 1;
+	if (world.twoDimensional)
+		return ceil(SQUARE(side) * 2 / sqrt(3)) + 1;
+	return ceil(CUBE(side) * sqrt(2)) + 1;
+}
+
+static Checkerboard *allocCheckerboard(double delta, int numThreads)
+{
+	Checkerboard *cb = calloc(1, sizeof(*cb));
+	if (cb == NULL)
+		dieMem();
+	cb->delta = delta;
+	cb->numThreads = numThreads;
+
+	double minDomainSize = MAX(2 * spgrid.boxSize, DIAMETER);
+	double gs[3] = {spgrid.gridSize.x, spgrid.gridSize.y,
+							spgrid.gridSize.z};
+	int dims = world.twoDimensional ? 2 : 3;
+	for (int i = 0; i < 3; i++) {
+		int nd = 1;
+		if (i < dims) {
+			nd = floor(gs[i] / minDomainSize);
+			nd -= nd % 2;
+			if (nd < 2)
+				die("World too small to split into domains for "
+						"%d threads!\n", numThreads);
+		}
+		cb->nd[i] = nd;
+	}
+	cb->domainSize.x = gs[0] / cb->nd[0];
+	cb->domainSize.y = gs[1] / cb->nd[1];
+	cb->domainSize.z = gs[2] / cb->nd[2];
+	printf("Checkerboard of %d x %d x %d domains for %d threads\n",
+				cb->nd[0], cb->nd[1], cb->nd[2], numThreads);
+
+	int nDomains = numDomains(cb);
+	cb->numColours = 1 << dims;
+	cb->domainsPerColour = nDomains / cb->numColours;
+	for (int c = 0; c < cb->numColours; c++) {
+		cb->colourDomains[c] = malloc(cb->domainsPerColour
+					* sizeof(*cb->colourDomains[c]));
+		if (cb->colourDomains[c] == NULL)
+			dieMem();
+	}
+	int colourCount[MAX_COLOURS] = {0};
+	for (int dx = 0; dx < cb->nd[0]; dx++)
+	for (int dy = 0; dy < cb->nd[1]; dy++)
+	for (int dz = 0; dz < cb->nd[2]; dz++) {
+		int c = (dx % 2) | (dy % 2) << 1 | (dz % 2) << 2;
+		int d = (dx * cb->nd[1] + dy) * cb->nd[2] + dz;
+		cb->colourDomains[c][colourCount[c]++] = d;
+	}
+
+	cb->domainStart = malloc((nDomains + 1) * sizeof(*cb->domainStart));
+	cb->domainParticles = malloc(world.numParticles
+					* sizeof(*cb->domainParticles));
+	cb->particleDomain = malloc(world.numParticles
+					* sizeof(*cb->particleDomain));
+	cb->workers = calloc(numThreads, sizeof(*cb->workers));
+	if (cb->domainStart == NULL || cb->domainParticles == NULL
+			|| cb->particleDomain == NULL || cb->workers == NULL)
+		dieMem();
+
+	reserveBoxCapacity(maxParticlesPerBox());
+
+	if (pthread_barrier_init(&cb->barrier, NULL, numThreads) != 0)
+		die("Couldn't initialize the thread barrier!\n");
+	for (int t = 0; t < numThreads; t++) {
+		Worker *w = &cb->workers[t];
+		w->cb = cb;
+		w->index = t;
+		if (t > 0 && pthread_create(&w->thread, NULL,
+							&workerMain, w) != 0)
+			die("Couldn't create worker thread!\n");
+	}
+	return cb;
+}
+
+static void freeCheckerboard(Checkerboard *cb)
+{
+	cb->quit = true;
+	pthread_barrier_wait(&cb->barrier);
+	for (int t = 1; t < cb->numThreads; t++)
+		pthread_join(cb->workers[t].thread, NULL);
+	pthread_barrier_destroy(&cb->barrier);
+
+	for (int c = 0; c < cb->numColours; c++)
+		free(cb->colourDomains[c]);
+	free(cb->domainStart);
+	free(cb->domainParticles);
+	free(cb->particleDomain);
+	free(cb->workers);
+	free(cb);
+}
+
+/* Shift the domains by a random offset and sort the particles into them. */
+static void assignDomains(Checkerboard *cb, Rng *rng)
+{
+	cb->offset.x = cb->domainSize.x * rand01(rng);
+	cb->offset.y = cb->domainSize.y * rand01(rng);
+	cb->offset.z = cb->nd[2] > 1 ? cb->domainSize.z * rand01(rng) : 0;
+
+	int nDomains = numDomains(cb);
+	int *start = cb->domainStart;
+	memset(start, 0, (nDomains + 1) * sizeof(*start));
+	for (int i = 0; i < world.numParticles; i++) {
+		int d = domainOf(cb, world.particles[i].pos);
+		cb->particleDomain[i] = d;
+		start[d + 1]++;
+	}
+	for (int d = 0; d < nDomains; d++)
+		start[d + 1] += start[d];
+	/* Use start[d] as fill pointer, and shift it back afterwards */
+	for (int i = 0; i < world.numParticles; i++)
+		cb->domainParticles[start[cb->particleDomain[i]]++] = i;
+	for (int d = nDomains; d > 0; d--)
+		start[d] = start[d - 1];
+	start[0] = 0;
+}
+
+static void checkerboardSweep(MonteCarloState *mcs, Checkerboard *cb)
+{
+	cb->sweep = mcs->sweeps;
+	Rng rng = rngStream(RNG_CHECKERBOARD, 0, cb->sweep);
+	assignDomains(cb, &rng);
+
+	int order[MAX_COLOURS];
+	for (int c = 0; c < cb->numColours; c++)
+		order[c] = c;
+	randomShuffle(&rng, order, cb->numColours);
+
+	for (int c = 0; c < cb->numColours; c++) {
+		cb->colour = order[c];
+		pthread_barrier_wait(&cb->barrier);
+		workOnColour(&cb->workers[0]);
+		pthread_barrier_wait(&cb->barrier);
+	}
+
+	for (int t = 0; t < cb->numThreads; t++) {
+		Worker *w = &cb->workers[t];
+		mcs->attempted += w->attempted;
+		mcs->accepted += w->accepted;
+		w->attempted = 0;
+		w->accepted = 0;
+	}
+}
+
+/* Largest distance (taking the periodic boundaries into account) a single 
+ * move can take a particle. */
+static double maxDisplacement(double delta)
+{
+	int dims = world.twoDimensional ? 2 : 3;
+	return delta / 2 * sqrt(dims);
+}
+
+/* Sort world.particles along a space filling curve, so the particles we 
+ * visit around a given particle are close to it in memory too. */
+static void sortParticles(MonteCarloState *mcs)
+{
+	sortParticlesSpatially();
+	/* The Verlet lists hold particle indices */
+	if (mcs->conf.verletSkin > 0)
+		rebuildVerletLists();
+	mcs->sortedLocality = particleOrderLocality();
+	mcs->numSorts++;
+}
+
+/* The counters and the tuned delta. The random streams only depend on the 
+ * sweep, so they need nothing. */
+static void monteCarloSave(FILE *f, void *data)
+{
+	MonteCarloState *mcs = (MonteCarloState*) data;
+	checkpointWrite(f, &mcs->attempted, sizeof(mcs->attempted));
+	checkpointWrite(f, &mcs->accepted, sizeof(mcs->accepted));
+	checkpointWrite(f, &mcs->sweeps, sizeof(mcs->sweeps));
+	checkpointWrite(f, &mcs->sortedLocality, sizeof(mcs->sortedLocality));
+	checkpointWrite(f, &mcs->numSorts, sizeof(mcs->numSorts));
+	checkpointWrite(f, &mcs->conf.delta, sizeof(mcs->conf.delta));
+	checkpointWrite(f, &mcs->windowAttempted,
+					sizeof(mcs->windowAttempted));
+	checkpointWrite(f, &mcs->windowAccepted, sizeof(mcs->windowAccepted));
+}
+static bool monteCarloLoad(FILE *f, void *data)
+{
+	MonteCarloState *mcs = (MonteCarloState*) data;
+	if (!checkpointRead(f, &mcs->attempted, sizeof(mcs->attempted))
+			|| !checkpointRead(f, &mcs->accepted,
+						sizeof(mcs->accepted))
+			|| !checkpointRead(f, &mcs->sweeps, sizeof(mcs->sweeps))
+			|| !checkpointRead(f, &mcs->sortedLocality,
+						sizeof(mcs->sortedLocality))
+			|| !checkpointRead(f, &mcs->numSorts,
+						sizeof(mcs->numSorts))
+			|| !checkpointRead(f, &mcs->conf.delta,
+						sizeof(mcs->conf.delta))
+			|| !checkpointRead(f, &mcs->windowAttempted,
+						sizeof(mcs->windowAttempted))
+			|| !checkpointRead(f, &mcs->windowAccepted,
+						sizeof(mcs->windowAccepted)))
+		return false;
+
+	if (mcs->checkerboard != NULL)
+		mcs->checkerboard->delta = mcs->conf.delta;
+	return true;
+}
+static void *monteCarloTaskStart(void *initialData)
+{
+	assert(initialData != NULL);
+	MonteCarloConfig *mcc = (MonteCarloConfig*) initialData;
+
+	/* The Verlet lists get built with the grid, so the boxes need to 
+	 * be big enough for that, see allocVerletLists(). */
+	double minBoxSize = DIAMETER + 1.5 * mcc->verletSkin;
+	if (mcc->verletSkin > 0 && mcc->boxSize < minBoxSize) {
+		printf("Increasing boxsize to %f for the Verlet lists\n",
+								minBoxSize);
+		mcc->boxSize = minBoxSize;
+	}
+
+	allocFilledGrid(mcc->boxSize);
+
+	if (mcc->verletSkin > 0
+			&& !allocVerletLists(DIAMETER, mcc->verletSkin))
+		dieMem();
+	if (mcc->pairHistogramBins > 0
+			&& !allocPairHistogram(mcc->pairHistogramBins,
+					mcc->pairHistogramMaxR,
+					maxDisplacement(mcc->delta)))
+		dieMem();
 
 	MonteCarloState *state = malloc(sizeof(*state));
 	state->conf = *mcc;
 	state->attempted = 0;
 	state->accepted = 0;
+	state->sweeps = 0;
+	state->numSorts = 0;
+	state->sortedLocality = 0;
+	state->checkerboard = NULL;
+	/* The live pair histogram can't handle bigger moves than it was 
+	 * set up for. Otherwise just don't move across half the world, see 
+	 * reboxParticle(). */
+	state->maxDelta = mcc->pairHistogramBins > 0 ? mcc->delta
+						     : world.worldSize / 2;
+	state->windowAttempted = 0;
+	state->windowAccepted = 0;
+	state->order = NULL;
+	if (mcc->sweepOrder != SWEEP_RANDOM) {
+		state->order = malloc(world.numParticles
+						* sizeof(*state->order));
+		if (state->order == NULL)
+			dieMem();
+	}
+	if (mcc->numThreads > 1)
+		state->checkerboard = allocCheckerboard(mcc->delta,
+							mcc->numThreads);
+
+	/* The particles got inserted at random positions, so their order 
+	 * is as bad as it gets. (After a restart, they are in the order of 
+	 * the checkpoint, which the samplers depend on.) */
+	if (mcc->reorderInterval > 0 && !restartedFromCheckpoint())
+		sortParticles(state);
+	addCheckpointSection("monteCarlo", &monteCarloSave, &monteCarloLoad,
+								state);
 
 	free(mcc);
 	return state;
 }
 
-/* Perform a Monte Carlo sweep */
-static TaskSignal monteCarloTaskTick(void *state)
+/* SWEEP ORDER
+ *
+ * Picking a random particle for every move jumps all over memory: the 
+ * particle, its slot and the boxes around it are cold every time. The 
+ * other orders move every particle once per sweep, in an order that keeps 
+ * the neighbourhood in cache for a while:
+ *  - SWEEP_CELLS goes through the grid boxes along the Morton curve, and 
+ *    through the particles of a box in a random order.
+ *  - SWEEP_STORAGE goes through world.particles in blocks of 
+ *    SWEEP_BLOCK_SIZE, in a random order within a block. That is only 
+ *    local when the particles are sorted spatially (-R).
+ * Every single move still satisfies detailed balance, so any sequence of 
+ * them keeps the equilibrium distribution invariant (balance instead of 
+ * detailed balance for the sweep as a whole). The random order within the 
+ * blocks avoids the systematic bias of always moving a particle right 
+ * after the same neighbour. */
+
+#define SWEEP_BLOCK_SIZE 64
+
+static void fillSweepOrder(MonteCarloState *mcs, Rng *rng)
+{
+	int n = world.numParticles;
+	int *order = mcs->order;
+
+	if (mcs->conf.sweepOrder == SWEEP_CELLS) {
+		int got = particlesInBoxOrder(order, rng);
+		assert(got == n);
+		UNUSED(got);
+		return;
+	}
+
+	assert(mcs->conf.sweepOrder == SWEEP_STORAGE);
+	for (int i = 0; i < n; i++)
+		order[i] = i;
+	for (int start = 0; start < n; start += SWEEP_BLOCK_SIZE)
+		randomShuffle(rng, &order[start],
+					MIN(SWEEP_BLOCK_SIZE, n - start));
+}
+
+/* Single threaded sweep: N moves of particles in the order of the config */
+static void serialSweep(MonteCarloState *mcs)
 {
-	assert(state != NULL);
-	MonteCarloState *mcs = (MonteCarloState*) state;
 	MonteCarloConfig *mcc = &mcs->conf;
+	bool verlet = mcc->verletSkin > 0;
+	bool histogram = mcc->pairHistogramBins > 0;
+	Rng rng = rngStream(RNG_SWEEP, 0, mcs->sweeps);
+	const int *order = mcs->order;
+	if (order != NULL)
+		fillSweepOrder(mcs, &rng);
 
-	assert(mcc->delta > 0);
+	for (int i = 0; i < world.numParticles; i++) {
+		int k = (order == NULL ? randIndex(&rng, world.numParticles)
+				       : order[i]);
+		Particle *p = &world.particles[k];
+		Vec3 newPos = p->pos;
+
+		newPos.x += mcc->delta * (rand01(&rng) - 1/2.0);
+		newPos.y += mcc->delta * (rand01(&rng) - 1/2.0);
+		if (!world.twoDimensional)
+			newPos.z += mcc->delta * (rand01(&rng) - 1/2.0);
+		newPos = gridPeriodic(newPos);
+
+		/* Only touch the particle and the grid if the move gets 
+		 * accepted. The histogram does its own overlap test, in the 
+		 * same visit of the boxes as its update. */
+		if (histogram ? !pairHistogramMove(p, newPos, DIAMETER)
+		   : verlet ? verletOverlaps(p, newPos, DIAMETER)
+		            : collides(newPos, p))
+			continue;
+
+		p->pos = newPos;
+		reboxParticle(p);
+		if (verlet)
+			verletParticleMoved(p);
+		mcs->accepted++;
+	}
+
+	mcs->attempted += world.numParticles;
+}
+
+/* COMPRESSION
+ *
+ * Start from random insertion of smaller particles, at a density where 
+ * that's easy, and grow their diameter in steps until they have the real 
+ * one. After every step, the pairs that are now too close get pushed apart 
+ * by MC moves at the new diameter: a move is only accepted where the 
+ * particle doesn't overlap with anything at the new diameter, so overlaps 
+ * can disappear but never appear. Once all are gone, the step is taken.
+ *
+ * Growing only up to the closest pair (as in Lubachevsky-Stillinger) 
+ * never overlaps, but the closest pair of a fluid is so close that this 
+ * hardly makes any progress. */
+
+/* Initial relative growth of the diameter per step */
+#define COMPRESSION_GROWTH 0.01
+/* Give up on a step when its overlaps are still there after this many 
+ * sweeps, and try a smaller one */
+#define COMPRESSION_SWEEPS 20
+/* Keep the step size of the moves at about this acceptance ratio */
+#define COMPRESSION_ACCEPTANCE 0.3
+/* Stuck when the steps get this small */
+#define COMPRESSION_MIN_GROWTH 1e-9
+
+typedef struct {
+	double diameter2;
+	long overlaps;
+} OverlapCount;
+
+static void countOverlapAt(Particle *p1, Particle *p2, void *data)
+{
+	OverlapCount *oc = (OverlapCount*) data;
+	if (nearestImageDistance2(p1->pos, p2->pos) < oc->diameter2)
+		oc->overlaps++;
+}
 
+static long overlapsAt(double diameter)
+{
+	OverlapCount oc = { .diameter2 = SQUARE(diameter), .overlaps = 0 };
+	forEveryPairD(&countOverlapAt, &oc);
+	return oc.overlaps;
+}
+
+/* N moves of random particles of the given diameter, drawing from the 
+ * stream of the given sweep. Returns the number of accepted moves. */
+static long compressionSweep(double diameter, double delta, long sweep)
+{
+	Rng rng = rngStream(RNG_COMPRESSION, 0, sweep);
+	long accepted = 0;
 	for (int i = 0; i < world.numParticles; i++) {
-		Particle *p = &world.particles[randIndex(world.numParticles)];
-		Vec3 oldPos = p->pos;
+		Particle *p = &world.particles[randIndex(&rng,
+							world.numParticles)];
+		Vec3 newPos = p->pos;
 
-		p->pos.x += mcc->delta * (rand01() - 1/2.0);
-		p->pos.y += mcc->delta * (rand01() - 1/2.0);
+		newPos.x += delta * (rand01(&rng) - 1/2.0);
+		newPos.y += delta * (rand01(&rng) - 1/2.0);
 		if (!world.twoDimensional)
-			p->pos.z += mcc->delta * (rand01() - 1/2.0);
+			newPos.z += delta * (rand01(&rng) - 1/2.0);
+		newPos = gridPeriodic(newPos);
 
+		if (overlapsAnyParticle(newPos, diameter, p))
+			continue;
+		p->pos = newPos;
 		reboxParticle(p);
+		accepted++;
+	}
+	return accepted;
+}
+
+void compressWorld(double startDensity, double boxSize, double delta)
+{
+	assert(spgrid.boxCount == NULL);
+	int dims = world.twoDimensional ? 2 : 3;
+	double particleVolume = world.twoDimensional ? M_PI / 4 : M_PI / 6;
+	double density = world.numParticles * particleVolume
+					/ pow(world.worldSize, dims);
+	if (startDensity >= density)
+		startDensity = density;
 
-		if (collides(p)) {
-			/* Back to old position! */
-			p->pos = oldPos;
-			reboxParticle(p);
+	allocGridOfBoxSize(boxSize, false);
+	double diameter = DIAMETER * pow(startDensity / density, 1.0 / dims);
+	fillWorld(diameter);
+
+	double growth = COMPRESSION_GROWTH;
+	double maxDelta = delta;
+	long sweeps = 0;
+	while (diameter < DIAMETER) {
+		if (growth < COMPRESSION_MIN_GROWTH)
+			die("\nCompression got stuck at packing fraction %f!\n",
+				density * pow(diameter / DIAMETER, dims));
+		double next = MIN(DIAMETER, diameter * (1 + growth));
+
+		long overlaps = overlapsAt(next);
+		for (int k = 0; k < COMPRESSION_SWEEPS && overlaps > 0; k++) {
+			long accepted = compressionSweep(next, delta, sweeps);
+			sweeps++;
+			double acceptance = (double) accepted
+						/ MAX(world.numParticles, 1);
+			delta *= (acceptance > COMPRESSION_ACCEPTANCE ?
+								1.1 : 0.9);
+			delta = MIN(delta, maxDelta);
+			overlaps = overlapsAt(next);
+		}
+
+		if (overlaps == 0) {
+			diameter = next;
+			growth *= 1.5;
 		} else {
-			mcs->accepted++;
+			growth /= 2;
 		}
+		growth = MIN(growth, COMPRESSION_GROWTH);
+
+		printf("\rCompressing: packing fraction %f after %ld sweeps",
+				density * pow(diameter / DIAMETER, dims),
+				sweeps);
+		fflush(stdout);
 	}
+	printf("\n");
 
-	mcs->attempted += world.numParticles;
+	freeGrid();
+	compressed = true;
+}
+
+/* DELTA TUNING
+ *
+ * During the relaxation, every tuneWindow sweeps scale delta by the ratio 
+ * of the acceptance in that window to the target. Acceptance goes down 
+ * monotonically with delta, so that converges. Changing delta depending on 
+ * the history breaks detailed balance, which is why it only happens before 
+ * the sampling starts. With the live pair histogram, delta never grows 
+ * beyond where it started, as allocPairHistogram() sized its reach from 
+ * maxDisplacement() of that. Otherwise it stays below half the world size, 
+ * so reboxParticle() can still count the periodic images. */
+
+/* Bounds on the factor delta changes by in one window */
+#define TUNE_MIN_FACTOR 0.5
+#define TUNE_MAX_FACTOR 2.0
+
+static void tuneDelta(MonteCarloState *mcs)
+{
+	MonteCarloConfig *mcc = &mcs->conf;
+	if (mcc->targetAcceptance <= 0 || mcs->sweeps > mcc->tuneSweeps)
+		return;
+
+	if (mcs->sweeps == mcc->tuneSweeps) {
+		printf("\nTuned delta to %f (acceptance %f in the last "
+				"window), pass -d %f to start from there\n",
+				mcc->delta,
+				(double) (mcs->accepted - mcs->windowAccepted)
+				/ MAX(mcs->attempted - mcs->windowAttempted, 1),
+				mcc->delta);
+		return;
+	}
+	if (mcs->sweeps % mcc->tuneWindow != 0)
+		return;
+
+	long attempted = mcs->attempted - mcs->windowAttempted;
+	long accepted = mcs->accepted - mcs->windowAccepted;
+	mcs->windowAttempted = mcs->attempted;
+	mcs->windowAccepted = mcs->accepted;
+	if (attempted == 0)
+		return;
+
+	double acceptance = (double) accepted / attempted;
+	double factor = acceptance / mcc->targetAcceptance;
+	factor = MAX(TUNE_MIN_FACTOR, MIN(TUNE_MAX_FACTOR, factor));
+	mcc->delta = MIN(mcs->maxDelta, mcc->delta * factor);
+	if (mcs->checkerboard != NULL)
+		mcs->checkerboard->delta = mcc->delta;
+}
+
+/* Perform a Monte Carlo sweep */
+static TaskSignal monteCarloTaskTick(void *state)
+{
+	assert(state != NULL);
+	MonteCarloState *mcs = (MonteCarloState*) state;
+	MonteCarloConfig *mcc = &mcs->conf;
+
+	assert(mcc->delta > 0);
+
+	if (mcs->checkerboard != NULL)
+		checkerboardSweep(mcs, mcs->checkerboard);
+	else
+		serialSweep(mcs);
+	mcs->sweeps++;
+	tuneDelta(mcs);
+
+	assert(mcc->pairHistogramBins == 0 || pairHistogramCheck());
+
+	if (mcc->reorderInterval > 0 && mcs->sweeps % mcc->reorderInterval == 0
+			&& particleOrderLocality() > REORDER_DEGRADATION
+						* mcs->sortedLocality)
+		sortParticles(mcs);
 
 	return TASK_OK;
 }
@@ -110,9 +814,29 @@ static TaskSignal monteCarloTaskTick(void *state)
 static void monteCarloTaskStop(void *state)
 {
 	MonteCarloState *mcs = (MonteCarloState*) state;
+	removeCheckpointSection("monteCarlo");
 
 	printf("Acceptance ratio: %f\n",
 			((double) mcs->accepted) / mcs->attempted);
+	if (mcs->conf.targetAcceptance > 0)
+		printf("Delta: %f\n", mcs->conf.delta);
+
+	if (mcs->conf.verletSkin > 0) {
+		printf("Verlet list rebuilds: %ld full, %ld single "
+				"particle (%ld grid fallbacks)\n",
+				verletNumRebuilds(), verletNumRelists(),
+				verletNumFallbacks());
+		freeVerletLists();
+	}
+	if (mcs->conf.pairHistogramBins > 0)
+		freePairHistogram();
+	if (mcs->conf.reorderInterval > 0)
+		printf("Spatially sorted the particles %ld times\n",
+							mcs->numSorts);
+
+	if (mcs->checkerboard != NULL)
+		freeCheckerboard(mcs->checkerboard);
+	free(mcs->order);
 
 	freeGrid();
 	free(mcs);
@@ -127,6 +851,30 @@ Task makeMonteCarloTask(MonteCarloConfig *mcc)
 	if (mcc->delta <= 0)
 		die("MC delta is zero (or negative)!\n");
 
+	if (mcc->verletSkin < 0)
+		die("Verlet skin is negative!\n");
+
+	if (mcc->reorderInterval < 0)
+		die("Reorder interval is negative!\n");
+
+	if (mcc->numThreads > 1 && mcc->verletSkin > 0)
+		die("Verlet lists can't be used with multiple threads!\n");
+
+	if (mcc->pairHistogramBins < 0 || (mcc->pairHistogramBins > 0
+					&& mcc->pairHistogramMaxR <= 0))
+		die("Invalid pair histogram!\n");
+
+	if (mcc->targetAcceptance < 0 || mcc->targetAcceptance >= 1
+			|| (mcc->targetAcceptance > 0 && mcc->tuneWindow <= 0))
+		die("Invalid delta tuning!\n");
+
+	if (mcc->numThreads > 1 && mcc->sweepOrder != SWEEP_RANDOM)
+		die("Only single threaded sweeps can change the order!\n");
+
+	if (mcc->numThreads > 1 && mcc->pairHistogramBins > 0)
+		die("The pair histogram can't be kept with multiple "
+							"threads!\n");
+
 	MonteCarloConfig *mccCopy = malloc(sizeof(*mccCopy));
 	memcpy(mccCopy, mcc, sizeof(*mccCopy));
 
@@ -1,5 +1,13 @@
 #include "system.h"
 
+/* Order in which a single threaded sweep visits the particles */
+typedef enum
+{
+	SWEEP_RANDOM, /* N moves of particles picked at random */
+	SWEEP_CELLS, /* Every particle once, box by box, see monteCarlo.c */
+	SWEEP_STORAGE, /* Every particle once, in blocks of world.particles */
+} SweepOrder;
+
 typedef struct
 {
 	double boxSize; /* Particles have diameter == 1. */
@@ -7,8 +15,43 @@ typedef struct
 	int histBins; /* Number of bins in the distance histogram */
 	const char *filename; /* Filename to dump histogram to, or NULL if 
 				 you don't want to measure it */
+	double verletSkin; /* Skin of the Verlet lists, or 0 to only use the 
+			      cell lists of the grid. */
+	int reorderInterval; /* Check the spatial order of world.particles 
+				every this many sweeps, and sort them again 
+				when it got worse. 0 to never sort. */
+	int numThreads; /* Sweep with this many threads on a checkerboard 
+			   of domains if > 1, see monteCarlo.c. */
+	int pairHistogramBins; /* Keep a live pair histogram with this many 
+				  bins (see pairHistogram.h), or 0 to not 
+				  keep one. */
+	double pairHistogramMaxR; /* Range of that histogram */
+	double targetAcceptance; /* Tune delta toward this acceptance ratio 
+				    during the first tuneSweeps sweeps, or 0 
+				    to keep it fixed. delta is the upper 
+				    bound then if there is a live pair 
+				    histogram, the start value otherwise. */
+	int tuneWindow; /* Sweeps between two adjustments of delta */
+	long tuneSweeps; /* Tune only during this many sweeps (the 
+			    relaxation before measuring), so delta is 
+			    fixed while sampling. */
+	SweepOrder sweepOrder; /* Only for single threaded sweeps */
 } MonteCarloConfig;
 
 Task makeMonteCarloTask(MonteCarloConfig *mcc);
 
+/* Allocates the spgrid with boxes of (about) the given size, and puts all 
+ * particles of the world at random positions in it without overlaps. When 
+ * the particles came from a checkpoint, a configuration or compressWorld(), 
+ * they stay where they are instead. The other simulation tasks start from 
+ * this too. */
+void allocFilledGrid(double boxSize);
+
+/* Inserts the particles at random in the world, as smaller spheres that 
+ * would fill it at startDensity, and then grows them to their real size 
+ * with MC moves of at most the given delta, see monteCarlo.c. 
+ * allocFilledGrid() then starts from there. Dies if that gets stuck. 
+ * Precondition: the grid is not allocated. */
+void compressWorld(double startDensity, double boxSize, double delta);
+
 
@@ -3,59 +3,59 @@
 #include <stdarg.h>
 #include "octave.h"
 
-void octaveStartComment(void)
+void octaveStartComment(FILE *f)
 {
-	printf("## ");
+	fprintf(f, "## ");
 }
 
-void octaveEndComment(void)
+void octaveEndComment(FILE *f)
 {
-	printf("\n");
+	fprintf(f, "\n");
 }
 
-void octaveComment(const char *fmt, ...)
+void octaveComment(FILE *f, const char *fmt, ...)
 {
 	va_list args;
 
-	octaveStartComment();
+	octaveStartComment(f);
 	va_start(args, fmt);
-	vprintf(fmt, args);
+	vfprintf(f, fmt, args);
 	va_end(args);
-	octaveEndComment();
+	octaveEndComment(f);
 }
 
-void octaveScalar(const char *name, double value)
+void octaveScalar(FILE *f, const char *name, double value)
 {
-	printf("\n");
-	printf("# name: %s\n", name);
-	printf("# type: scalar\n");
-	printf("%e\n", value);
+	fprintf(f, "\n");
+	fprintf(f, "# name: %s\n", name);
+	fprintf(f, "# type: scalar\n");
+	fprintf(f, "%e\n", value);
 }
-void octaveString(const char *name, const char *string)
+void octaveString(FILE *f, const char *name, const char *string)
 {
-	printf("\n");
-	printf("# name: %s\n", name);
-	printf("# type: string\n");
-	printf("# elements: 1\n");
-	printf("# length: %d\n", (int) strlen(string));
-	printf("%s\n", string);
+	fprintf(f, "\n");
+	fprintf(f, "# name: %s\n", name);
+	fprintf(f, "# type: string\n");
+	fprintf(f, "# elements: 1\n");
+	fprintf(f, "# length: %d\n", (int) strlen(string));
+	fprintf(f, "%s\n", string);
 }
 
-void octaveMatrixHeader(const char *name, int rows, int cols)
+void octaveMatrixHeader(FILE *f, const char *name, int rows, int cols)
 {
-	printf("\n");
-	printf("# name: %s\n", name);
-	printf("# type: matrix\n");
-	printf("# rows: %d\n", rows);
-	printf("# columns: %d\n", cols);
+	fprintf(f, "\n");
+	fprintf(f, "# name: %s\n", name);
+	fprintf(f, "# type: matrix\n");
+	fprintf(f, "# rows: %d\n", rows);
+	fprintf(f, "# columns: %d\n", cols);
 }
 
-void octave3DMatrixHeader(const char *name, int nx, int ny, int nz)
+void octave3DMatrixHeader(FILE *f, const char *name, int nx, int ny, int nz)
 {
-	printf("\n");
-	printf("# name: %s\n", name);
-	printf("# type: matrix\n");
-	printf("# ndims: 3\n");
-	printf("%d %d %d\n", nx, ny, nz);
+	fprintf(f, "\n");
+	fprintf(f, "# name: %s\n", name);
+	fprintf(f, "# type: matrix\n");
+	fprintf(f, "# ndims: 3\n");
+	fprintf(f, "%d %d %d\n", nx, ny, nz);
 }
 
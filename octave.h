@@ -1,19 +1,22 @@
+#include <stdio.h>
+
+/* All of these write to the given stream f. */
+
 /* Don't use line breaks in comments. If you need multiple lines, call me 
  * multiple times.
  * Alternatively, call octaveStartComment(), then print stuff *without 
  * linebreaks* and end the comment by calling octaveEndComment().
  * Also. comments cannot be placed in between matrix data. */
-void octaveComment(const char *fmt, ...);
-void octaveStartComment(void);
-void octaveEndComment(void);
+void octaveComment(FILE *f, const char *fmt, ...);
+void octaveStartComment(FILE *f);
+void octaveEndComment(FILE *f);
 
-void octaveScalar(const char *name, double value);
-void octaveString(const char *name, const char *string);
-void octaveMatrixHeader(const char *name, int rows, int cols);
+void octaveScalar(FILE *f, const char *name, double value);
+void octaveString(FILE *f, const char *name, const char *string);
+void octaveMatrixHeader(FILE *f, const char *name, int rows, int cols);
 
 /* After this, you print:
  *  - every column below the previous one in the 2D matrix name(:,:,i)
  *    [ie: dump the matrix in column major form]
  *  - do this for all such matrices i = 1:nz */
-void octave3DMatrixHeader(const char *name, int nx, int ny, int nz);
-
+void octave3DMatrixHeader(FILE *f, const char *name, int nx, int ny, int nz);
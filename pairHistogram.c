@@ -0,0 +1,184 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include "pairHistogram.h"
+#include "spgrid.h"
+
+static long *bins; /* NULL when not allocated */
+static int numBins = 0;
+static double maxR = 0;
+static double maxR2 = 0;
+static double invBinWidth = 0;
+static double maxMove = 0; /* Largest move pairHistogramMove() can handle */
+
+/* Bins that the move being tried changes: bin b gains a pair for an entry 
+ * b, and loses one for an entry ~b. They only go into the histogram when 
+ * the move doesn't overlap. */
+static int *changes;
+static int numChanges = 0;
+static int changesCapacity = 0;
+
+
+/* Add 'weight' to the bin of the pair at squared distance r2, if it's
+ * close enough to count. */
+static __inline__ void countPair(long *histogram, double r2, long weight)
+{
+	if (r2 >= maxR2)
+		return;
+	int bin = sqrt(r2) * invBinWidth;
+	histogram[MIN(bin, numBins - 1)] += weight;
+}
+
+typedef struct {
+	const Particle *p;
+	long *histogram;
+} PairCount;
+
+/* Counts the pair once, from the particle that comes first */
+static bool countLaterPair(Particle *q, Vec3 qPos, void *data)
+{
+	PairCount *pc = (PairCount*) data;
+	if (q > pc->p)
+		countPair(pc->histogram, nearestImageDistance2(pc->p->pos, qPos),
+									1);
+	return true;
+}
+
+/* Bin all pairs of the world within maxR into histogram. */
+static void countAllPairs(long *histogram)
+{
+	PairCount pc = {.histogram = histogram};
+	for (int i = 0; i < world.numParticles; i++) {
+		pc.p = &world.particles[i];
+		forEveryParticleWithin(pc.p->pos, maxR, pc.p, &countLaterPair,
+									&pc);
+	}
+}
+
+bool allocPairHistogram(int nBins, double range, double maxDist)
+{
+	assert(bins == NULL);
+	assert(nBins > 0 && range > 0 && maxDist >= 0);
+	assert(2 * range <= spgrid.gridSize.x);
+
+	bins = calloc(nBins, sizeof(*bins));
+	if (bins == NULL)
+		return false;
+	numBins = nBins;
+	maxR = range;
+	maxR2 = SQUARE(range);
+	invBinWidth = nBins / range;
+	maxMove = maxDist;
+
+	countAllPairs(bins);
+	return true;
+}
+
+void freePairHistogram(void)
+{
+	free(bins);
+	free(changes);
+	bins = NULL;
+	changes = NULL;
+	numBins = 0;
+	numChanges = changesCapacity = 0;
+}
+
+bool pairHistogramActive(void)
+{
+	return bins != NULL;
+}
+
+typedef struct {
+	Vec3 oldPos;
+	Vec3 newPos;
+	double diameter2;
+} Move;
+
+static void addChange(double r2, bool gained)
+{
+	if (r2 >= maxR2)
+		return;
+	if (UNLIKELY(numChanges == changesCapacity)) {
+		changesCapacity = MAX(2 * changesCapacity, 64);
+		changes = realloc(changes, changesCapacity * sizeof(*changes));
+		if (changes == NULL)
+			dieMem();
+	}
+	int bin = MIN((int) (sqrt(r2) * invBinWidth), numBins - 1);
+	changes[numChanges++] = gained ? bin : ~bin;
+}
+
+static bool movePair(Particle *q, Vec3 qPos, void *data)
+{
+	UNUSED(q);
+	Move *move = (Move*) data;
+	double newR2 = nearestImageDistance2(move->newPos, qPos);
+	if (newR2 < move->diameter2)
+		return false;
+	addChange(nearestImageDistance2(move->oldPos, qPos), false);
+	addChange(newR2, true);
+	return true;
+}
+
+/* The partners of p at its old position are within maxR + maxMove of the 
+ * new one, so one visit around the new position finds both its old and 
+ * its new pairs. The nearest boxes come first, so a move that overlaps 
+ * usually gets rejected before we get to the boxes further out. */
+bool pairHistogramMove(Particle *p, Vec3 newPos, double diameter)
+{
+	assert(bins != NULL);
+	assert(nearestImageDistance(p->pos, newPos) <= maxMove * (1 + 1e-9));
+	assert(diameter <= spgrid.boxSize);
+	Move move = {
+		.oldPos = p->pos,
+		.newPos = newPos,
+		.diameter2 = SQUARE(diameter),
+	};
+	numChanges = 0;
+	if (!forEveryParticleWithin(newPos, maxR + maxMove, p, &movePair,
+									&move))
+		return false;
+
+	for (int i = 0; i < numChanges; i++) {
+		int c = changes[i];
+		if (c >= 0)
+			bins[c]++;
+		else
+			bins[~c]--;
+	}
+	return true;
+}
+
+const long *pairHistogramBins(void)
+{
+	return bins;
+}
+int pairHistogramNumBins(void)
+{
+	return numBins;
+}
+double pairHistogramMaxR(void)
+{
+	return maxR;
+}
+
+bool pairHistogramCheck(void)
+{
+	assert(bins != NULL);
+	long *fresh = calloc(numBins, sizeof(*fresh));
+	if (fresh == NULL)
+		dieMem();
+	countAllPairs(fresh);
+
+	bool ok = true;
+	for (int i = 0; i < numBins; i++) {
+		if (fresh[i] == bins[i])
+			continue;
+		fprintf(stderr, "Pair histogram bin %d holds %ld pairs, but "
+				"there are %ld!\n", i, bins[i], fresh[i]);
+		ok = false;
+	}
+	free(fresh);
+	return ok;
+}
@@ -0,0 +1,54 @@
+#ifndef _PAIRHISTOGRAM_H_
+#define _PAIRHISTOGRAM_H_
+
+/* Incrementally maintained histogram of the pair distances, on top of the
+ * spgrid.
+ *
+ * Recomputing every pair within maxR for every sample of g(r) is a waste
+ * when only a single particle moves at a time. Instead, this keeps a live
+ * histogram of all pair distances below maxR: every time a particle moves,
+ * its pairs at the old position get taken out, and its pairs at the new
+ * position get put in. A sample is then just a copy of the bins.
+ *
+ * The overlap test of a trial move, and both the old and the new pairs of 
+ * the particle, come from a single visit of the grid boxes within maxR 
+ * plus the largest possible displacement of its new position. The grid 
+ * keeps its normal box size: the nearest boxes get visited first, so most 
+ * rejected moves never look further out. Accepted moves still visit every 
+ * pair within the range, so this only pays off for a short range maxR. */
+
+#include "world.h"
+
+/* Allocates and fills the histogram with all pairs of the world.
+ * Precondition: All particles are in the spgrid, and maxR is at most half 
+ * the grid size. maxMove is the largest distance a particle can move in 
+ * one go.
+ * Returns true on succes, false on failure. */
+bool allocPairHistogram(int numBins, double maxR, double maxMove);
+
+/* Frees the histogram. */
+void freePairHistogram(void);
+
+/* Returns true if allocPairHistogram() was called (and the histogram
+ * didn't get freed since). */
+bool pairHistogramActive(void);
+
+/* Trial move of particle p to newPos. Returns false if p would overlap 
+ * with another particle there, assuming all particles have the given 
+ * diameter. Otherwise the histogram gets updated for the move and true is 
+ * returned, and the caller then has to actually move p (and rebox it).
+ * Precondition: newPos is at most maxMove away from p, and within the 
+ * grid. diameter is at most the box size of the grid. */
+bool pairHistogramMove(Particle *p, Vec3 newPos, double diameter);
+
+/* The number of distinct pairs with a distance in bin i is bins[i], for
+ * bins of width maxR / numBins. */
+const long *pairHistogramBins(void);
+int pairHistogramNumBins(void);
+double pairHistogramMaxR(void);
+
+/* Check the live histogram against a full recompute of all pairs. Returns
+ * true if they're the same, false otherwise. */
+bool pairHistogramCheck(void);
+
+#endif
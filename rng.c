@@ -0,0 +1,68 @@
+#include "rng.h"
+#include <unistd.h>
+#include <sys/time.h>
+
+/* Philox4x32 constants: the multipliers, and the Weyl sequence that bumps
+ * the key between the rounds. */
+#define PHILOX_M0 0xD2511F53u
+#define PHILOX_M1 0xCD9E8D57u
+#define PHILOX_W0 0x9E3779B9u
+#define PHILOX_W1 0xBB67AE85u
+#define PHILOX_ROUNDS 10
+
+static uint64_t seed = 0;
+
+void seedRandomWith(uint64_t s)
+{
+	seed = s;
+}
+void seedRandom(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	seedRandomWith(tv.tv_usec ^ tv.tv_sec 
+			^ ((uint64_t)getpid() * 123456789));
+}
+uint64_t randomSeed(void)
+{
+	return seed;
+}
+
+/* RNG_BLOCKS Philox blocks at once, as independent lanes so the rounds 
+ * vectorize. */
+void rngRefill(Rng *rng)
+{
+	uint32_t c0[RNG_BLOCKS], c1[RNG_BLOCKS], c2[RNG_BLOCKS], c3[RNG_BLOCKS];
+	for (int j = 0; j < RNG_BLOCKS; j++) {
+		c0[j] = rng->counter[0] + j;
+		c1[j] = rng->counter[1];
+		c2[j] = rng->counter[2];
+		c3[j] = rng->counter[3];
+	}
+	rng->counter[0] += RNG_BLOCKS;
+
+	uint32_t k0 = rng->key[0], k1 = rng->key[1];
+	for (int round = 0; round < PHILOX_ROUNDS; round++) {
+		for (int j = 0; j < RNG_BLOCKS; j++) {
+			uint64_t p0 = (uint64_t) PHILOX_M0 * c0[j];
+			uint64_t p1 = (uint64_t) PHILOX_M1 * c2[j];
+			uint32_t n0 = (uint32_t) (p1 >> 32) ^ c1[j] ^ k0;
+			uint32_t n2 = (uint32_t) (p0 >> 32) ^ c3[j] ^ k1;
+			c1[j] = (uint32_t) p1;
+			c3[j] = (uint32_t) p0;
+			c0[j] = n0;
+			c2[j] = n2;
+		}
+		k0 += PHILOX_W0;
+		k1 += PHILOX_W1;
+	}
+
+	/* 53 random bits per double in [0, 1) */
+	for (int j = 0; j < RNG_BLOCKS; j++) {
+		uint64_t a = ((uint64_t) c1[j] << 32) | c0[j];
+		uint64_t b = ((uint64_t) c3[j] << 32) | c2[j];
+		rng->buffer[2*j]     = (a >> 11) * (1.0 / 9007199254740992.0);
+		rng->buffer[2*j + 1] = (b >> 11) * (1.0 / 9007199254740992.0);
+	}
+	rng->next = 0;
+}
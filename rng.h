@@ -0,0 +1,138 @@
+#ifndef _RNG_H_
+#define _RNG_H_
+
+/* Counter based random numbers (Philox4x32-10, Salmon et al., "Parallel
+ * random numbers: as easy as 1, 2, 3", SC 2011).
+ *
+ * There is no generator state that advances: the numbers are a keyed hash
+ * of a counter. So instead of one global generator, everything that needs
+ * random numbers opens its own stream for what it is doing right now,
+ * identified by
+ *   - the seed of the run,
+ *   - the purpose (which part of the code draws, see RngPurpose),
+ *   - an id (the particle, domain, ... the numbers are for), and
+ *   - the sweep (or chain, ...) number.
+ * The same stream always gives the same numbers, no matter which thread
+ * draws them, in which order the streams get opened, or what else got
+ * drawn before. That makes runs reproducible regardless of the number of
+ * threads, lets threads draw without sharing anything, and means a
+ * checkpoint only has to store the seed.
+ *
+ * A stream fills a small buffer a couple of Philox blocks at a time (the
+ * blocks are independent, so that loop vectorizes), and hands out those
+ * numbers until it needs the next blocks. */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <math.h>
+
+#ifndef M_PI
+#define M_PI	3.14159265358979323846
+#endif
+
+/* Who draws the numbers. Every user gets its own purpose, so streams of
+ * different users never overlap. Only append to this, the values end up in
+ * the numbers of every run. */
+typedef enum
+{
+	RNG_INSERTION, /* Random insertion, id = particle */
+	RNG_SWEEP, /* Single threaded MC sweeps */
+	RNG_CHECKERBOARD, /* Domain offsets and colour order of a sweep */
+	RNG_DOMAIN, /* Moves within a checkerboard domain, id = domain */
+	RNG_COMPRESSION, /* MC sweeps while compressing */
+	RNG_EVENT_CHAIN, /* Start of an event chain */
+	RNG_VELOCITIES, /* Initial velocities for EDMD, id = particle */
+} RngPurpose;
+
+/* Doubles per refill of the buffer: RNG_BLOCKS Philox blocks of two
+ * doubles each. */
+#define RNG_BLOCKS 4
+#define RNG_BUFFER (2 * RNG_BLOCKS)
+
+typedef struct
+{
+	uint32_t key[2];
+	uint32_t counter[4]; /* counter[0] counts the blocks of the stream */
+	int next; /* Next unused number in buffer */
+	double buffer[RNG_BUFFER];
+	bool normalCached; /* randNorm() makes two at a time */
+	double normalCache;
+} Rng;
+
+/* Sets the seed of all streams opened from now on. */
+void seedRandomWith(uint64_t seed);
+/* Seeds based on the current time and PID of the process */
+void seedRandom(void);
+uint64_t randomSeed(void);
+
+/* Refills the buffer with the next blocks of the stream. */
+void rngRefill(Rng *rng);
+
+/* Opens the stream of the given purpose and id at the given sweep (or
+ * whatever the user counts). Cheap: nothing gets generated until the first
+ * draw. */
+static __inline__ Rng rngStream(RngPurpose purpose, uint32_t id,
+							uint64_t sweep)
+{
+	/* Sweeps won't come near 2^56, so the purpose fits in the top byte */
+	uint64_t seed = randomSeed();
+	Rng rng;
+	rng.key[0] = (uint32_t) seed;
+	rng.key[1] = (uint32_t) (seed >> 32);
+	rng.counter[0] = 0;
+	rng.counter[1] = id;
+	rng.counter[2] = (uint32_t) sweep;
+	rng.counter[3] = (uint32_t) (sweep >> 32) ^ ((uint32_t) purpose << 24);
+	rng.next = RNG_BUFFER;
+	rng.normalCached = false;
+	return rng;
+}
+
+/* Returns a uniform random number x, where 0 <= x < 1. */
+static __inline__ double rand01(Rng *rng)
+{
+	if (rng->next == RNG_BUFFER)
+		rngRefill(rng);
+	return rng->buffer[rng->next++];
+}
+
+/* Returns a uniform random index x, where 0 <= x < numElements. */
+static __inline__ int randIndex(Rng *rng, int numElements)
+{
+	return (int) (numElements * rand01(rng));
+}
+
+/* Puts the n elements of array in a uniformly random order. */
+static __inline__ void randomShuffle(Rng *rng, int *array, int n)
+{
+	for (int i = n - 1; i > 0; i--) {
+		int j = randIndex(rng, i + 1);
+		int tmp = array[i];
+		array[i] = array[j];
+		array[j] = tmp;
+	}
+}
+
+/* Standard normal random number. */
+static __inline__ double randNorm(Rng *rng)
+{
+	if (rng->normalCached) {
+		rng->normalCached = false;
+		return rng->normalCache;
+	}
+
+	/* Box-Muller transform */
+	/* 0 < u1,u2 <= 1 */
+	double u1 = 1 - rand01(rng);
+	double u2 = 1 - rand01(rng);
+
+	double sqrtLog = sqrt(-2 * log(u1));
+	double c = cos(2*M_PI * u2);
+	double s = (u2 < 0.5 ? 1 : -1) * sqrt(1 - c*c);
+
+	rng->normalCache = sqrtLog * s;
+	rng->normalCached = true;
+	return sqrtLog * c;
+}
+
+#endif
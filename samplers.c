@@ -1,8 +1,11 @@
 #include <string.h>
 #include <stdio.h>
+#include <pthread.h>
 #include "samplers.h"
 #include "spgrid.h"
 #include "octave.h"
+#include "pairHistogram.h"
+#include "checkpoint.h"
 
 #if 0
 /* Simple sampler start that just passes the configuration data as the 
@@ -38,51 +41,129 @@ Sampler dumpStatsSampler(void)
 	sampler.sample = &dumpStatsSample;
 	sampler.stop   = NULL;
 	sampler.header = NULL;
+	sampler.pairs  = NULL;
+	sampler.save   = NULL;
+	sampler.load   = NULL;
 	return sampler;
 }
 
 
 /* PAIR CORRELATION SAMPLER */
+
+/* The pairs come from the shared pair pass of the measurement (see 
+ * Sampler.pairs). Every thread of that pass bins its pairs in its own 
+ * histogram, and those get summed in sample(), which gives exactly the 
+ * same histogram for any number of threads.
+ * The counts of every sample also go to a blocking analysis per bin, for 
+ * the error bars. */
 typedef struct {
-	long *bins;
+	long *bins; /* Summed over all samples */
+	long *sampleBins; /* Counts of the current sample */
+	long **threadBins; /* Counts of the current sample per thread */
+	int numThreads;
+	Blocking *blocking; /* Of the counts of every bin */
 	PairCorrelationConfig conf;
+	double maxR2; /* Compare squared distances */
+	double invBinWidth;
 } PairCorrelationData;
+
 static void *pairCorrelationStart(SamplerData *sd, void *conf)
 {
-	UNUSED(sd);
 	assert(conf != NULL);
 
 	PairCorrelationConfig *pcc = (PairCorrelationConfig*) conf;
-	PairCorrelationData *pcd = malloc(sizeof(*pcd));
+	double ws = world.worldSize;
+	if (pcc->maxR > ws / 2)
+		die("Pair correlation range %f is more than half the world "
+						"size %f!\n", pcc->maxR, ws);
+
+	/* Everything we don't need in live mode stays NULL */
+	PairCorrelationData *pcd = calloc(1, sizeof(*pcd));
+	if (pcd == NULL)
+		dieMem();
 	pcd->conf = *pcc;
 	pcd->bins = calloc(pcc->numBins, sizeof(*pcd->bins));
+	pcd->sampleBins = calloc(pcc->numBins, sizeof(*pcd->sampleBins));
+	pcd->blocking = malloc(pcc->numBins * sizeof(*pcd->blocking));
+	if (pcd->bins == NULL || pcd->sampleBins == NULL
+			|| pcd->blocking == NULL)
+		dieMem();
+	for (int i = 0; i < pcc->numBins; i++)
+		blockingInit(&pcd->blocking[i]);
+	pcd->maxR2 = SQUARE(pcc->maxR);
+	pcd->invBinWidth = pcc->numBins / pcc->maxR;
+
+	if (!pcc->live) {
+		pcd->numThreads = sd->pairThreads;
+		pcd->threadBins = malloc(pcd->numThreads
+						* sizeof(*pcd->threadBins));
+		if (pcd->threadBins == NULL)
+			dieMem();
+		for (int t = 0; t < pcd->numThreads; t++) {
+			pcd->threadBins[t] = calloc(pcc->numBins,
+						sizeof(*pcd->threadBins[t]));
+			if (pcd->threadBins[t] == NULL)
+				dieMem();
+		}
+	} else if (!pairHistogramActive()
+			|| pairHistogramNumBins() != pcc->numBins
+			|| pairHistogramMaxR() != pcc->maxR) {
+		die("Live pair correlation needs a pair histogram with the "
+						"same bins and range!\n");
+	}
 
 	free(pcc);
 	return pcd;
 }
 
-static void pairCorrelationHelper(Particle *p1, Particle *p2, void *data)
+static void pairCorrelationPairs(SamplerData *sd, void *data, int thread,
+						const PairBatch *batch)
 {
+	UNUSED(sd);
 	PairCorrelationData *pcd = (PairCorrelationData*) data;
-	double maxR = pcd->conf.maxR;
-	int nBins = pcd->conf.numBins;
+	long *bins = pcd->threadBins[thread];
+	double maxR2 = pcd->maxR2;
+	double invBinWidth = pcd->invBinWidth;
+	int lastBin = pcd->conf.numBins - 1;
 
-	double r = nearestImageDistance(p1->pos, p2->pos);
-	if (r >= maxR)
-		return;
-
-	pcd->bins[(int) (nBins * r / maxR)] += 1;
+	for (int k = 0; k < batch->n; k++) {
+		double r2 = batch->r2[k];
+		if (r2 >= maxR2)
+			continue;
+		int bin = sqrt(r2) * invBinWidth;
+		bins[MIN(bin, lastBin)]++;
+	}
 }
+
 static SamplerSignal pairCorrelationSample(SamplerData *sd, void *data)
 {
 	UNUSED(sd);
-	forEVERYpairD(&pairCorrelationHelper, data);
+	PairCorrelationData *pcd = (PairCorrelationData*) data;
+	int nBins = pcd->conf.numBins;
+	long *sampleBins = pcd->sampleBins;
+
+	if (pcd->conf.live) {
+		memcpy(sampleBins, pairHistogramBins(),
+					nBins * sizeof(*sampleBins));
+	} else {
+		for (int t = 0; t < pcd->numThreads; t++) {
+			long *bins = pcd->threadBins[t];
+			for (int i = 0; i < nBins; i++)
+				sampleBins[i] += bins[i];
+			memset(bins, 0, nBins * sizeof(*bins));
+		}
+	}
+
+	for (int i = 0; i < nBins; i++) {
+		pcd->bins[i] += sampleBins[i];
+		blockingAdd(&pcd->blocking[i], sampleBins[i]);
+	}
+	memset(sampleBins, 0, nBins * sizeof(*sampleBins));
 	return SAMPLER_OK;
 }
 static void pairCorrelationStop(SamplerData *sd, void *data)
 {
-	UNUSED(sd);
-
+	FILE *out = sd->out;
 	PairCorrelationData *pcd = (PairCorrelationData*) data;
 	double maxR = pcd->conf.maxR;
 	int nBins = pcd->conf.numBins;
@@ -105,12 +186,44 @@ static void pairCorrelationStop(SamplerData *sd, void *data)
 		double normalization = rho * dr * (world.twoDimensional ?
 				2*M_PI*r : 4*M_PI*SQUARE(r));
 
-		printf("%e, %e\n", r, n / normalization);
+		/* The error is that of the mean count per sample, which 
+		 * gets scaled the same way */
+		BlockingResult br = blockingResult(&pcd->blocking[i]);
+		double scale = 2.0 / (N * normalization);
+
+		fprintf(out, "%e, %e, %e, %e\n", r,
+				n / normalization, br.error * scale,
+				br.tau * sd->sampleInterval);
 	}
 
+	for (int t = 0; t < pcd->numThreads; t++)
+		free(pcd->threadBins[t]);
+	free(pcd->threadBins);
 	free(pcd->bins);
+	free(pcd->sampleBins);
+	free(pcd->blocking);
 	free(pcd);
 }
+static void pairCorrelationSave(SamplerData *sd, void *data, FILE *f)
+{
+	UNUSED(sd);
+	PairCorrelationData *pcd = (PairCorrelationData*) data;
+	int nBins = pcd->conf.numBins;
+	checkpointWrite(f, &nBins, sizeof(nBins));
+	checkpointWrite(f, pcd->bins, nBins * sizeof(*pcd->bins));
+	checkpointWrite(f, pcd->blocking, nBins * sizeof(*pcd->blocking));
+}
+static bool pairCorrelationLoad(SamplerData *sd, void *data, FILE *f)
+{
+	UNUSED(sd);
+	PairCorrelationData *pcd = (PairCorrelationData*) data;
+	int nBins;
+	return checkpointRead(f, &nBins, sizeof(nBins))
+		&& nBins == pcd->conf.numBins
+		&& checkpointRead(f, pcd->bins, nBins * sizeof(*pcd->bins))
+		&& checkpointRead(f, pcd->blocking,
+					nBins * sizeof(*pcd->blocking));
+}
 Sampler pairCorrelationSampler(PairCorrelationConfig *conf)
 {
 	PairCorrelationConfig *pcc = malloc(sizeof(*pcc));
@@ -120,7 +233,808 @@ Sampler pairCorrelationSampler(PairCorrelationConfig *conf)
 			.start = &pairCorrelationStart,
 			.sample = &pairCorrelationSample,
 			.stop = &pairCorrelationStop,
+			.header = "# r, g(r), standard error of g(r), "
+				"correlation time (iterations)\n",
+			/* The live histogram has the pairs already */
+			.pairs = conf->live ? NULL : &pairCorrelationPairs,
+			.pairRange = conf->maxR,
+			.save = &pairCorrelationSave,
+			.load = &pairCorrelationLoad,
+	};
+	return sampler;
+}
+
+
+
+/* COORDINATION NUMBER SAMPLER */
+
+/* Number of neighbours within the cutoff of every particle, from the 
+ * pairs of the shared pair pass. Every thread of the pass counts in its 
+ * own array. */
+#define MAX_COORDINATION 64
+
+typedef struct {
+	CoordinationConfig conf;
+	double cutoff2;
+	int numThreads;
+	int **threadCount; /* Neighbours of every particle per thread */
+	long histogram[MAX_COORDINATION + 1]; /* Summed over all samples */
+	Blocking blocking; /* Of the average coordination number */
+} CoordinationData;
+
+static void *coordinationStart(SamplerData *sd, void *conf)
+{
+	assert(conf != NULL);
+
+	CoordinationConfig *cc = (CoordinationConfig*) conf;
+	CoordinationData *cd = calloc(1, sizeof(*cd));
+	if (cd == NULL)
+		dieMem();
+	cd->conf = *cc;
+	cd->cutoff2 = SQUARE(cc->cutoff);
+	blockingInit(&cd->blocking);
+
+	cd->numThreads = sd->pairThreads;
+	cd->threadCount = malloc(cd->numThreads * sizeof(*cd->threadCount));
+	if (cd->threadCount == NULL)
+		dieMem();
+	for (int t = 0; t < cd->numThreads; t++) {
+		cd->threadCount[t] = calloc(world.numParticles,
+						sizeof(*cd->threadCount[t]));
+		if (cd->threadCount[t] == NULL)
+			dieMem();
+	}
+
+	free(cc);
+	return cd;
+}
+
+static void coordinationPairs(SamplerData *sd, void *data, int thread,
+						const PairBatch *batch)
+{
+	UNUSED(sd);
+	CoordinationData *cd = (CoordinationData*) data;
+	int *count = cd->threadCount[thread];
+	double cutoff2 = cd->cutoff2;
+
+	for (int k = 0; k < batch->n; k++) {
+		if (batch->r2[k] >= cutoff2)
+			continue;
+		count[batch->i[k]]++;
+		count[batch->j[k]]++;
+	}
+}
+
+static SamplerSignal coordinationSample(SamplerData *sd, void *data)
+{
+	UNUSED(sd);
+	CoordinationData *cd = (CoordinationData*) data;
+	int N = world.numParticles;
+
+	long total = 0;
+	for (int i = 0; i < N; i++) {
+		int z = 0;
+		for (int t = 0; t < cd->numThreads; t++) {
+			z += cd->threadCount[t][i];
+			cd->threadCount[t][i] = 0;
+		}
+		cd->histogram[MIN(z, MAX_COORDINATION)]++;
+		total += z;
+	}
+	blockingAdd(&cd->blocking, (double) total / N);
+	return SAMPLER_OK;
+}
+
+/* Write out the average coordination number with its error, and the 
+ * distribution of the coordination numbers. */
+static void coordinationStop(SamplerData *sd, void *data)
+{
+	FILE *out = sd->out;
+	CoordinationData *cd = (CoordinationData*) data;
+	BlockingResult br = blockingResult(&cd->blocking);
+
+	octaveComment(out, "Coordination numbers within %f of %ld samples",
+						cd->conf.cutoff, sd->sample);
+	octaveScalar(out, "coordination", br.mean);
+	octaveScalar(out, "coordinationError", br.error);
+	octaveScalar(out, "coordinationTau", br.tau * sd->sampleInterval);
+
+	int maxZ = 0;
+	for (int z = 0; z <= MAX_COORDINATION; z++)
+		if (cd->histogram[z] > 0)
+			maxZ = z;
+	octaveComment(out, "Columns: coordination number, fraction of "
+								"particles");
+	octaveMatrixHeader(out, "coordinationDistribution", maxZ + 1, 2);
+	double total = (double) world.numParticles * sd->sample;
+	for (int z = 0; z <= maxZ; z++)
+		fprintf(out, "%d %e\n", z, cd->histogram[z] / total);
+
+	for (int t = 0; t < cd->numThreads; t++)
+		free(cd->threadCount[t]);
+	free(cd->threadCount);
+	free(cd);
+}
+static void coordinationSave(SamplerData *sd, void *data, FILE *f)
+{
+	UNUSED(sd);
+	CoordinationData *cd = (CoordinationData*) data;
+	checkpointWrite(f, cd->histogram, sizeof(cd->histogram));
+	checkpointWrite(f, &cd->blocking, sizeof(cd->blocking));
+}
+static bool coordinationLoad(SamplerData *sd, void *data, FILE *f)
+{
+	UNUSED(sd);
+	CoordinationData *cd = (CoordinationData*) data;
+	return checkpointRead(f, cd->histogram, sizeof(cd->histogram))
+		&& checkpointRead(f, &cd->blocking, sizeof(cd->blocking));
+}
+Sampler coordinationSampler(CoordinationConfig *conf)
+{
+	CoordinationConfig *cc = malloc(sizeof(*cc));
+	memcpy(cc, conf, sizeof(*cc));
+	Sampler sampler = {
+			.samplerConf = cc,
+			.start = &coordinationStart,
+			.sample = &coordinationSample,
+			.stop = &coordinationStop,
+			.header = NULL,
+			.pairs = &coordinationPairs,
+			.pairRange = conf->cutoff,
+			.save = &coordinationSave,
+			.load = &coordinationLoad,
+	};
+	return sampler;
+}
+
+
+
+/* STRUCTURE FACTOR SAMPLER */
+
+/* S(k) = |rho(k)|^2 / N, with rho(k) the sum of exp(i k.r) over all 
+ * particles, for the wave vectors k = dk * (nx, ny, nz) of the periodic 
+ * world (dk = 2 pi / L) up to maxK. 
+ *
+ * Only cos/sin of the smallest wave vector get computed with libm for 
+ * every particle. The exponentials of the other k follow from products: 
+ * exp(i n dk x) = exp(i (n-1) dk x) * exp(i dk x), and the negative n are 
+ * the complex conjugates. The particles go in blocks of SF_BLOCK: the 
+ * powers of a block are stored per dimension with the particles as the 
+ * fastest index, so the sum over the particles of the block streams 
+ * through the cache and gets vectorized, and the memory doesn't grow 
+ * with N. 
+ *
+ * S(-k) == S(k), so we only do the half space of k with the first nonzero 
+ * component positive. The kx planes are dealt out over the threads, which 
+ * live as long as the sampler. Every k is only touched by a single thread, 
+ * which adds up the blocks in order, so the result doesn't depend on the 
+ * number of threads. Every thread makes the powers of every block itself, 
+ * that's cheap next to the sums. 
+ * The average of every sample over each shell of k goes to a blocking 
+ * analysis, for the error bars. */
+
+#define SF_BLOCK 256
+
+typedef struct structureFactorData StructureFactorData;
+typedef struct {
+	StructureFactorData *sfd;
+	int index;
+	/* exp(i n dk x_j) for dimension d and particle j of the block is 
+	 * re[d][n*SF_BLOCK + j] + i im[d][n*SF_BLOCK + j], for n = 0 up to 
+	 * nMax[d] */
+	double *re[3], *im[3];
+	double xyRe[SF_BLOCK], xyIm[SF_BLOCK]; /* exp(i (kx x + ky y)) */
+	pthread_t thread;
+} StructureFactorWorker;
+
+struct structureFactorData {
+	StructureFactorConfig conf;
+	double dk; /* Spacing of the reciprocal lattice */
+	int nMax[3]; /* Largest component of k (in units of dk) */
+	int maxN2; /* Largest squared length of k (in units of dk) */
+
+	double *rhoRe, *rhoIm; /* rho(k) of the current sample, see 
+				  structureFactorIndex() */
+	int *kShell; /* Shell of every k, or -1 for the k we don't do */
+
+	int numShells; /* Shell i holds the k with i <= |k| / dk < i + 1 */
+	double *shellK; /* Sum of |k| over the shell */
+	int *shellCount; /* Number of k in the shell */
+	double *shellSample; /* Sum of S(k) over the shell for this sample */
+	Blocking *blocking; /* Of the average S(k) of every shell */
+
+	/* conf.numThreads of them. Worker 0 is the sampling thread itself, 
+	 * the others wait on the barrier for the next sample. */
+	StructureFactorWorker *workers;
+	pthread_barrier_t barrier;
+	bool quit;
+};
+
+static void *structureFactorWorkerMain(void *arg);
+
+static int structureFactorIndex(const StructureFactorData *sfd,
+						int nx, int ny, int nz)
+{
+	const int *nMax = sfd->nMax;
+	return (nx * (2*nMax[1] + 1) + ny + nMax[1]) * (2*nMax[2] + 1)
+							+ nz + nMax[2];
+}
+
+static void *structureFactorStart(SamplerData *sd, void *conf)
+{
+	UNUSED(sd);
+	assert(conf != NULL);
+
+	StructureFactorConfig *sfc = (StructureFactorConfig*) conf;
+	StructureFactorData *sfd = malloc(sizeof(*sfd));
+	if (sfd == NULL)
+		dieMem();
+	sfd->conf = *sfc;
+	sfd->conf.numThreads = MAX(sfc->numThreads, 1);
+	sfd->dk = 2 * M_PI / world.worldSize;
+
+	int n = floor(sfc->maxK / sfd->dk);
+	if (n < 1)
+		die("Largest k %f of the structure factor is smaller than "
+				"the smallest one of the world %f!\n",
+				sfc->maxK, sfd->dk);
+	sfd->nMax[0] = sfd->nMax[1] = n;
+	sfd->nMax[2] = world.twoDimensional ? 0 : n;
+	sfd->maxN2 = floor(SQUARE(sfc->maxK / sfd->dk));
+
+	int numK = structureFactorIndex(sfd, n, sfd->nMax[1],
+							sfd->nMax[2]) + 1;
+	sfd->rhoRe = malloc(numK * sizeof(*sfd->rhoRe));
+	sfd->rhoIm = malloc(numK * sizeof(*sfd->rhoIm));
+	sfd->kShell = malloc(numK * sizeof(*sfd->kShell));
+	sfd->numShells = floor(sqrt(sfd->maxN2)) + 1;
+	sfd->shellK = calloc(sfd->numShells, sizeof(*sfd->shellK));
+	sfd->shellCount = calloc(sfd->numShells, sizeof(*sfd->shellCount));
+	sfd->shellSample = calloc(sfd->numShells, sizeof(*sfd->shellSample));
+	sfd->blocking = malloc(sfd->numShells * sizeof(*sfd->blocking));
+	sfd->workers = calloc(sfd->conf.numThreads, sizeof(*sfd->workers));
+	if (sfd->rhoRe == NULL || sfd->rhoIm == NULL || sfd->kShell == NULL
+			|| sfd->shellK == NULL || sfd->shellCount == NULL
+			|| sfd->shellSample == NULL || sfd->blocking == NULL
+			|| sfd->workers == NULL)
+		dieMem();
+
+	/* The same half space of k as structureFactorBlock() */
+	const int *nMax = sfd->nMax;
+	for (int nx = 0; nx <= nMax[0]; nx++)
+	for (int ny = -nMax[1]; ny <= nMax[1]; ny++)
+	for (int nz = -nMax[2]; nz <= nMax[2]; nz++) {
+		int k = structureFactorIndex(sfd, nx, ny, nz);
+		int n2 = SQUARE(nx) + SQUARE(ny) + SQUARE(nz);
+		if ((nx == 0 && (ny < 0 || (ny == 0 && nz <= 0)))
+							|| n2 > sfd->maxN2) {
+			sfd->kShell[k] = -1;
+			continue;
+		}
+		int shell = sqrt(n2);
+		sfd->kShell[k] = shell;
+		sfd->shellK[shell] += sfd->dk * sqrt(n2);
+		sfd->shellCount[shell]++;
+	}
+	for (int i = 0; i < sfd->numShells; i++)
+		blockingInit(&sfd->blocking[i]);
+
+	sfd->quit = false;
+	if (pthread_barrier_init(&sfd->barrier, NULL,
+						sfd->conf.numThreads) != 0)
+		die("Couldn't initialize the thread barrier!\n");
+	for (int t = 0; t < sfd->conf.numThreads; t++) {
+		StructureFactorWorker *w = &sfd->workers[t];
+		w->sfd = sfd;
+		w->index = t;
+		for (int d = 0; d < 3; d++) {
+			size_t size = (nMax[d] + 1) * SF_BLOCK * sizeof(double);
+			w->re[d] = malloc(size);
+			w->im[d] = malloc(size);
+			if (w->re[d] == NULL || w->im[d] == NULL)
+				dieMem();
+		}
+		if (t > 0 && pthread_create(&w->thread, NULL,
+				&structureFactorWorkerMain, w) != 0)
+			die("Couldn't create structure factor thread!\n");
+	}
+
+	free(sfc);
+	return sfd;
+}
+
+/* Fill in the powers of exp(i dk x) for the count particles from first 
+ * on. */
+static void structureFactorPowers(StructureFactorWorker *w, int first,
+								int count)
+{
+	const StructureFactorData *sfd = w->sfd;
+	const int B = SF_BLOCK;
+	double dk = sfd->dk;
+
+	for (int d = 0; d < 3; d++) {
+		double *re = w->re[d], *im = w->im[d];
+		for (int j = 0; j < count; j++) {
+			re[j] = 1;
+			im[j] = 0;
+		}
+		if (sfd->nMax[d] == 0)
+			continue;
+
+		for (int j = 0; j < count; j++) {
+			Vec3 pos = world.particles[first + j].pos;
+			double x = d == 0 ? pos.x : (d == 1 ? pos.y : pos.z);
+			re[B + j] = cos(dk * x);
+			im[B + j] = sin(dk * x);
+		}
+		for (int n = 2; n <= sfd->nMax[d]; n++) {
+			const double *r1 = re + B, *i1 = im + B;
+			const double *rPrev = re + (n - 1) * B;
+			const double *iPrev = im + (n - 1) * B;
+			double *rn = re + n * B, *in = im + n * B;
+			for (int j = 0; j < count; j++) {
+				rn[j] = rPrev[j] * r1[j] - iPrev[j] * i1[j];
+				in[j] = rPrev[j] * i1[j] + iPrev[j] * r1[j];
+			}
+		}
+	}
+}
+
+/* Add the count particles of the block in the powers to rho(k), for all 
+ * k with the kx planes of this worker. */
+static void structureFactorBlock(StructureFactorWorker *w, int count)
+{
+	StructureFactorData *sfd = w->sfd;
+	const int *nMax = sfd->nMax;
+	const int B = SF_BLOCK;
+	double *xyRe = w->xyRe, *xyIm = w->xyIm;
+
+	for (int nx = w->index; nx <= nMax[0]; nx += sfd->conf.numThreads)
+	for (int ny = -nMax[1]; ny <= nMax[1]; ny++) {
+		if ((nx == 0 && ny < 0) || SQUARE(nx) + SQUARE(ny) > sfd->maxN2)
+			continue;
+
+		const double *xRe = w->re[0] + nx * B;
+		const double *xIm = w->im[0] + nx * B;
+		const double *yRe = w->re[1] + abs(ny) * B;
+		const double *yIm = w->im[1] + abs(ny) * B;
+		double ySign = ny < 0 ? -1 : 1;
+		for (int j = 0; j < count; j++) {
+			double yi = ySign * yIm[j];
+			xyRe[j] = xRe[j] * yRe[j] - xIm[j] * yi;
+			xyIm[j] = xRe[j] * yi + xIm[j] * yRe[j];
+		}
+
+		for (int nz = -nMax[2]; nz <= nMax[2]; nz++) {
+			int n2 = SQUARE(nx) + SQUARE(ny) + SQUARE(nz);
+			if ((nx == 0 && ny == 0 && nz <= 0) || n2 > sfd->maxN2)
+				continue;
+
+			const double *zRe = w->re[2] + abs(nz) * B;
+			const double *zIm = w->im[2] + abs(nz) * B;
+			double zSign = nz < 0 ? -1 : 1;
+			double rhoRe = 0, rhoIm = 0;
+			for (int j = 0; j < count; j++) {
+				double zi = zSign * zIm[j];
+				rhoRe += xyRe[j] * zRe[j] - xyIm[j] * zi;
+				rhoIm += xyRe[j] * zi + xyIm[j] * zRe[j];
+			}
+			int k = structureFactorIndex(sfd, nx, ny, nz);
+			sfd->rhoRe[k] += rhoRe;
+			sfd->rhoIm[k] += rhoIm;
+		}
+	}
+}
+
+/* Do all k with the kx planes of this worker, block by block. */
+static void structureFactorWork(StructureFactorWorker *w)
+{
+	int N = world.numParticles;
+	for (int first = 0; first < N; first += SF_BLOCK) {
+		int count = MIN(SF_BLOCK, N - first);
+		structureFactorPowers(w, first, count);
+		structureFactorBlock(w, count);
+	}
+}
+
+static void *structureFactorWorkerMain(void *arg)
+{
+	StructureFactorWorker *w = (StructureFactorWorker*) arg;
+	StructureFactorData *sfd = w->sfd;
+
+	while (true) {
+		pthread_barrier_wait(&sfd->barrier);
+		if (sfd->quit)
+			break;
+		structureFactorWork(w);
+		pthread_barrier_wait(&sfd->barrier);
+	}
+	return NULL;
+}
+
+static SamplerSignal structureFactorSample(SamplerData *sd, void *data)
+{
+	UNUSED(sd);
+	StructureFactorData *sfd = (StructureFactorData*) data;
+	const int *nMax = sfd->nMax;
+	int numK = structureFactorIndex(sfd, nMax[0], nMax[1], nMax[2]) + 1;
+	int N = world.numParticles;
+
+	memset(sfd->rhoRe, 0, numK * sizeof(*sfd->rhoRe));
+	memset(sfd->rhoIm, 0, numK * sizeof(*sfd->rhoIm));
+	pthread_barrier_wait(&sfd->barrier);
+	structureFactorWork(&sfd->workers[0]);
+	pthread_barrier_wait(&sfd->barrier);
+
+	for (int k = 0; k < numK; k++)
+		if (sfd->kShell[k] >= 0)
+			sfd->shellSample[sfd->kShell[k]] += (SQUARE(sfd->rhoRe[k])
+						+ SQUARE(sfd->rhoIm[k])) / N;
+	for (int i = 0; i < sfd->numShells; i++) {
+		if (sfd->shellCount[i] > 0)
+			blockingAdd(&sfd->blocking[i], sfd->shellSample[i]
+							/ sfd->shellCount[i]);
+		sfd->shellSample[i] = 0;
+	}
+	return SAMPLER_OK;
+}
+
+/* Write out the shells as an octave matrix with columns |k| (averaged 
+ * over the k in the shell), S(k), its standard error and correlation time, 
+ * and the number of k in the shell. */
+static void structureFactorStop(SamplerData *sd, void *data)
+{
+	FILE *out = sd->out;
+	StructureFactorData *sfd = (StructureFactorData*) data;
+
+	int rows = 0;
+	for (int i = 0; i < sfd->numShells; i++)
+		if (sfd->shellCount[i] > 0)
+			rows++;
+
+	octaveComment(out, "Static structure factor of %ld samples, averaged "
+			"over shells of width %f in k", sd->sample, sfd->dk);
+	octaveComment(out, "Columns: |k|, S(k), standard error of S(k), "
+			"correlation time (iterations), number of wave "
+			"vectors");
+	octaveMatrixHeader(out, "structureFactor", rows, 5);
+	for (int i = 0; i < sfd->numShells; i++) {
+		if (sfd->shellCount[i] == 0)
+			continue;
+		BlockingResult br = blockingResult(&sfd->blocking[i]);
+		fprintf(out, "%e %e %e %e %d\n",
+				sfd->shellK[i] / sfd->shellCount[i],
+				br.mean, br.error,
+				br.tau * sd->sampleInterval,
+				sfd->shellCount[i]);
+	}
+
+	sfd->quit = true;
+	pthread_barrier_wait(&sfd->barrier);
+	for (int t = 1; t < sfd->conf.numThreads; t++)
+		pthread_join(sfd->workers[t].thread, NULL);
+	pthread_barrier_destroy(&sfd->barrier);
+	for (int t = 0; t < sfd->conf.numThreads; t++) {
+		for (int d = 0; d < 3; d++) {
+			free(sfd->workers[t].re[d]);
+			free(sfd->workers[t].im[d]);
+		}
+	}
+	free(sfd->workers);
+	free(sfd->rhoRe);
+	free(sfd->rhoIm);
+	free(sfd->kShell);
+	free(sfd->shellK);
+	free(sfd->shellCount);
+	free(sfd->shellSample);
+	free(sfd->blocking);
+	free(sfd);
+}
+/* Only the blocking of the shells accumulates anything */
+static void structureFactorSave(SamplerData *sd, void *data, FILE *f)
+{
+	UNUSED(sd);
+	StructureFactorData *sfd = (StructureFactorData*) data;
+	checkpointWrite(f, &sfd->numShells, sizeof(sfd->numShells));
+	checkpointWrite(f, sfd->blocking,
+				sfd->numShells * sizeof(*sfd->blocking));
+}
+static bool structureFactorLoad(SamplerData *sd, void *data, FILE *f)
+{
+	UNUSED(sd);
+	StructureFactorData *sfd = (StructureFactorData*) data;
+	int numShells;
+	return checkpointRead(f, &numShells, sizeof(numShells))
+		&& numShells == sfd->numShells
+		&& checkpointRead(f, sfd->blocking,
+				numShells * sizeof(*sfd->blocking));
+}
+Sampler structureFactorSampler(StructureFactorConfig *conf)
+{
+	StructureFactorConfig *sfc = malloc(sizeof(*sfc));
+	memcpy(sfc, conf, sizeof(*sfc));
+	Sampler sampler = {
+			.samplerConf = sfc,
+			.start = &structureFactorStart,
+			.sample = &structureFactorSample,
+			.stop = &structureFactorStop,
+			.header = NULL,
+			.save = &structureFactorSave,
+			.load = &structureFactorLoad,
+	};
+	return sampler;
+}
+
+
+
+/* MEAN SQUARED DISPLACEMENT SAMPLER */
+
+/* Multiple tau correlator: level l keeps the last blockLength positions 
+ * of every particle that are coarsening^l samples apart, and correlates 
+ * every new position with all of those. Level l + 1 gets every 
+ * coarsening'th position of level l. Level 0 does the lags of 1 up to 
+ * blockLength - 1 samples, level l > 0 the lags of blockLength / 
+ * coarsening up to blockLength - 1 times coarsening^l samples, so the 
+ * lags are spaced logarithmically, and the memory and the work per sample 
+ * only grow with the logarithm of the measurement time.
+ *
+ * The usual multiple tau correlator averages the values that go to the 
+ * next level, but averaging positions over a block underestimates the 
+ * displacements at the lags of a few blocks. So we just pass every 
+ * coarsening'th position on, which gives the exact MSD at every lag (with 
+ * fewer time origins at the coarser levels).
+ * The displacements of consecutive time origins are strongly correlated, 
+ * so every lag gets a blocking analysis over its time origins for the 
+ * error bars. */
+
+typedef struct {
+	double *x, *y, *z; /* Ring of positions: entry k of the particle 
+			      with id i at [k * N + i] */
+	int head; /* Entry the next position goes to */
+	int filled; /* Number of valid entries */
+	long numPushed; /* Number of positions that went into this level */
+	Blocking *blocking; /* Of the MSD at lag k (in units of this level) 
+			       of every time origin */
+} MSDLevel;
+
+typedef struct {
+	MSDConfig conf;
+	int numLevels;
+	MSDLevel *levels;
+	double *x, *y, *z; /* Unwrapped positions of the current sample, by 
+			      particle id */
+} MSDData;
+
+static void *msdStart(SamplerData *sd, void *conf)
+{
+	UNUSED(sd);
+	assert(conf != NULL);
+
+	MSDConfig *mc = (MSDConfig*) conf;
+	if (mc->coarsening < 2 || mc->blockLength < mc->coarsening
+				|| mc->blockLength % mc->coarsening != 0)
+		die("The MSD block length %d has to be a multiple of the "
+					"coarsening %d, which has to be at "
+					"least 2!\n",
+					mc->blockLength, mc->coarsening);
+
+	MSDData *md = malloc(sizeof(*md));
+	if (md == NULL)
+		dieMem();
+	md->conf = *mc;
+	md->numLevels = 0;
+	md->levels = NULL;
+
+	int N = world.numParticles;
+	md->x = malloc(N * sizeof(*md->x));
+	md->y = malloc(N * sizeof(*md->y));
+	md->z = malloc(N * sizeof(*md->z));
+	if (md->x == NULL || md->y == NULL || md->z == NULL)
+		dieMem();
+
+	free(mc);
+	return md;
+}
+
+/* Levels only get allocated once the measurement gets that long. */
+static MSDLevel *msdAddLevel(MSDData *md)
+{
+	int p = md->conf.blockLength;
+	int N = world.numParticles;
+
+	md->levels = realloc(md->levels, (md->numLevels + 1)
+						* sizeof(*md->levels));
+	if (md->levels == NULL)
+		dieMem();
+	MSDLevel *level = &md->levels[md->numLevels++];
+	level->x = malloc(p * N * sizeof(*level->x));
+	level->y = malloc(p * N * sizeof(*level->y));
+	level->z = malloc(p * N * sizeof(*level->z));
+	level->blocking = malloc(p * sizeof(*level->blocking));
+	if (level->x == NULL || level->y == NULL || level->z == NULL
+			|| level->blocking == NULL)
+		dieMem();
+	for (int k = 0; k < p; k++)
+		blockingInit(&level->blocking[k]);
+	level->head = 0;
+	level->filled = 0;
+	level->numPushed = 0;
+	return level;
+}
+
+/* Correlate the current positions with the ones in level l, store them 
+ * in there, and pass them on to the next level if it's their turn. */
+static void msdPush(MSDData *md, int l)
+{
+	int p = md->conf.blockLength;
+	int N = world.numParticles;
+	if (l == md->numLevels)
+		msdAddLevel(md);
+	MSDLevel *level = &md->levels[l];
+	const double *x = md->x, *y = md->y, *z = md->z;
+
+	/* The lags below this are done by the finer level */
+	int minLag = (l == 0 ? 1 : p / md->conf.coarsening);
+	int maxLag = MIN(level->filled, p - 1);
+	for (int k = minLag; k <= maxLag; k++) {
+		int e = (level->head - k + p) % p;
+		const double *ox = level->x + e * N;
+		const double *oy = level->y + e * N;
+		const double *oz = level->z + e * N;
+		double r2 = 0;
+		for (int i = 0; i < N; i++)
+			r2 += SQUARE(x[i] - ox[i]) + SQUARE(y[i] - oy[i])
+						+ SQUARE(z[i] - oz[i]);
+		blockingAdd(&level->blocking[k], r2 / N);
+	}
+
+	memcpy(level->x + level->head * N, x, N * sizeof(*x));
+	memcpy(level->y + level->head * N, y, N * sizeof(*y));
+	memcpy(level->z + level->head * N, z, N * sizeof(*z));
+	level->head = (level->head + 1) % p;
+	level->filled = MIN(level->filled + 1, p);
+	level->numPushed++;
+
+	if (level->numPushed % md->conf.coarsening == 0)
+		msdPush(md, l + 1);
+}
+
+static SamplerSignal msdSample(SamplerData *sd, void *data)
+{
+	UNUSED(sd);
+	MSDData *md = (MSDData*) data;
+
+	/* By id, the particles get reordered when sorting spatially */
+	for (int i = 0; i < world.numParticles; i++) {
+		const Particle *p = &world.particles[i];
+		Vec3 pos = unwrappedPosition(p);
+		md->x[p->id] = pos.x;
+		md->y[p->id] = pos.y;
+		md->z[p->id] = pos.z;
+	}
+	msdPush(md, 0);
+	return SAMPLER_OK;
+}
+
+/* Write out an octave matrix with columns lag (in iterations), MSD, its 
+ * standard error and correlation time, and the number of time origins 
+ * that got averaged over. */
+static void msdStop(SamplerData *sd, void *data)
+{
+	FILE *out = sd->out;
+	MSDData *md = (MSDData*) data;
+	int p = md->conf.blockLength;
+	int m = md->conf.coarsening;
+
+	int rows = 0;
+	for (int l = 0; l < md->numLevels; l++)
+		for (int k = 0; k < p; k++)
+			if (md->levels[l].blocking[k].level[0].n > 0)
+				rows++;
+
+	octaveComment(out, "Mean squared displacement of %ld samples, %f "
+			"iterations apart", sd->sample, sd->sampleInterval);
+	octaveComment(out, "Columns: lag, MSD, standard error of the MSD, "
+			"correlation time (iterations), number of time "
+			"origins");
+	octaveMatrixHeader(out, "msd", rows, 5);
+	long scale = 1; /* Samples per entry of level l */
+	for (int l = 0; l < md->numLevels; l++) {
+		MSDLevel *level = &md->levels[l];
+		for (int k = 0; k < p; k++) {
+			long n = level->blocking[k].level[0].n;
+			if (n == 0)
+				continue;
+			BlockingResult br = blockingResult(&level->blocking[k]);
+			double interval = scale * sd->sampleInterval;
+			fprintf(out, "%e %e %e %e %ld\n", k * interval,
+					br.mean, br.error, br.tau * interval,
+					n);
+		}
+		scale *= m;
+	}
+
+	for (int l = 0; l < md->numLevels; l++) {
+		MSDLevel *level = &md->levels[l];
+		free(level->x);
+		free(level->y);
+		free(level->z);
+		free(level->blocking);
+	}
+	free(md->levels);
+	free(md->x);
+	free(md->y);
+	free(md->z);
+	free(md);
+}
+/* All levels with their rings of positions, which are by particle id. The 
+ * ids are in the particles of the checkpoint. */
+static void msdSave(SamplerData *sd, void *data, FILE *f)
+{
+	UNUSED(sd);
+	MSDData *md = (MSDData*) data;
+	int p = md->conf.blockLength;
+	int N = world.numParticles;
+	checkpointWrite(f, &md->conf, sizeof(md->conf));
+	checkpointWrite(f, &md->numLevels, sizeof(md->numLevels));
+	for (int l = 0; l < md->numLevels; l++) {
+		MSDLevel *level = &md->levels[l];
+		checkpointWrite(f, &level->head, sizeof(level->head));
+		checkpointWrite(f, &level->filled, sizeof(level->filled));
+		checkpointWrite(f, &level->numPushed, sizeof(level->numPushed));
+		checkpointWrite(f, level->x, p * N * sizeof(*level->x));
+		checkpointWrite(f, level->y, p * N * sizeof(*level->y));
+		checkpointWrite(f, level->z, p * N * sizeof(*level->z));
+		checkpointWrite(f, level->blocking,
+					p * sizeof(*level->blocking));
+	}
+}
+static bool msdLoad(SamplerData *sd, void *data, FILE *f)
+{
+	UNUSED(sd);
+	MSDData *md = (MSDData*) data;
+	int p = md->conf.blockLength;
+	int N = world.numParticles;
+	MSDConfig conf;
+	int numLevels;
+	if (!checkpointRead(f, &conf, sizeof(conf))
+			|| conf.blockLength != p
+			|| conf.coarsening != md->conf.coarsening
+			|| !checkpointRead(f, &numLevels, sizeof(numLevels)))
+		return false;
+
+	assert(md->numLevels == 0);
+	for (int l = 0; l < numLevels; l++) {
+		MSDLevel *level = msdAddLevel(md);
+		if (!checkpointRead(f, &level->head, sizeof(level->head))
+				|| !checkpointRead(f, &level->filled,
+						sizeof(level->filled))
+				|| !checkpointRead(f, &level->numPushed,
+						sizeof(level->numPushed))
+				|| !checkpointRead(f, level->x,
+						p * N * sizeof(*level->x))
+				|| !checkpointRead(f, level->y,
+						p * N * sizeof(*level->y))
+				|| !checkpointRead(f, level->z,
+						p * N * sizeof(*level->z))
+				|| !checkpointRead(f, level->blocking,
+						p * sizeof(*level->blocking)))
+			return false;
+	}
+	return true;
+}
+Sampler msdSampler(MSDConfig *conf)
+{
+	MSDConfig *mc = malloc(sizeof(*mc));
+	memcpy(mc, conf, sizeof(*mc));
+	Sampler sampler = {
+			.samplerConf = mc,
+			.start = &msdStart,
+			.sample = &msdSample,
+			.stop = &msdStop,
 			.header = NULL,
+			.save = &msdSave,
+			.load = &msdLoad,
 	};
 	return sampler;
 }
@@ -9,12 +9,41 @@ Sampler dumpStatsSampler(void);
 
 typedef struct {
 	int numBins;
-	double maxR;
+	double maxR; /* Only bin distances up to this. At most half the world 
+			size, the smaller the faster. */
 	double rho; /* Particle density, for normalization. */
+	bool live; /* Copy the bins of the live pair histogram (see 
+		      pairHistogram.h) instead of binning all pairs for 
+		      every sample. That histogram has to have the same 
+		      bins and range. */
 } PairCorrelationConfig;
 /* A sampler that samples the pair correlation function between the particles. */
 Sampler pairCorrelationSampler(PairCorrelationConfig *conf);
 
+typedef struct {
+	double cutoff; /* Count the neighbours closer than this */
+} CoordinationConfig;
+/* A sampler that samples the number of neighbours of the particles. */
+Sampler coordinationSampler(CoordinationConfig *conf);
+
+typedef struct {
+	double maxK; /* Sample all wave vectors of the periodic world up to 
+			this length. */
+	int numThreads; /* Threads to do the wave vectors with, 0 means 1 */
+} StructureFactorConfig;
+/* A sampler that samples the static structure factor S(k), radially 
+ * averaged over shells in k. */
+Sampler structureFactorSampler(StructureFactorConfig *conf);
+
+typedef struct {
+	int blockLength; /* Number of lags per level of the correlator */
+	int coarsening; /* Every level is this many times coarser than the 
+			   previous one. Has to divide blockLength. */
+} MSDConfig;
+/* A sampler that samples the mean squared displacement of the particles, 
+ * at logarithmically spaced lags (see samplers.c). */
+Sampler msdSampler(MSDConfig *conf);
+
 /* A trivial sampler that does nothing. Useful for debugging purposes. */
 Sampler trivialSampler(void);
 
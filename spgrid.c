@@ -2,157 +2,314 @@
 #include "math.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 /* Return false if the given expression is false. */
 #define QUICK_BAIL(expr) if (!expr) return false;
 
-struct box
-{
-	Particle *p;	/* (Linked list of) particles in this box */
-	int n;		/* number of particles in this box */
-
-	/* Circular linked list of boxes that contain particles. Both are 
-	 * NULL if this box has no particles, and hence is not part of the 
-	 * list. */
-	struct box *prevOccupied;
-	struct box *nextOccupied;
+/* Minimal number of particle slots to reserve per box, as a power of two. */
+#define MIN_BOX_CAPACITY_SHIFT 2
 
-	/* TODO be more smart so we don't need this */
-	struct box *prevX;
-	struct box *nextX;
-	struct box *prevY;
-	struct box *nextY;
-	struct box *prevZ;
-	struct box *nextZ;
-};
-typedef struct box Box;
 
-
-static void addToBox(Particle *p, Box *b);
-static void removeFromBox(Particle *p, Box *b);
-static Box *boxFromIndex(int ix, int iy, int iz);
-static Box *boxFromParticle(const Particle *p);
-static Box *boxFromNonPeriodicIndex(int ix, int iy, int iz);
+static void addToBox(int i, int b);
+static void removeFromBox(int i);
+static int boxFromIndex(int ix, int iy, int iz);
+static int boxFromPosition(Vec3 pos);
+static int boxFromNonPeriodicIndex(int ix, int iy, int iz);
 
 
 /* Globals */
-static Box *grid; /* All boxes in the spgrid. */
-static Box *occupiedBoxes; /* First element in linked list of boxes that 
-			      contain particles, or NULL if all boxes are 
-			      empty. */
-static double boxSize = 0; /* Linear length of one box. */
-static int nbx = 0; /* Number of Boxes in x dimension. */
-static int nby = 0; /* Number of Boxes in y dimension. */
-static int nbz = 0; /* Number of Boxes in z dimension. */
-static Vec3 gridSize; /* [nbx, nby, nbz] * boxSize -- cached for performance */
+SPGrid spgrid; /* Hot state, see spgrid.h */
 static int gridNumParticles = 0; /* Total number of particles in the grid. For 
 				consistency checking only! */
+static int boxCapacity = 0; /* Number of slots reserved per box. */
+
+/* Half stencil for the pair loop, precomputed in allocGrid(). This holds
+ * one offset of every pair of opposite offsets in spgrid.stencil, so
+ * every pair of neighbouring boxes is visited once when looping over all
+ * boxes. With exactly 2 boxes in a dimension, an offset can be its own
+ * opposite. Those get flagged in halfStencilOrdered and are only visited
+ * when the neighbour has a larger index than the box itself. */
+static int halfStencilSize = 0;
+static int halfStencil[SPGRID_MAX_STENCIL][3];
+static bool halfStencilOrdered[SPGRID_MAX_STENCIL];
+
+/* The boxes, sorted along a Morton (Z-order) curve, and the position of
+ * every box along that curve. Used to sort the particles spatially. */
+static int *mortonOrder;
+static int *mortonRank;
+
+/* Offsets to all boxes within rangeShells boxes of a box, the nearest 
+ * shells first, for forEveryParticleWithin(). Built on first use. The 
+ * offset tables are like spgrid.xOffset, but for the indices in 
+ * [-rangeShells, n + rangeShells), at rangeXOffset[k + rangeShells]. An 
+ * axis with too few boxes for the shells gets visited whole, and flagged 
+ * in rangeWraps. */
+static int (*rangeStencil)[3];
+static int rangeStencilSize = 0;
+static int rangeShells = -1;
+static int *rangeXOffset, *rangeYOffset, *rangeZOffset;
+static bool rangeWraps[3];
+
+static int numBoxes(void)
+{
+	return spgrid.nbx * spgrid.nby * spgrid.nbz;
+}
+static int boxStart(int b)
+{
+	assert(0 <= b  &&  b < numBoxes());
+	return b << spgrid.boxCapacityShift;
+}
+/* One past the last occupied slot of box b */
+static int boxEnd(int b)
+{
+	return boxStart(b) + spgrid.boxCount[b];
+}
+static int boxFromSlot(int s)
+{
+	return s >> spgrid.boxCapacityShift;
+}
+static int particleIndex(const Particle *p)
+{
+	assert(world.particles <= p  &&  p < world.particles + world.numParticles);
+	return p - world.particles;
+}
 
-/* Box to signal a 'non existing box'. */
-static Box nullBox = {
-	.p = NULL, .n = 0, .prevOccupied = NULL, .nextOccupied = NULL,
-	.prevX = &nullBox, .nextX = &nullBox,
-	.prevY = &nullBox, .nextY = &nullBox,
-	.prevZ = &nullBox, .nextZ = &nullBox,
-};
+/* Box at the given stencil offset from box (ix, iy, iz). */
+static int neighbourBox(int ix, int iy, int iz, const int offset[3])
+{
+	return spgrid.xOffset[ix + offset[0] + 1]
+	     + spgrid.yOffset[iy + offset[1] + 1]
+	     + spgrid.zOffset[iz + offset[2] + 1];
+}
+static void boxCoords(int b, int *ix, int *iy, int *iz)
+{
+	int nby = spgrid.nby, nbz = spgrid.nbz;
+	*ix = b / (nby * nbz);
+	*iy = (b / nbz) % nby;
+	*iz = b % nbz;
+}
 
-/* Add the (newly) occupied box to the list. It cannot already be part of 
- * the list. */
-static void addOccupiedBox(Box *box)
+/* Allocate the slot storage for a box capacity of 2^shift. Returns false
+ * if we are out of memory. */
+static bool allocSlots(int shift)
+{
+	int capacity = 1 << shift;
+	int numSlots = numBoxes() * capacity;
+	spgrid.slotX = malloc(numSlots * sizeof(*spgrid.slotX));
+	spgrid.slotY = malloc(numSlots * sizeof(*spgrid.slotY));
+	spgrid.slotZ = malloc(numSlots * sizeof(*spgrid.slotZ));
+	spgrid.slotParticle = malloc(numSlots * sizeof(*spgrid.slotParticle));
+	boxCapacity = capacity;
+	spgrid.boxCapacityShift = shift;
+	return spgrid.slotX != NULL && spgrid.slotY != NULL && spgrid.slotZ != NULL
+						&& spgrid.slotParticle != NULL;
+}
+static void freeSlots(void)
 {
-	assert(box != NULL);
-	assert(box->n > 0);
-	assert(box->p != NULL);
-	assert(box->nextOccupied == NULL);
-	assert(box->prevOccupied == NULL);
+	free(spgrid.slotX);
+	free(spgrid.slotY);
+	free(spgrid.slotZ);
+	free(spgrid.slotParticle);
+	spgrid.slotX = spgrid.slotY = spgrid.slotZ = NULL;
+	spgrid.slotParticle = NULL;
+	boxCapacity = 0;
+	spgrid.boxCapacityShift = 0;
+}
 
-	if (occupiedBoxes == NULL) {
-		/* Start a new list */
-		box->nextOccupied = box;
-		box->prevOccupied = box;
-		occupiedBoxes = box;
-	} else {
-		box->nextOccupied = occupiedBoxes;
-		box->prevOccupied = occupiedBoxes->prevOccupied;
-		box->prevOccupied->nextOccupied = box;
-		box->nextOccupied->prevOccupied = box;
+/* Double the number of slots of every box. This moves all particles to
+ * their new slots, but keeps them in the same order within their box. */
+static void growBoxCapacity(void)
+{
+	double *oldX = spgrid.slotX, *oldY = spgrid.slotY, *oldZ = spgrid.slotZ;
+	int *oldParticle = spgrid.slotParticle;
+	int oldCapacity = boxCapacity;
+
+	if (!allocSlots(spgrid.boxCapacityShift + 1))
+		dieMem();
+
+	for (int b = 0; b < numBoxes(); b++) {
+		int n = spgrid.boxCount[b];
+		int from = b * oldCapacity;
+		int to   = b * boxCapacity;
+		memcpy(spgrid.slotX + to, oldX + from, n * sizeof(*spgrid.slotX));
+		memcpy(spgrid.slotY + to, oldY + from, n * sizeof(*spgrid.slotY));
+		memcpy(spgrid.slotZ + to, oldZ + from, n * sizeof(*spgrid.slotZ));
+		memcpy(spgrid.slotParticle + to, oldParticle + from,
+					n * sizeof(*spgrid.slotParticle));
+		for (int j = 0; j < n; j++)
+			spgrid.particleSlot[spgrid.slotParticle[to + j]]
+								= to + j;
 	}
+
+	free(oldX);
+	free(oldY);
+	free(oldZ);
+	free(oldParticle);
 }
-/* Remove the empty box from the list */
-static void removeNonOccupiedBox(Box *emptyBox)
+
+/* Fill offset[k + 1] = wrap(k) * stride for k in [-1, n]. */
+static int *allocOffsetTable(int n, int stride)
 {
-	assert(emptyBox != NULL);
-	assert(occupiedBoxes != NULL);
-	assert(emptyBox->n == 0);
-	assert(emptyBox->p == NULL);
+	int *offset = malloc((n + 2) * sizeof(*offset));
+	if (offset == NULL)
+		return NULL;
+	for (int k = -1; k <= n; k++)
+		offset[k + 1] = ((k + n) % n) * stride;
+	return offset;
+}
 
-	if (emptyBox->nextOccupied == emptyBox) {
-		/* List contains only emptyBox itself */
-		assert(emptyBox->prevOccupied == emptyBox);
-		assert(emptyBox == occupiedBoxes);
+/* The offset that points back from the neighbour at offset d in a
+ * dimension with n boxes. */
+static int oppositeOffset(int d, int n)
+{
+	if (n >= 3)
+		return -d;
+	/* With 2 boxes, -1 and +1 are the same box. With 1 box d is 0. */
+	return d;
+}
 
-		occupiedBoxes = NULL;
-	} else {
-		/* List contains at least one other box */
-		assert(emptyBox->prevOccupied->nextOccupied == emptyBox);
-		assert(emptyBox->nextOccupied->prevOccupied == emptyBox);
+static void buildStencils(void)
+{
+	int nbx = spgrid.nbx, nby = spgrid.nby, nbz = spgrid.nbz;
+	spgrid.stencilSize = 0;
+	halfStencilSize = 0;
+
+	/* With less than 3 boxes in a dimension, only keep the offsets that
+	 * give distinct boxes. */
+	for (int dx = (nbx>=3 ? -1 : 0); dx <= (nbx>=2 ? 1 : 0); dx++)
+	for (int dy = (nby>=3 ? -1 : 0); dy <= (nby>=2 ? 1 : 0); dy++)
+	for (int dz = (nbz>=3 ? -1 : 0); dz <= (nbz>=2 ? 1 : 0); dz++) {
+		if (dx == 0 && dy == 0 && dz == 0)
+			continue;
 
-		emptyBox->prevOccupied->nextOccupied = emptyBox->nextOccupied;
-		emptyBox->nextOccupied->prevOccupied = emptyBox->prevOccupied;
+		assert(spgrid.stencilSize < SPGRID_MAX_STENCIL);
+		spgrid.stencil[spgrid.stencilSize][0] = dx;
+		spgrid.stencil[spgrid.stencilSize][1] = dy;
+		spgrid.stencil[spgrid.stencilSize][2] = dz;
+		spgrid.stencilSize++;
+
+		int mx = oppositeOffset(dx, nbx);
+		int my = oppositeOffset(dy, nby);
+		int mz = oppositeOffset(dz, nbz);
+		bool selfOpposite = (mx == dx && my == dy && mz == dz);
+
+		/* Of two opposite offsets, keep the lexicographically
+		 * largest one. */
+		if (!selfOpposite && (dx < mx || (dx == mx && (dy < my
+						|| (dy == my && dz < mz)))))
+			continue;
 
-		/* If the list uses emptyBox as head, pick another head */
-		if (occupiedBoxes == emptyBox)
-			occupiedBoxes = emptyBox->nextOccupied;
+		halfStencil[halfStencilSize][0] = dx;
+		halfStencil[halfStencilSize][1] = dy;
+		halfStencil[halfStencilSize][2] = dz;
+		halfStencilOrdered[halfStencilSize] = selfOpposite;
+		halfStencilSize++;
 	}
+}
 
-	emptyBox->prevOccupied = NULL;
-	emptyBox->nextOccupied = NULL;
+/* Spread the lower 21 bits of x so there are two zero bits between each
+ * of them. */
+static uint64_t spreadBits(uint64_t x)
+{
+	x &= 0x1fffff;
+	x = (x | x << 32) & 0x001f00000000ffffULL;
+	x = (x | x << 16) & 0x001f0000ff0000ffULL;
+	x = (x | x <<  8) & 0x100f00f00f00f00fULL;
+	x = (x | x <<  4) & 0x10c30c30c30c30c3ULL;
+	x = (x | x <<  2) & 0x1249249249249249ULL;
+	return x;
 }
 
+typedef struct
+{
+	uint64_t code;
+	int box;
+} MortonBox;
+static int compareMortonBoxes(const void *a, const void *b)
+{
+	const MortonBox *ma = (const MortonBox*) a;
+	const MortonBox *mb = (const MortonBox*) b;
+	return (ma->code > mb->code) - (ma->code < mb->code);
+}
 
-bool allocGrid(int nx, int ny, int nz, double boxLength)
+static bool buildMortonOrder(void)
 {
-	assert(grid == NULL && nbx == 0 && nby == 0 && nbz == 0);
-	grid = calloc(nx * ny * nz, sizeof(*grid));
-	if (grid == NULL)
+	int n = numBoxes();
+	MortonBox *boxes = malloc(n * sizeof(*boxes));
+	mortonOrder = malloc(n * sizeof(*mortonOrder));
+	mortonRank = malloc(n * sizeof(*mortonRank));
+	if (boxes == NULL || mortonOrder == NULL || mortonRank == NULL) {
+		free(boxes);
 		return false;
-	gridSize = scale((Vec3) {nx, ny, nz}, boxLength);
-	nbx = nx;
-	nby = ny;
-	nbz = nz;
-	boxSize = boxLength;
+	}
 
+	for (int b = 0; b < n; b++) {
+		int ix, iy, iz;
+		boxCoords(b, &ix, &iy, &iz);
+		boxes[b].code = spreadBits(ix) << 2 | spreadBits(iy) << 1
+							| spreadBits(iz);
+		boxes[b].box = b;
+	}
+	qsort(boxes, n, sizeof(*boxes), &compareMortonBoxes);
+	for (int r = 0; r < n; r++) {
+		mortonOrder[r] = boxes[r].box;
+		mortonRank[boxes[r].box] = r;
+	}
+
+	free(boxes);
+	return true;
+}
+
+bool allocGrid(int nx, int ny, int nz, double boxLength)
+{
+	assert(spgrid.boxCount == NULL);
+	assert(spgrid.nbx == 0 && spgrid.nby == 0 && spgrid.nbz == 0);
 	if (nx*ny*nz*boxLength == 0)
 		die("Allocating grid with 0 boxes in a dimension, or zero "
 				"box size!\n");
 
-	/* Set the prev/nextXYZ pointers
-	 * When there are 2 or less boxes in a given dimension, then set 
-	 * the 'next' pointer for that dimension to the nullBox to avoid 
-	 * double passes! (Because for 2 boxes in a dimension, both prev 
-	 * and next would point to the same neighbouring box!)
-	 * For only one box in a given dimension, both next and prev is set 
-	 * to the nullbox. */
-	for (int ix = 0; ix < nbx; ix++)
-	for (int iy = 0; iy < nby; iy++)
-	for (int iz = 0; iz < nbz; iz++) {
-		Box *box = boxFromIndex(ix, iy, iz);
+	spgrid.boxCount = calloc(nx * ny * nz, sizeof(*spgrid.boxCount));
+	spgrid.xOffset = allocOffsetTable(nx, ny * nz);
+	spgrid.yOffset = allocOffsetTable(ny, nz);
+	spgrid.zOffset = allocOffsetTable(nz, 1);
+	if (spgrid.boxCount == NULL || spgrid.xOffset == NULL || spgrid.yOffset == NULL
+							|| spgrid.zOffset == NULL)
+		return false;
+	spgrid.gridSize = scale((Vec3) {nx, ny, nz}, boxLength);
+	spgrid.nbx = nx;
+	spgrid.nby = ny;
+	spgrid.nbz = nz;
+	spgrid.boxSize = boxLength;
+
+	/* Start with room for twice the average occupation, we grow when a
+	 * box overflows anyway. */
+	int shift = MIN_BOX_CAPACITY_SHIFT;
+	while ((1 << shift) < 2 * (world.numParticles / (nx*ny*nz) + 1))
+		shift++;
+	spgrid.particleSlot = malloc(world.numParticles
+					* sizeof(*spgrid.particleSlot));
+	if (!allocSlots(shift) || spgrid.particleSlot == NULL)
+		return false;
+	for (int i = 0; i < world.numParticles; i++)
+		spgrid.particleSlot[i] = -1;
 
-		box->nextX = boxFromNonPeriodicIndex(ix+1, iy,   iz  );
-		box->prevX = boxFromNonPeriodicIndex(ix-1, iy,   iz  );
-		box->nextY = boxFromNonPeriodicIndex(ix,   iy+1, iz  );
-		box->prevY = boxFromNonPeriodicIndex(ix,   iy-1, iz  );
-		box->nextZ = boxFromNonPeriodicIndex(ix,   iy,   iz+1);
-		box->prevZ = boxFromNonPeriodicIndex(ix,   iy,   iz-1);
+	buildStencils();
+	if (!buildMortonOrder())
+		return false;
 
-		if (nbx < 3) box->nextX = &nullBox;
-		if (nby < 3) box->nextY = &nullBox;
-		if (nbz < 3) box->nextZ = &nullBox;
+	if (world.twoDimensional && nz != 1)
+		die("A 2D world needs a grid that is one box thick in z!\n");
+	spgrid.twoDimensional = world.twoDimensional;
 
-		if (nbx < 2) box->prevX = &nullBox;
-		if (nby < 2) box->prevY = &nullBox;
-		if (nbz < 2) box->prevZ = &nullBox;
-	}
+	spgrid.simd = SPGRID_SCALAR;
+#ifdef SPGRID_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f"))
+		spgrid.simd = SPGRID_AVX512;
+	else if (__builtin_cpu_supports("avx2"))
+		spgrid.simd = SPGRID_AVX2;
+#endif
 
 	assert(spgridSanityCheck(true));
 	return true;
@@ -160,66 +317,171 @@ bool allocGrid(int nx, int ny, int nz, double boxLength)
 
 void freeGrid()
 {
-	if (grid == NULL) {
-		assert(nbx == 0 && nby == 0 && nbz == 0);
-		assert(occupiedBoxes == NULL);
+	if (spgrid.boxCount == NULL) {
+		assert(spgrid.nbx == 0 && spgrid.nby == 0 && spgrid.nbz == 0);
 		return;
 	}
 
-	for (int i = 0; i < nbx*nby*nbz; i++) {
-		Box *box = &grid[i];
-		Particle *p = box->p;
-
-		if (p == NULL)
-			continue; /* Empty box */
-
-		int n = box->n; /* Save original number, it will decrease 
-				   during the loop as we remove particles! */
-		for (int j = 0; j < n; j++) {
-			Particle *next = p->next;
-			removeFromBox(p, box);
-			gridNumParticles--;
-			p = next;
-		}
-		assert(box->n == 0  &&  box->p == NULL);
+	for (int i = 0; i < world.numParticles; i++) {
+		if (spgrid.particleSlot[i] < 0)
+			continue;
+		removeFromBox(i);
+		gridNumParticles--;
 	}
 	assert(spgridSanityCheck(true));
 	assert(gridNumParticles == 0);
 
-	occupiedBoxes = NULL;
-
-	nbx = nby = nbz = 0;
-	free(grid);
+	freeSlots();
+	free(spgrid.particleSlot);
+	spgrid.particleSlot = NULL;
+
+	spgrid.nbx = spgrid.nby = spgrid.nbz = 0;
+	spgrid.twoDimensional = false;
+	spgrid.stencilSize = halfStencilSize = 0;
+	free(spgrid.xOffset);
+	free(spgrid.yOffset);
+	free(spgrid.zOffset);
+	free(spgrid.boxCount);
+	free(mortonOrder);
+	free(mortonRank);
+	free(rangeStencil);
+	free(rangeXOffset);
+	free(rangeYOffset);
+	free(rangeZOffset);
+	spgrid.xOffset = spgrid.yOffset = spgrid.zOffset = NULL;
+	spgrid.boxCount = NULL;
+	mortonOrder = mortonRank = NULL;
+	rangeStencil = NULL;
+	rangeXOffset = rangeYOffset = rangeZOffset = NULL;
+	rangeStencilSize = 0;
+	rangeShells = -1;
 }
 
 void addToGrid(Particle *p) {
-	p->pos = periodic(gridSize, p->pos);
-	Box *box = boxFromParticle(p);
-	addToBox(p, box);
+	p->pos = periodic(spgrid.gridSize, p->pos);
+	int box = boxFromPosition(p->pos);
+	addToBox(particleIndex(p), box);
 	gridNumParticles++;
 
 	assert(spgridSanityCheck(false));
 }
 
+void addAllToGrid(void)
+{
+	assert(gridNumParticles == 0);
+	int n = world.numParticles;
+	int *particleBox = malloc(n * sizeof(*particleBox));
+	if (particleBox == NULL)
+		dieMem();
+
+	int maxCount = 0;
+	for (int i = 0; i < n; i++) {
+		Particle *p = &world.particles[i];
+		p->pos = periodic(spgrid.gridSize, p->pos);
+		int b = boxFromPosition(p->pos);
+		particleBox[i] = b;
+		spgrid.boxCount[b]++;
+		maxCount = MAX(maxCount, spgrid.boxCount[b]);
+	}
+
+	/* The boxes are empty, so there's nothing to move over */
+	if (maxCount > boxCapacity) {
+		int shift = spgrid.boxCapacityShift;
+		while ((1 << shift) < maxCount)
+			shift++;
+		freeSlots();
+		if (!allocSlots(shift))
+			dieMem();
+	}
+
+	/* The slots of a box start at a fixed place, so the counts are all 
+	 * we needed. Fill the boxes again in particle order. */
+	memset(spgrid.boxCount, 0, numBoxes() * sizeof(*spgrid.boxCount));
+	for (int i = 0; i < n; i++) {
+		assert(spgrid.particleSlot[i] == -1);
+		int b = particleBox[i];
+		int s = boxEnd(b);
+		spgrid.boxCount[b]++;
+
+		Vec3 pos = world.particles[i].pos;
+		spgrid.slotX[s] = pos.x;
+		spgrid.slotY[s] = pos.y;
+		spgrid.slotZ[s] = pos.z;
+		spgrid.slotParticle[s] = i;
+		spgrid.particleSlot[i] = s;
+	}
+	gridNumParticles = n;
+	free(particleBox);
+
+	assert(spgridSanityCheck(true));
+}
+
 static void periodicPosition(Particle *p)
 {
 	/* closePeriodic should suffice. When debugging, it can be useful 
 	 * to use periodic instead if we hang on closePeriodic [but that's 
 	 * a bad sign anyway!]. */
-	p->pos = closePeriodic(gridSize, p->pos);
-	//p->pos = periodic(gridSize, p->pos);
+	p->pos = closePeriodic(spgrid.gridSize, p->pos);
+	//p->pos = periodic(spgrid.gridSize, p->pos);
+}
+
+/* Count the periodic images the particle in slot s moved through, by 
+ * comparing its new position with the one stored in the slot. A jump of 
+ * more than half the grid can only be a wrap around the boundary. */
+static void countImages(Particle *p, int s)
+{
+	Vec3 gs = spgrid.gridSize;
+	double dx = p->pos.x - spgrid.slotX[s];
+	double dy = p->pos.y - spgrid.slotY[s];
+	double dz = p->pos.z - spgrid.slotZ[s];
+	p->image[0] += (dx < -gs.x / 2) - (dx > gs.x / 2);
+	p->image[1] += (dy < -gs.y / 2) - (dy > gs.y / 2);
+	p->image[2] += (dz < -gs.z / 2) - (dz > gs.z / 2);
 }
 
 void reboxParticle(Particle *p)
 {
 	periodicPosition(p);
 
-	Box *correctBox = boxFromParticle(p);
-	if (correctBox == p->myBox)
+	int i = particleIndex(p);
+	int s = spgrid.particleSlot[i];
+	assert(s >= 0);
+	countImages(p, s);
+
+	int correctBox = boxFromPosition(p->pos);
+	if (correctBox == boxFromSlot(s)) {
+		/* Same box, just update the stored position. */
+		spgrid.slotX[s] = p->pos.x;
+		spgrid.slotY[s] = p->pos.y;
+		spgrid.slotZ[s] = p->pos.z;
 		return;
+	}
+
+	removeFromBox(i);
+	addToBox(i, correctBox);
+}
+void setParticleBox(Particle *p, int b)
+{
+	int i = particleIndex(p);
+	int s = spgrid.particleSlot[i];
+	assert(s >= 0);
+	assert(0 <= b && b < numBoxes());
+	countImages(p, s);
+
+	if (b == boxFromSlot(s)) {
+		spgrid.slotX[s] = p->pos.x;
+		spgrid.slotY[s] = p->pos.y;
+		spgrid.slotZ[s] = p->pos.z;
+		return;
+	}
 
-	removeFromBox(p, p->myBox);
-	addToBox(p, correctBox);
+	removeFromBox(i);
+	addToBox(i, b);
+}
+void reserveBoxCapacity(int n)
+{
+	while (boxCapacity < n)
+		growBoxCapacity();
 }
 void reboxParticles(void)
 {
@@ -230,214 +492,138 @@ void reboxParticles(void)
 	assert(spgridSanityCheck(true));
 }
 
-/* Precondition: particle must be within the grid. */
-static Box *boxFromParticle(const Particle *p)
+/* Precondition: position must be within the grid. */
+static int boxFromPosition(Vec3 pos)
 {
 	/* shift coordinates from [-gs/2 to gs/2] to [0 to gs], where gs = 
 	 * gridSize */
-	Vec3 shifted = add(p->pos, scale(gridSize, 1/2.0));
+	Vec3 shifted = add(pos, scale(spgrid.gridSize, 1/2.0));
 
-	assert(p != NULL);
-	assert(!isnan(p->pos.x) && !isnan(p->pos.y) && !isnan(p->pos.z));
-	assert(0 <= shifted.x  &&  shifted.x < gridSize.x);
-	assert(0 <= shifted.y  &&  shifted.y < gridSize.y);
-	assert(0 <= shifted.z  &&  shifted.z < gridSize.z);
+	assert(!isnan(pos.x) && !isnan(pos.y) && !isnan(pos.z));
+	assert(0 <= shifted.x  &&  shifted.x < spgrid.gridSize.x);
+	assert(0 <= shifted.y  &&  shifted.y < spgrid.gridSize.y);
+	assert(0 <= shifted.z  &&  shifted.z < spgrid.gridSize.z);
 
-	int ix = shifted.x / boxSize;
-	int iy = shifted.y / boxSize;
-	int iz = shifted.z / boxSize;
+	int ix = shifted.x / spgrid.boxSize;
+	int iy = shifted.y / spgrid.boxSize;
+	int iz = shifted.z / spgrid.boxSize;
 
 	return boxFromIndex(ix, iy, iz);
 }
-/* Particle may be outside the grid */
-static Box *boxFromNonPeriodicParticle(const Particle *p)
+/* Position may be outside the grid */
+static int boxFromNonPeriodicPosition(Vec3 pos)
 {
-	assert(p != NULL);
-	assert(!isnan(p->pos.x) && !isnan(p->pos.y) && !isnan(p->pos.z));
+	assert(!isnan(pos.x) && !isnan(pos.y) && !isnan(pos.z));
 
-	Vec3 shifted = add(p->pos, scale(gridSize, 1/2.0));
+	Vec3 shifted = add(pos, scale(spgrid.gridSize, 1/2.0));
 
-	int ix = shifted.x / boxSize;
-	int iy = shifted.y / boxSize;
-	int iz = shifted.z / boxSize;
+	int ix = shifted.x / spgrid.boxSize;
+	int iy = shifted.y / spgrid.boxSize;
+	int iz = shifted.z / spgrid.boxSize;
 
 	return boxFromNonPeriodicIndex(ix, iy, iz);
 }
 
-static Box *boxFromNonPeriodicIndex(int ix, int iy, int iz)
+static int boxFromNonPeriodicIndex(int ix, int iy, int iz)
 {
-	ix = ix % nbx;
-	if (UNLIKELY(ix < 0)) ix += nbx;
+	ix = ix % spgrid.nbx;
+	if (UNLIKELY(ix < 0)) ix += spgrid.nbx;
 
-	iy = iy % nby;
-	if (UNLIKELY(iy < 0)) iy += nby;
+	iy = iy % spgrid.nby;
+	if (UNLIKELY(iy < 0)) iy += spgrid.nby;
 
-	iz = iz % nbz;
-	if (UNLIKELY(iz < 0)) iz += nbz;
+	iz = iz % spgrid.nbz;
+	if (UNLIKELY(iz < 0)) iz += spgrid.nbz;
 
 	return boxFromIndex(ix, iy, iz);
 }
 
-static Box *boxFromIndex(int ix, int iy, int iz)
+static int boxFromIndex(int ix, int iy, int iz)
 {
-	assert(0 <= ix && ix < nbx);
-	assert(0 <= iy && iy < nby);
-	assert(0 <= iz && iz < nbz);
+	assert(0 <= ix && ix < spgrid.nbx);
+	assert(0 <= iy && iy < spgrid.nby);
+	assert(0 <= iz && iz < spgrid.nbz);
 
-	return grid + ix*nby*nbz + iy*nbz + iz;
+	return ix*spgrid.nby*spgrid.nbz + iy*spgrid.nbz + iz;
 }
 
-static void removeFromBox(Particle *p, Box *b)
+/* Remove particle i from its box. The last particle of the box is moved
+ * into the freed slot, so the box stays contiguous. */
+static void removeFromBox(int i)
 {
-	assert(p != NULL && b != NULL);
-	assert(p->myBox == b);
-	assert(b->n >= 0);
-
-	b->n--;
-
-	if (b->n == 0) {
-		assert(p->prev == p);
-		assert(p->next == p);
-		b->p = NULL;
-		removeNonOccupiedBox(b);
-	} else {
-		assert(p->prev->next == p);
-		assert(p->next->prev == p);
-		p->prev->next = p->next;
-		p->next->prev = p->prev;
-
-		if (b->p == p)
-			b->p = p->next;
+	int s = spgrid.particleSlot[i];
+	assert(s >= 0);
+	int b = boxFromSlot(s);
+	assert(spgrid.boxCount[b] > 0);
+	assert(spgrid.slotParticle[s] == i);
+
+	spgrid.boxCount[b]--;
+	int last = boxEnd(b);
+	if (s != last) {
+		spgrid.slotX[s] = spgrid.slotX[last];
+		spgrid.slotY[s] = spgrid.slotY[last];
+		spgrid.slotZ[s] = spgrid.slotZ[last];
+		spgrid.slotParticle[s] = spgrid.slotParticle[last];
+		spgrid.particleSlot[spgrid.slotParticle[s]] = s;
 	}
 
-	p->prev = NULL;
-	p->next = NULL;
-	p->myBox = NULL;
-}
-
-static void addToBox(Particle *p, Box *b)
-{
-	assert(p->prev == NULL);
-	assert(p->next == NULL);
-	assert(p->myBox == NULL);
-
-	b->n++;
-
-	if (b->p == NULL) {
-		assert(b->n == 1);
-		b->p = p;
-		p->prev = p;
-		p->next = p;
-		addOccupiedBox(b);
-	} else {
-		assert(b->n > 1);
-		p->next = b->p;
-		p->prev = b->p->prev;
-		p->prev->next = p;
-		p->next->prev = p;
-	}
-	p->myBox = b;
+	spgrid.particleSlot[i] = -1;
 }
 
-
-
-
-
-
-
-/* ITERATION OVER ALL NEIGBOURS OF A SINGLE PARTICLE */
-
-/* Loop between given particle (element of 'box') and particles of adjacent 
- * boxes of box.  */
-static bool forEveryNeighbourInBox(Particle *p, Box *neighbour,
-		bool (*f)(Particle *p1, Particle *p2, void *data), void *data)
+static void addToBox(int i, int b)
 {
-	assert(p->myBox != neighbour);
+	assert(spgrid.particleSlot[i] == -1);
 
-	if (neighbour == &nullBox)
-		return true;
-		/* Check for nullBox in case there were less than 3 boxes 
-		 * in that dimension. */
+	if (UNLIKELY(spgrid.boxCount[b] >= boxCapacity))
+		growBoxCapacity();
 
-	/* Match up all particles from box and neighbour. */
-	int n = neighbour->n;
-	Particle *p2 = neighbour->p;
-	for (int i = 0; i < n; i++) {
-		QUICK_BAIL(f(p, p2, data));
-		p2 = p2->next;
-	}
-	assert(p2 == neighbour->p);
+	int s = boxEnd(b);
+	spgrid.boxCount[b]++;
 
-	return true;
+	Vec3 pos = world.particles[i].pos;
+	spgrid.slotX[s] = pos.x;
+	spgrid.slotY[s] = pos.y;
+	spgrid.slotZ[s] = pos.z;
+	spgrid.slotParticle[s] = i;
+	spgrid.particleSlot[i] = s;
 }
 
-static bool forEveryNeighbourBox(Particle *p,
-		bool (*f)(Particle *p1, Particle *p2, void *d), void *d)
-{
-	//TODO: be more smart/elegant
-	Box *b = p->myBox;
-
-	/* x-1 */
-	QUICK_BAIL(forEveryNeighbourInBox(p, b->prevX->prevY->nextZ, f, d));
-	QUICK_BAIL(forEveryNeighbourInBox(p, b->prevX->prevY,        f, d));
-	QUICK_BAIL(forEveryNeighbourInBox(p, b->prevX->prevY->prevZ, f, d));
-
-	QUICK_BAIL(forEveryNeighbourInBox(p, b->prevX->nextZ,        f, d));
-	QUICK_BAIL(forEveryNeighbourInBox(p, b->prevX,               f, d));
-	QUICK_BAIL(forEveryNeighbourInBox(p, b->prevX->prevZ,        f, d));
-
-	QUICK_BAIL(forEveryNeighbourInBox(p, b->prevX->nextY->nextZ, f, d));
-	QUICK_BAIL(forEveryNeighbourInBox(p, b->prevX->nextY,        f, d));
-	QUICK_BAIL(forEveryNeighbourInBox(p, b->prevX->nextY->prevZ, f, d));
-
-
-	/* x */
-	QUICK_BAIL(forEveryNeighbourInBox(p, b->prevY->nextZ, f, d));
-	QUICK_BAIL(forEveryNeighbourInBox(p, b->prevY,        f, d));
-	QUICK_BAIL(forEveryNeighbourInBox(p, b->prevY->prevZ, f, d));
-
-	QUICK_BAIL(forEveryNeighbourInBox(p, b->nextZ,        f, d));
-	QUICK_BAIL(forEveryNeighbourInBox(p, b->prevZ,        f, d));
 
-	QUICK_BAIL(forEveryNeighbourInBox(p, b->nextY->nextZ, f, d));
-	QUICK_BAIL(forEveryNeighbourInBox(p, b->nextY,        f, d));
-	QUICK_BAIL(forEveryNeighbourInBox(p, b->nextY->prevZ, f, d));
 
 
-	/* x+1 */
-	QUICK_BAIL(forEveryNeighbourInBox(p, b->nextX->prevY->nextZ, f, d));
-	QUICK_BAIL(forEveryNeighbourInBox(p, b->nextX->prevY,        f, d));
-	QUICK_BAIL(forEveryNeighbourInBox(p, b->nextX->prevY->prevZ, f, d));
 
-	QUICK_BAIL(forEveryNeighbourInBox(p, b->nextX->nextZ,        f, d));
-	QUICK_BAIL(forEveryNeighbourInBox(p, b->nextX,               f, d));
-	QUICK_BAIL(forEveryNeighbourInBox(p, b->nextX->prevZ,        f, d));
 
-	QUICK_BAIL(forEveryNeighbourInBox(p, b->nextX->nextY->nextZ, f, d));
-	QUICK_BAIL(forEveryNeighbourInBox(p, b->nextX->nextY,        f, d));
-	QUICK_BAIL(forEveryNeighbourInBox(p, b->nextX->nextY->prevZ, f, d));
-
-	return true;
-}
 
+/* ITERATION OVER ALL NEIGBOURS OF A SINGLE PARTICLE */
 
 bool forEveryNeighbourOfD(Particle *p,
 		bool (*f)(Particle *p1, Particle *p2, void *data),
 		void *data)
 {
-	Box *box = boxFromParticle(p);
+	int self = spgrid.particleSlot[particleIndex(p)];
+	int box = boxFromSlot(self);
+	assert(box == boxFromPosition(p->pos));
 
 	/* Every neighbour within the same box */
-	int n = box->n;
-	Particle *p2 = p->next;
-	for (int i = 0; i < n - 1; i++) {
-		QUICK_BAIL(f(p, p2, data));
-		p2 = p2->next;
-	}
-	assert(p2 == p);
-	
+	int end = boxEnd(box);
+	for (int s = boxStart(box); s < end; s++) {
+		if (s == self)
+			continue;
+		QUICK_BAIL(f(p, &world.particles[spgrid.slotParticle[s]], data));
+	}
+
 	/* Every neighbour in neighbouring boxes */
-	return forEveryNeighbourBox(p, f, data);
+	int ix, iy, iz;
+	boxCoords(box, &ix, &iy, &iz);
+	for (int n = 0; n < spgrid.stencilSize; n++) {
+		int b = neighbourBox(ix, iy, iz, spgrid.stencil[n]);
+		assert(b != box);
+		int bEnd = boxEnd(b);
+		for (int s = boxStart(b); s < bEnd; s++)
+			QUICK_BAIL(f(p, &world.particles[
+						spgrid.slotParticle[s]], data));
+	}
+	return true;
 }
 
 static bool neighbourWrapper(Particle *p1, Particle *p2, void *data)
@@ -452,119 +638,179 @@ bool forEveryNeighbourOf(Particle *p, bool (*f)(Particle *p1, Particle *p2))
 }
 
 
+/* ITERATION OVER ALL PARTICLES WITHIN A RANGE */
 
-/* ITERATION OVER ALL PAIRS */
-
-/* Loop between particles of adjacent boxes of box.  We need a total 
- * ordering on the boxes so we don't check the same box twice. We use the 
- * pointer value for this.
- * However, due to periodic boundary conditions, this ONLY works when there 
- * are AT LEAST 3 boxes in each dimension!  */
-static void visitNeighbours(Box *box, Box *neighbour,
-		void (*f)(Particle *p1, Particle *p2, void *data), void *data)
+/* Offsets along a dimension with n boxes that reach up to 'shells' boxes 
+ * away. When that would wrap around, take every box once instead. Returns 
+ * true in that case. */
+static bool shellRange(int shells, int n, int *lo, int *hi)
 {
-	if (neighbour <= box || neighbour == &nullBox)
-		return;
-		/* if neighbour == box: it's our own box!
-		 * else: only check boxes that have a 
-		 * strictly larger pointer value to avoid 
-		 * double work.
-		 * Check for nullBox in case there were less than 3 boxes 
-		 * in that dimension. */
-
-	if (neighbour->n == 0)
-		return;
-
-	/* Match up all particles from box and neighbour. */
-	int n1 = box->n;
-	int n2 = neighbour->n;
-	Particle *p1 = box->p;
-	for (int i = 0; i < n1; i++) {
-		Particle *p2 = neighbour->p;
-		for (int j = 0; j < n2; j++) {
-			f(p1, p2, data);
-			p2 = p2->next;
-		}
-		assert(p2 == neighbour->p);
-		p1 = p1->next;
+	if (2 * shells + 1 <= n) {
+		*lo = -shells;
+		*hi = shells;
+		return false;
 	}
-	assert(p1 == box->p);
+	*lo = -(n - 1) / 2;
+	*hi = *lo + n - 1;
+	return true;
 }
 
-static void visitNeighboursOf(Box *box,
-		void (*f)(Particle *p1, Particle *p2, void *data), void *data)
+/* Fill offset[k + shells] = wrap(k) * stride for k in [-shells, n + shells). */
+static int *allocRangeOffsetTable(int shells, int n, int stride)
 {
-	//TODO: be more smart/elegant
-
-	/* x-1 */
-	visitNeighbours(box, box->prevX->prevY->nextZ, f, data);
-	visitNeighbours(box, box->prevX->prevY,        f, data);
-	visitNeighbours(box, box->prevX->prevY->prevZ, f, data);
-
-	visitNeighbours(box, box->prevX->nextZ,        f, data);
-	visitNeighbours(box, box->prevX,               f, data);
-	visitNeighbours(box, box->prevX->prevZ,        f, data);
-
-	visitNeighbours(box, box->prevX->nextY->nextZ, f, data);
-	visitNeighbours(box, box->prevX->nextY,        f, data);
-	visitNeighbours(box, box->prevX->nextY->prevZ, f, data);
+	int *offset = malloc((n + 2 * shells) * sizeof(*offset));
+	if (offset == NULL)
+		dieMem();
+	for (int k = -shells; k < n + shells; k++)
+		offset[k + shells] = (((k % n) + n) % n) * stride;
+	return offset;
+}
 
+static void buildRangeStencil(int shells)
+{
+	int nbx = spgrid.nbx, nby = spgrid.nby, nbz = spgrid.nbz;
+	int lx, hx, ly, hy, lz, hz;
+	rangeWraps[0] = shellRange(shells, nbx, &lx, &hx);
+	rangeWraps[1] = shellRange(shells, nby, &ly, &hy);
+	rangeWraps[2] = shellRange(shells, nbz, &lz, &hz);
+
+	free(rangeStencil);
+	free(rangeXOffset);
+	free(rangeYOffset);
+	free(rangeZOffset);
+	rangeStencil = malloc((hx - lx + 1) * (hy - ly + 1) * (hz - lz + 1)
+						* sizeof(*rangeStencil));
+	if (rangeStencil == NULL)
+		dieMem();
+	rangeXOffset = allocRangeOffsetTable(shells, nbx, nby * nbz);
+	rangeYOffset = allocRangeOffsetTable(shells, nby, nbz);
+	rangeZOffset = allocRangeOffsetTable(shells, nbz, 1);
+
+	rangeStencilSize = 0;
+	for (int shell = 0; shell <= shells; shell++)
+	for (int dx = lx; dx <= hx; dx++)
+	for (int dy = ly; dy <= hy; dy++)
+	for (int dz = lz; dz <= hz; dz++) {
+		if (MAX(abs(dx), MAX(abs(dy), abs(dz))) != shell)
+			continue;
+		rangeStencil[rangeStencilSize][0] = dx;
+		rangeStencil[rangeStencilSize][1] = dy;
+		rangeStencil[rangeStencilSize][2] = dz;
+		rangeStencilSize++;
+	}
+	rangeShells = shells;
+}
 
-	/* x */
-	visitNeighbours(box, box->prevY->nextZ, f, data);
-	visitNeighbours(box, box->prevY,        f, data);
-	visitNeighbours(box, box->prevY->prevZ, f, data);
+/* Squared distance from a point at f in [0, boxSize) within its box to the 
+ * box at offset d, along one axis. 0 if the axis wraps, the box might be 
+ * closer the other way around then. */
+static double gapToBox2(int d, double f, bool wraps)
+{
+	if (wraps || d == 0)
+		return 0;
+	double bs = spgrid.boxSize;
+	return SQUARE(d > 0 ? d * bs - f : (-d - 1) * bs + f);
+}
 
-	visitNeighbours(box, box->nextZ,        f, data);
-	visitNeighbours(box, box->prevZ,        f, data);
+bool forEveryParticleWithin(Vec3 pos, double range, const Particle *skip,
+		bool (*f)(Particle *q, Vec3 qPos, void *data), void *data)
+{
+	int shells = ceil(range / spgrid.boxSize);
+	if (shells != rangeShells)
+		buildRangeStencil(shells);
+
+	int skipSlot = -1;
+	if (skip != NULL) {
+		skipSlot = spgrid.particleSlot[particleIndex(skip)];
+		assert(skipSlot >= 0);
+	}
 
-	visitNeighbours(box, box->nextY->nextZ, f, data);
-	visitNeighbours(box, box->nextY,        f, data);
-	visitNeighbours(box, box->nextY->prevZ, f, data);
+	/* Index and position of pos within its box */
+	double bs = spgrid.boxSize;
+	Vec3 shifted = add(pos, scale(spgrid.gridSize, 1/2.0));
+	int ix = shifted.x / bs;
+	int iy = shifted.y / bs;
+	int iz = shifted.z / bs;
+	assert(boxFromIndex(ix, iy, iz) == boxFromPosition(pos));
+	double fx = shifted.x - ix * bs;
+	double fy = shifted.y - iy * bs;
+	double fz = shifted.z - iz * bs;
+
+	double range2 = SQUARE(range);
+	for (int n = 0; n < rangeStencilSize; n++) {
+		const int *o = rangeStencil[n];
+		/* Skip the corners of the shells that are out of range */
+		if (gapToBox2(o[0], fx, rangeWraps[0])
+				+ gapToBox2(o[1], fy, rangeWraps[1])
+				+ gapToBox2(o[2], fz, rangeWraps[2]) > range2)
+			continue;
 
+		int b = rangeXOffset[ix + o[0] + shells]
+		      + rangeYOffset[iy + o[1] + shells]
+		      + rangeZOffset[iz + o[2] + shells];
+		int end = boxEnd(b);
+		for (int s = boxStart(b); s < end; s++) {
+			if (s == skipSlot)
+				continue;
+			Vec3 qPos = {spgrid.slotX[s], spgrid.slotY[s],
+							spgrid.slotZ[s]};
+			QUICK_BAIL(f(&world.particles[spgrid.slotParticle[s]],
+								qPos, data));
+		}
+	}
+	return true;
+}
 
-	/* x+1 */
-	visitNeighbours(box, box->nextX->prevY->nextZ, f, data);
-	visitNeighbours(box, box->nextX->prevY,        f, data);
-	visitNeighbours(box, box->nextX->prevY->prevZ, f, data);
 
-	visitNeighbours(box, box->nextX->nextZ,        f, data);
-	visitNeighbours(box, box->nextX,               f, data);
-	visitNeighbours(box, box->nextX->prevZ,        f, data);
+/* ITERATION OVER ALL PAIRS */
 
-	visitNeighbours(box, box->nextX->nextY->nextZ, f, data);
-	visitNeighbours(box, box->nextX->nextY,        f, data);
-	visitNeighbours(box, box->nextX->nextY->prevZ, f, data);
+/* Match up all particles from box and neighbour. */
+static void visitNeighbours(int box, int neighbour,
+		void (*f)(Particle *p1, Particle *p2, void *data), void *data)
+{
+	int end1 = boxEnd(box);
+	int end2 = boxEnd(neighbour);
+	for (int s1 = boxStart(box); s1 < end1; s1++) {
+		Particle *p1 = &world.particles[spgrid.slotParticle[s1]];
+		for (int s2 = boxStart(neighbour); s2 < end2; s2++)
+			f(p1, &world.particles[spgrid.slotParticle[s2]], data);
+	}
 }
 
 void forEveryPairD(void (*f)(Particle *p1, Particle *p2, void *data),
 		void *data)
 {
-	/* Loop over all occupied boxes */
-	if (occupiedBoxes == NULL)
-		return;
+	int nbx = spgrid.nbx, nby = spgrid.nby, nbz = spgrid.nbz;
+	/* Loop over all occupied boxes. The box table is a dense array, so
+	 * skipping the empty ones is cheap. */
+	for (int ix = 0; ix < nbx; ix++)
+	for (int iy = 0; iy < nby; iy++)
+	for (int iz = 0; iz < nbz; iz++) {
+		int box = boxFromIndex(ix, iy, iz);
+		if (spgrid.boxCount[box] == 0)
+			continue;
 
-	Box *box = occupiedBoxes;
-	do {
 		/* Loop over all i'th particles 'p' from the box 'box' and 
 		 * match them with the j'th particle in the same box */
-		Particle *p = box->p;
-		int n = box->n;
-		for (int i = 0; i < n; i++) {
-			Particle *p2 = p->next;
-			for (int j = i + 1; j < n; j++) {
-				f(p, p2, data);
-				p2 = p2->next;
-			}
-
-			p = p->next;
+		int end = boxEnd(box);
+		for (int s1 = boxStart(box); s1 < end; s1++) {
+			Particle *p = &world.particles[spgrid.slotParticle[s1]];
+			for (int s2 = s1 + 1; s2 < end; s2++)
+				f(p, &world.particles[
+						spgrid.slotParticle[s2]], data);
 		}
-		assert(p == box->p); /* We went 'full circle' */
 
-		visitNeighboursOf(box, f, data);
-
-		box = box->nextOccupied;
-	} while (box != occupiedBoxes);
+		/* Half of the neighbouring boxes, the other half visits
+		 * us. */
+		for (int n = 0; n < halfStencilSize; n++) {
+			int b = neighbourBox(ix, iy, iz, halfStencil[n]);
+			if (halfStencilOrdered[n] && b < box)
+				continue;
+			if (spgrid.boxCount[b] == 0)
+				continue;
+			visitNeighbours(box, b, f, data);
+		}
+	}
 }
 
 static void pairWrapper(Particle *p1, Particle *p2, void *data)
@@ -583,32 +829,153 @@ void forEveryPair(void (*f)(Particle *p1, Particle *p2))
 
 
 
-/* PERIODIC VECTOR FUNCTIONS */
-Vec3 nearestImageVector(Vec3 v1, Vec3 v2)
-{
-	return fastPeriodic(gridSize, sub(v2, v1));
-}
+/* COLLISIONS ALONG AN AXIS */
 
-double nearestImageDistance(Vec3 v1, Vec3 v2)
-{
-	return length(nearestImageVector(v1, v2));
-}
-double nearestImageDistance2(Vec3 v1, Vec3 v2)
-{
-	return length2(nearestImageVector(v1, v2));
-}
-Vec3 nearestImageUnitVector(Vec3 v1, Vec3 v2)
+double collisionAlongAxis(const Particle *p, int axis, double diameter,
+					double maxDist, Particle **hit)
 {
-	return normalize(nearestImageVector(v1, v2));
+	assert(0 <= axis && axis < (spgrid.twoDimensional ? 2 : 3));
+	assert(diameter <= spgrid.boxSize && maxDist <= spgrid.boxSize);
+
+	int i = particleIndex(p);
+	int self = spgrid.particleSlot[i];
+	assert(self >= 0);
+
+	int ix, iy, iz;
+	boxCoords(boxFromSlot(self), &ix, &iy, &iz);
+	int nb[3] = {spgrid.nbx, spgrid.nby, spgrid.nbz};
+	int home[3] = {ix, iy, iz};
+	double gs[3] = {spgrid.gridSize.x, spgrid.gridSize.y,
+							spgrid.gridSize.z};
+	const double *slot[3] = {spgrid.slotX, spgrid.slotY, spgrid.slotZ};
+	double pos[3] = {p->pos.x, p->pos.y, p->pos.z};
+	int u = (axis + 1) % 3; /* The two axes perpendicular to 'axis' */
+	int v = (axis + 2) % 3;
+	int du = (spgrid.twoDimensional && u == 2) ? 0 : 1;
+	int dv = (spgrid.twoDimensional && v == 2) ? 0 : 1;
+	double d2 = SQUARE(diameter);
+
+	/* Everything we can hit within maxDist has its centre less than 
+	 * maxDist + diameter <= 2 boxSize ahead of p, so it's in the home 
+	 * column or in one of the two columns after that. With few boxes, 
+	 * some of these are the same box, which doesn't matter for finding 
+	 * the closest hit. */
+	double best = maxDist;
+	int bestSlot = -1;
+	for (int col = 0; col <= 2; col++)
+	for (int ou = -du; ou <= du; ou++)
+	for (int ov = -dv; ov <= dv; ov++) {
+		int c[3];
+		c[axis] = (home[axis] + col) % nb[axis];
+		c[u] = (home[u] + ou + nb[u]) % nb[u];
+		c[v] = (home[v] + ov + nb[v]) % nb[v];
+		int b = boxFromIndex(c[0], c[1], c[2]);
+
+		for (int s = boxStart(b); s < boxEnd(b); s++) {
+			double ahead = _fastPeriodic(gs[axis],
+						slot[axis][s] - pos[axis]);
+			if (ahead <= 0 || s == self)
+				continue;
+			double perp2 = SQUARE(_fastPeriodic(gs[u],
+							slot[u][s] - pos[u]))
+				     + SQUARE(_fastPeriodic(gs[v],
+							slot[v][s] - pos[v]));
+			if (perp2 >= d2)
+				continue;
+			double dist = ahead - sqrt(d2 - perp2);
+			if (dist < best) {
+				best = dist;
+				bestSlot = s;
+			}
+		}
+	}
+
+	if (bestSlot < 0) {
+		*hit = NULL;
+		return maxDist;
+	}
+	*hit = &world.particles[spgrid.slotParticle[bestSlot]];
+	/* Touching particles can come out a rounding error too close. */
+	return MAX(best, 0);
 }
 
 
 
 
+/* SPATIAL ORDERING OF THE PARTICLES */
 
+void sortParticlesSpatially(void)
+{
+	int n = world.numParticles;
+	Particle *sorted = malloc(n * sizeof(*sorted));
+	int *sortedSlot = malloc(n * sizeof(*sortedSlot));
+	if (sorted == NULL || sortedSlot == NULL)
+		dieMem();
+
+	/* Walk the boxes along the Morton curve, and give the particles new 
+	 * indices in that order. */
+	int i = 0;
+	for (int r = 0; r < numBoxes(); r++) {
+		int b = mortonOrder[r];
+		int end = boxEnd(b);
+		for (int s = boxStart(b); s < end; s++) {
+			sorted[i] = world.particles[spgrid.slotParticle[s]];
+			sortedSlot[i] = s;
+			spgrid.slotParticle[s] = i;
+			i++;
+		}
+	}
+	/* Particles that aren't in the grid go last */
+	for (int j = 0; j < n; j++) {
+		if (spgrid.particleSlot[j] >= 0)
+			continue;
+		sorted[i] = world.particles[j];
+		sortedSlot[i] = -1;
+		i++;
+	}
+	assert(i == n);
 
+	memcpy(world.particles, sorted, n * sizeof(*sorted));
+	free(spgrid.particleSlot);
+	spgrid.particleSlot = sortedSlot;
+	free(sorted);
 
+	assert(spgridSanityCheck(true));
+}
 
+double particleOrderLocality(void)
+{
+	long jumps = 0;
+	int pairs = 0;
+	int prev = -1;
+	for (int i = 0; i < world.numParticles; i++) {
+		int s = spgrid.particleSlot[i];
+		if (s < 0)
+			continue;
+		int rank = mortonRank[boxFromSlot(s)];
+		if (prev >= 0) {
+			jumps += ABS(rank - prev);
+			pairs++;
+		}
+		prev = rank;
+	}
+	return pairs > 0 ? (double) jumps / pairs : 0;
+}
+
+int particlesInBoxOrder(int *order, Rng *rng)
+{
+	int i = 0;
+	for (int r = 0; r < numBoxes(); r++) {
+		int b = mortonOrder[r];
+		int start = boxStart(b);
+		int count = spgrid.boxCount[b];
+		memcpy(&order[i], &spgrid.slotParticle[start],
+						count * sizeof(*order));
+		randomShuffle(rng, &order[i], count);
+		i += count;
+	}
+	return i;
+}
 
 
 /* TEST ROUTINES */
@@ -630,6 +997,7 @@ static void forEveryPairCheckHelper(Particle *p1, Particle *p2, void *data)
 }
 bool forEveryPairCheck(void)
 {
+	int nbx = spgrid.nbx, nby = spgrid.nby, nbz = spgrid.nbz;
 	ForEveryCheckData data;
 	data.count = 0;
 	data.error = false;
@@ -640,15 +1008,15 @@ bool forEveryPairCheck(void)
 	for (int ix = 0; ix < nbx; ix++)
 	for (int iy = 0; iy < nby; iy++)
 	for (int iz = 0; iz < nbz; iz++) {
-		Box *box = boxFromIndex(ix, iy, iz);
+		int box = boxFromIndex(ix, iy, iz);
 		/* Pairs in this box */
-		int n1 = box->n;
+		int n1 = spgrid.boxCount[box];
 		correctCount += n1 * (n1 - 1) / 2;
 
 		/* Loop over pair with adjacent boxes to the box 
 		 * of p. We need a total ordering on the boxes so 
 		 * we don't check the same box twice. We use the 
-		 * pointer value for this.
+		 * box index for this.
 		 * However, due to periodic boundary conditions, 
 		 * this ONLY works when there are AT LEAST 3 boxes 
 		 * in each dimension! Hence the conditional di{x,y,z}'s 
@@ -656,15 +1024,15 @@ bool forEveryPairCheck(void)
 		for (int dix = (nbx>=3 ? -1 : 0); dix <= (nbx>=2 ? 1 : 0); dix++)
 		for (int diy = (nby>=3 ? -1 : 0); diy <= (nby>=2 ? 1 : 0); diy++)
 		for (int diz = (nbz>=3 ? -1 : 0); diz <= (nbz>=2 ? 1 : 0); diz++) {
-			Box *b = boxFromNonPeriodicIndex(
+			int b = boxFromNonPeriodicIndex(
 					ix+dix, iy+diy, iz+diz);
 			if (b <= box)
 				continue;
 				/* if b == box: it's our own box!
 				 * else: only check boxes that have 
-				 * a strictly larger pointer value 
-				 * to avoid double counting. */
-			int n2 = b->n;
+				 * a strictly larger index to avoid
+				 * double counting. */
+			int n2 = spgrid.boxCount[b];
 			correctCount += n1 * n2;
 		}
 	}
@@ -695,35 +1063,35 @@ static bool forEveryNeighbourOfCheckHelper(Particle *p1, Particle *p2,
 
 static bool forEveryNeighbourOfCheck(void)
 {
+	int nbx = spgrid.nbx, nby = spgrid.nby, nbz = spgrid.nbz;
 	bool OK = true;
 
 	for (int ix = 0; ix < nbx; ix++)
 	for (int iy = 0; iy < nby; iy++)
 	for (int iz = 0; iz < nbz; iz++) {
 
-		Box *box = boxFromIndex(ix, iy, iz);
+		int box = boxFromIndex(ix, iy, iz);
 		int particlesInAdjacentBoxes = 0;
 
 		/* Count all particles in adjacent boxes */
 		for (int dix = (nbx>=3 ? -1 : 0); dix <= (nbx>=2 ? 1 : 0); dix++)
 		for (int diy = (nby>=3 ? -1 : 0); diy <= (nby>=2 ? 1 : 0); diy++)
 		for (int diz = (nbz>=3 ? -1 : 0); diz <= (nbz>=2 ? 1 : 0); diz++) {
-			Box *b = boxFromNonPeriodicIndex(
+			int b = boxFromNonPeriodicIndex(
 					ix+dix, iy+diy, iz+diz);
 			if (b == box)
 				continue;
 
-			particlesInAdjacentBoxes += b->n;
+			particlesInAdjacentBoxes += spgrid.boxCount[b];
 		}
 
 		int correctNeighbours = particlesInAdjacentBoxes 
-						+ MAX(0, box->n - 1);
+						+ MAX(0, spgrid.boxCount[box] - 1);
 
 		/* Loop over all particles in this box and check that their 
 		 * number of neigbours check out. */
-		int n = box->n;
-		Particle *p = box->p;
-		for (int i = 0; i < n; i++) {
+		for (int s = boxStart(box); s < boxEnd(box); s++) {
+			Particle *p = &world.particles[spgrid.slotParticle[s]];
 			ForEveryCheckData data;
 			data.count = 0;
 			data.error = false;
@@ -735,19 +1103,17 @@ static bool forEveryNeighbourOfCheck(void)
 			if (data.count != correctNeighbours) {
 				fprintf(stderr, "forEveryNeighbourOf ran "
 						"over %d neighbour(s), but "
-						"should be %d (p %p, b %p)\n",
+						"should be %d (p %p, b %d)\n",
 						data.count, correctNeighbours,
-						(void*) p, (void*) box);
+						(void*) p, box);
 				OK = false;
 			}
-
-			p = p->next;
 		}
 	}
 
 	return OK;
 }
-	
+
 
 
 
@@ -757,77 +1123,66 @@ bool spgridSanityCheck(bool checkCorrectBox)
 	int nParts2 = 0;
 	bool OK = true;
 
-	/* BOXES */
+	/* BOXES AND SLOTS */
 
-	/* Check linked list consistency of boxes */
-	for (int i = 0; i < nbx*nby*nbz; i++) {
-		Box *box = &grid[i];
-		Particle *p = box->p;
-
-		if (p == NULL)
-			continue; /* Empty box */
+	/* 1) Check if the slot and particle tables agree with each other.
+	 * 2) Check if each particle is in the box it should be in, given
+	 * its coordinates, and if the stored copy of its position is up to
+	 * date (only when checkCorrectBox, particles may have moved
+	 * otherwise).
+	 * 3) Count the number of particles and check them with
+	 * the total we got when initially adding the particles. */
+	for (int i = 0; i < numBoxes(); i++)
+	{
+		if (spgrid.boxCount[i] < 0 || spgrid.boxCount[i] > boxCapacity) {
+			fprintf(stderr, "Box %d: holds %d particles, but "
+					"capacity is %d\n", i, spgrid.boxCount[i],
+					boxCapacity);
+			OK = false;
+			continue;
+		}
 
-		int n = box->n; 
-		for (int j = 0; j < n; j++) {
-			if (p->next->prev != p || p->prev->next != p) {
-				fprintf(stderr, "%p is in a broken list\n",
-						(const void *) p);
+		for (int s = boxStart(i); s < boxEnd(i); s++) {
+			int pi = spgrid.slotParticle[s];
+			if (pi < 0 || pi >= world.numParticles
+					|| spgrid.particleSlot[pi] != s) {
+				fprintf(stderr, "Slot %d (box %d) holds particle "
+						"%d, which doesn't point back "
+						"to it\n", s, i, pi);
 				OK = false;
+				continue;
 			}
-			p = p->next;
-		}
-	}
+			nParts1++;
 
-	/* 1) Check if each particle is in the box it should be in, given 
-	 * its coordinates.
-	 * 2) Count the number of particles and check them with
-	 * the total we got when initially adding the particles. */
-	for (int i = 0; i < nbx*nby*nbz; i++)
-	{
-		Box *b = &grid[i];
-		const Particle *p, *first;
+			if (!checkCorrectBox)
+				continue;
 
-		if (b->p == NULL) {
-			if (b->n != 0) {
-				fprintf(stderr, "Box %d: found zero particles, "
-						"expected %d\n", i, b->n);
+			const Particle *p = &world.particles[pi];
+			if (spgrid.slotX[s] != p->pos.x || spgrid.slotY[s] != p->pos.y
+						|| spgrid.slotZ[s] != p->pos.z) {
+				fprintf(stderr, "Slot %d has a stale copy of "
+						"the position of particle "
+						"%d\n", s, pi);
 				OK = false;
 			}
-			continue;
-		}
 
-		first = b->p;
-		p = first;
-		int j = 0;
-		do {
-			Box *correctBox = boxFromNonPeriodicParticle(p);
-			if (checkCorrectBox && correctBox != b) {
-				int c = (correctBox - grid)/sizeof(*correctBox);
+			int c = boxFromNonPeriodicPosition(p->pos);
+			if (c != i) {
 				fprintf(stderr, "Particle is in box %d, "
-					"should be in %ld\n", i, (correctBox -
-					grid)/sizeof(*correctBox));
+					"should be in %d\n", i, c);
 				fprintf(stderr, "numBox per dim: %d %d %d\n",
-								nbx, nby, nbz);
+								spgrid.nbx, spgrid.nby, spgrid.nbz);
 				fprintf(stderr, "Pos:\t");
 				fprintVector(stderr, p->pos);
 				fprintf(stderr, "\n");
 				fprintf(stderr, "Actual box coords:  %d %d %d\n",
-						i/nby/nbz, (i/nbz)%nby, i%nbx);
+						i/spgrid.nby/spgrid.nbz, (i/spgrid.nbz)%spgrid.nby, i%spgrid.nbz);
 				fprintf(stderr, "Correct box coords: %d %d %d\n",
-						c/nby/nbz, (c/nbz)%nby, c%nbx);
+						c/spgrid.nby/spgrid.nbz, (c/spgrid.nbz)%spgrid.nby, c%spgrid.nbz);
 				OK = false;
 			}
-			j++;
-			nParts1++;
-			p = p->next;
-		} while (p != first);
-
-		if (j != b->n) {
-			fprintf(stderr, "Box %d: found %d particles, "
-					"expected %d\n", i, j, b->n);
-			OK = false;
 		}
-		nParts2 += b->n;
+		nParts2 += spgrid.boxCount[i];
 	}
 
 	if (nParts1 != gridNumParticles)
@@ -844,70 +1199,15 @@ bool spgridSanityCheck(bool checkCorrectBox)
 		OK = false;
 	}
 
-
-
-	/* OCCUPIED BOXES */
-
-	/* Check linked list consistency of occupiedboxes and count them */
-	int numOccupiedBoxes = 0;
-	if (occupiedBoxes != NULL) {
-		Box *box = occupiedBoxes;
-		do {
-			if (box->nextOccupied->prevOccupied != box
-					|| box->prevOccupied->nextOccupied != box) {
-				fprintf(stderr, "numOccupiedBoxes is broken at %p\n",
-						(const void *) box);
-				OK = false;
-			}
-			numOccupiedBoxes++;
-			if (numOccupiedBoxes > nbx*nby*nbz) {
-				fprintf(stderr, "numOccupiedBoxes contains more boxes "
-						"than there are boxes in the "
-						"grid!\n");
-				OK = false;
-				break; /* Avoid possible infinite loops */
-			}
-			box = box->nextOccupied;
-		} while (box != occupiedBoxes);
-	}
-
-	/* Check whether all occupied boxes (n > 0) are in the list, and 
-	 * that we don't have any extra in the list (count them) */
-	int correctNumOccupiedBoxes = 0;
-	for (int ix = 0; ix < nbx; ix++)
-	for (int iy = 0; iy < nby; iy++)
-	for (int iz = 0; iz < nbz; iz++) {
-		Box *box = boxFromIndex(ix, iy, iz);
-
-		if (box->n == 0) {
-			/* empty box */
-			if (box->nextOccupied != NULL
-					|| box->prevOccupied != NULL) {
-				fprintf(stderr, "box %p has no particles "
-						"but appears to be in the "
-						"occupiedBoxes list!\n",
-						(void *) box);
-				OK = false;
-			}
-		} else {
-			/* occupied box */
-			correctNumOccupiedBoxes++;
-
-			if (box->nextOccupied == NULL
-					|| box->prevOccupied == NULL) {
-				fprintf(stderr, "box %p has particles but "
-						"doesn't appear to be in the "
-						"occupiedBoxes list!\n",
-						(void *) box);
-				OK = false;
-			}
-		}
-	}
-
-	if (numOccupiedBoxes != correctNumOccupiedBoxes) {
-		fprintf(stderr, "Found %d boxes in the numOccupiedBoxes "
-				"list, but counted %d occupied boxes!\n", 
-				numOccupiedBoxes, correctNumOccupiedBoxes);
+	/* Every particle that claims a slot must be counted above */
+	int nParts3 = 0;
+	for (int i = 0; i < world.numParticles && spgrid.boxCount != NULL; i++)
+		if (spgrid.particleSlot[i] >= 0)
+			nParts3++;
+	if (nParts3 != gridNumParticles)
+	{
+		fprintf(stderr, "3: Found a total of %d particles, "
+			"should be %d\n", nParts3, gridNumParticles);
 		OK = false;
 	}
 
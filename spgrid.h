@@ -5,6 +5,13 @@
 
 #include "world.h"
 
+/* The SIMD overlap kernels can be disabled by compiling with -DNO_SIMD. */
+#if !defined(NO_SIMD) && defined(__GNUC__) \
+		&& (defined(__x86_64__) || defined(__i386__))
+#define SPGRID_X86_SIMD
+#include <immintrin.h>
+#endif
+
 /* Allocates a (nx * ny * nz) grid where each box has a size boxLength in 
  * every dimension.
  * Precondition: grid can't already be allocated (unless it was freed 
@@ -18,17 +25,43 @@ void freeGrid(void);
 /* Adds the given particle to the grid. In the case that the particle is 
  * outside of the grid, periodic boundary conditions are used to force its 
  * position to be within the grid.
- * Precondition: The particle can't already be added to the grid (ie, 
- * p->prev == p->next == NULL).
+ * Precondition: The particle must be an element of world.particles and 
+ * can't already be added to the grid.
  */
 void addToGrid(Particle *p);
 
+/* Adds all particles of the world to the (empty) grid at once, in O(N): 
+ * one pass counts the particles per box to size the boxes, and a second 
+ * one puts them in. Same result as calling addToGrid() for every 
+ * particle in order, but without growing the boxes as we go, or checking 
+ * the whole grid after every particle in debug builds. */
+void addAllToGrid(void);
+
 /* Put particles back in their correct boxes in case they escaped. This 
  * also forces periodic boundary conditions on the particle positions in 
- * case the particles escaped from the grid. */
+ * case the particles escaped from the grid.
+ * The grid keeps its own cell sorted copy of the particle positions, so 
+ * this has to be called every time a particle is moved, even if it stays 
+ * within its box!
+ * This also counts the periodic images in Particle.image, which only works 
+ * if the particle moved less than half the grid size since the last time 
+ * (the same goes for setParticleBox()). */
 void reboxParticle(Particle *p);
 void reboxParticles(void);
 
+/* Puts particle p in box b (a plain box index, see spgrid.xOffset below) 
+ * no matter where its position is, and stores that position. This is for 
+ * event driven dynamics, which move a particle to the next box exactly when 
+ * it hits the wall, even if rounding puts it a hair before that wall. Use 
+ * reboxParticle() everywhere else. */
+void setParticleBox(Particle *p, int b);
+
+/* Makes sure every box has room for at least n particles. As long as no 
+ * box gets more than that, reboxParticle() never reallocates the slots, so
+ * different threads can then move particles between boxes as long as no 
+ * two threads touch the same boxes. */
+void reserveBoxCapacity(int n);
+
 /* Run the given function over all particles that are neighbours of the 
  * given particle. In case the function f returns false for a pair, the 
  * iteration is stopped immediately and false is returned. */
@@ -37,6 +70,17 @@ bool forEveryNeighbourOfD(Particle *p,
 		void *data);
 bool forEveryNeighbourOf(Particle *p, bool (*f)(Particle *p1, Particle *p2));
 
+/* Run the given function over every particle q in the grid, other than 
+ * 'skip' (which may be NULL), in the boxes within 'range' of pos, with 
+ * the position of q as the grid stores it. The boxes nearest to pos come 
+ * first, so with a range of at least the box size, every particle closer 
+ * than the box size to pos gets visited before any box further out. Some 
+ * of the particles are further than range away, but every particle within 
+ * range gets visited exactly once. In case f returns false, the iteration 
+ * is stopped immediately and false is returned.
+ * Precondition: pos is within the grid. */
+bool forEveryParticleWithin(Vec3 pos, double range, const Particle *skip,
+		bool (*f)(Particle *q, Vec3 qPos, void *data), void *data);
 
 /* Execute a given function for every discinct pair of particles that are 
  * within the same box, or in adjacent boxes (taking into account periodic 
@@ -48,6 +92,38 @@ bool forEveryNeighbourOf(Particle *p, bool (*f)(Particle *p1, Particle *p2));
 void forEveryPairD(void (*f)(Particle *p1, Particle *p2, void *data), void *data);
 void forEveryPair(void (*f)(Particle *p1, Particle *p2));
 
+/* Ray query for event driven moves: returns how far particle p can move 
+ * in the positive direction of the given axis (0, 1 or 2 for x, y, z) 
+ * before it touches another particle, assuming all particles have the 
+ * given diameter. If that is more than maxDist, maxDist is returned and 
+ * *hit is set to NULL, otherwise *hit is the particle that gets touched.
+ * This only looks at the column of boxes ahead of p, so:
+ * Precondition: diameter <= boxSize, maxDist <= boxSize, and 
+ * maxDist + diameter is less than half the grid size along every axis. */
+double collisionAlongAxis(const Particle *p, int axis, double diameter,
+					double maxDist, Particle **hit);
+
+/* Permute world.particles so particles that are close to each other in 
+ * space are also close to each other in memory. The particles get sorted 
+ * along a Morton curve through the boxes (and keep their cell sorted 
+ * order within a box).
+ * This invalidates every pointer to a particle and every particle index 
+ * that is kept outside of the grid! Keep the id of a particle instead. */
+void sortParticlesSpatially(void);
+
+/* Measure of how scattered the particles are in memory: the average 
+ * distance along the Morton curve of the boxes of particles that are 
+ * consecutive in world.particles. This is small (about the number of 
+ * boxes per particle) right after sortParticlesSpatially(), and grows as 
+ * the particles diffuse away. */
+double particleOrderLocality(void);
+
+/* Fills order with the indices of all particles in the grid, box by box 
+ * along the same Morton curve, in a random order (drawn from rng) within 
+ * every box. order needs room for world.numParticles indices. Returns the 
+ * number of particles it got. */
+int particlesInBoxOrder(int *order, Rng *rng);
+
 /* Check whether internal structure is still consistent. If checkCorrectBox 
  * is true, then also check if all particles are in their correct boxes.
  * This check also does a forEveryPairCheck. */
@@ -59,21 +135,322 @@ bool spgridSanityCheck(bool checkCorrectBox);
  * Returns true if everything is OK, false otherwise. */
 bool forEveryPairCheck(void);
 
+
+
+/* INTERNALS
+ * The state of the grid is only exported so the hot path functions below 
+ * can be inlined. Don't touch this outside of spgrid! */
+
+/* Maximal number of neighbouring boxes of a box. */
+#define SPGRID_MAX_STENCIL 26
+
+/* Minimal number of particles in a box to use the SIMD overlap kernels 
+ * for. Below that, the scalar loop is faster. */
+#define SPGRID_SIMD_MIN_BATCH 2
+
+/* Overlap kernel to use, depending on what the CPU supports. */
+typedef enum
+{
+	SPGRID_SCALAR,
+	SPGRID_AVX2,
+	SPGRID_AVX512,
+} SPGridSimd;
+
+typedef struct spgrid
+{
+	double boxSize; /* Linear length of one box. */
+	int nbx; /* Number of Boxes in x dimension. */
+	int nby; /* Number of Boxes in y dimension. */
+	int nbz; /* Number of Boxes in z dimension. */
+	Vec3 gridSize; /* [nbx, nby, nbz] * boxSize -- cached for performance */
+	bool twoDimensional; /* All particles in one plane, nbz == 1 */
+
+	/* Cell sorted particle storage. Every box owns a fixed range of 
+	 * 2^boxCapacityShift consecutive slots: the particles of box b are 
+	 * stored in the first boxCount[b] slots starting at slot 
+	 * b << boxCapacityShift. The positions in the slots are copies of 
+	 * the Particle positions, so neighbour loops can stream through 
+	 * contiguous memory instead of hopping through world.particles. */
+	int boxCapacityShift;
+	double *slotX, *slotY, *slotZ; /* Positions of the particle in a slot */
+	int *particleSlot; /* Slot of particle i, or -1 if not in the grid */
+	int *slotParticle; /* Index in world.particles of the particle in a 
+			      slot */
+	int *boxCount; /* Number of particles in each box, NULL if no grid */
+
+	/* Neighbour stencil, precomputed in allocGrid().
+	 * Boxes are plain indices ix*nby*nbz + iy*nbz + iz. The periodic 
+	 * wrap is folded into the offset tables: xOffset[k + 1] is the 
+	 * contribution of the (wrapped) x index k to the box index, for k 
+	 * in [-1, nbx]. The same goes for y and z. The box at offset 
+	 * (dx, dy, dz) of box (ix, iy, iz) is then simply
+	 *   xOffset[ix + dx + 1] + yOffset[iy + dy + 1] + zOffset[iz + dz + 1]
+	 * which needs no branches and no pointer chasing.
+	 * 'stencil' holds the offsets to all distinct neighbouring boxes. 
+	 * When there are less than 3 boxes in a dimension, the offsets -1 
+	 * and +1 would give the same box (or the box itself), so we only 
+	 * keep the distinct ones. */
+	int *xOffset, *yOffset, *zOffset;
+	int stencilSize;
+	int stencil[SPGRID_MAX_STENCIL][3];
+
+	SPGridSimd simd; /* Picked at runtime in allocGrid() */
+} SPGrid;
+
+extern SPGrid spgrid;
+
+
+/* Returns the position of p as if the world wasn't periodic, ie the 
+ * position it would have without ever having been wrapped around the 
+ * boundaries since it got added to the grid. */
+static __inline__ Vec3 unwrappedPosition(const Particle *p)
+{
+	Vec3 gs = spgrid.gridSize;
+	Vec3 pos = p->pos;
+	pos.x += p->image[0] * gs.x;
+	pos.y += p->image[1] * gs.y;
+	pos.z += p->image[2] * gs.z;
+	return pos;
+}
+
 /* Returns the shortest vector that points from v1 to v2, taking into 
  * account the periodic boundary conditions. 
  * Precondition: The given vectors are allowed to break out of the grid, 
  * but they must be within one 'world-size' of the grid (ie in [-L, 2L] if 
- * the grid is [0, L] in each dimension.)
- *
- * NOTE: We can't fully define these here with an __inline__ attribute in 
- * the header because we need the dimensions of the world, which we hide in 
- * the .c file.  This shouldn't be a performance hit if your compiler can 
- * do Link Time Optimization (LTO), though.
- * If not: you'd probably want to bring those variables into this header 
- * and move the implementation from the .c file to here. */
-Vec3 nearestImageVector(Vec3 v1, Vec3 v2);
-Vec3 nearestImageUnitVector(Vec3 v1, Vec3 v2);
-double nearestImageDistance(Vec3 v1, Vec3 v2);
-double nearestImageDistance2(Vec3 v1, Vec3 v2);
+ * the grid is [0, L] in each dimension.) */
+static __inline__ Vec3 nearestImageVector(Vec3 v1, Vec3 v2)
+{
+	return fastPeriodic(spgrid.gridSize, sub(v2, v1));
+}
+static __inline__ double nearestImageDistance(Vec3 v1, Vec3 v2)
+{
+	return length(nearestImageVector(v1, v2));
+}
+static __inline__ double nearestImageDistance2(Vec3 v1, Vec3 v2)
+{
+	return length2(nearestImageVector(v1, v2));
+}
+static __inline__ Vec3 nearestImageUnitVector(Vec3 v1, Vec3 v2)
+{
+	return normalize(nearestImageVector(v1, v2));
+}
+
+/* Returns the given position with periodic boundary conditions applied, 
+ * so it is within the grid. Only use this if the position is "only a 
+ * couple of times" outside of the grid, see closePeriodic(). */
+static __inline__ Vec3 gridPeriodic(Vec3 pos)
+{
+	return closePeriodic(spgrid.gridSize, pos);
+}
+
+
+/* Helpers for overlapsAnyParticle() */
+
+#ifdef SPGRID_X86_SIMD
+/* Batched versions of the distance test over the slots [start, end), 
+ * testing 8 (AVX-512) or 4 (AVX2) slots at once. These give exactly the 
+ * same answer as the scalar loop in _overlapsInBox(). They are only 
+ * called when the CPU supports them, see spgrid.simd. */
+__attribute__((target("avx512f")))
+static __inline__ __m512d _periodicAVX512(__m512d d, double period)
+{
+	__m512d p = _mm512_set1_pd(period);
+	__mmask8 low = _mm512_cmp_pd_mask(d, _mm512_set1_pd(-period/2),
+								_CMP_LT_OQ);
+	d = _mm512_mask_add_pd(d, low, d, p);
+	__mmask8 high = _mm512_cmp_pd_mask(d, _mm512_set1_pd(period/2),
+								_CMP_GE_OQ);
+	return _mm512_mask_sub_pd(d, high, d, p);
+}
+__attribute__((target("avx512f")))
+static bool _overlapsInSlotsAVX512(Vec3 pos, double d2, int start, int end,
+						int skip, bool threeD)
+{
+	Vec3 gs = spgrid.gridSize;
+	__m512d px = _mm512_set1_pd(pos.x);
+	__m512d py = _mm512_set1_pd(pos.y);
+	__m512d pz = _mm512_set1_pd(pos.z);
+	__m512d maxR2 = _mm512_set1_pd(d2);
+
+	for (int s = start; s < end; s += 8) {
+		__mmask8 valid = (end - s >= 8) ? 0xff : (1 << (end - s)) - 1;
+		if (s <= skip && skip < s + 8)
+			valid &= ~(1 << (skip - s));
+
+		__m512d dx = _mm512_maskz_loadu_pd(valid, spgrid.slotX + s);
+		__m512d dy = _mm512_maskz_loadu_pd(valid, spgrid.slotY + s);
+		dx = _periodicAVX512(_mm512_sub_pd(dx, px), gs.x);
+		dy = _periodicAVX512(_mm512_sub_pd(dy, py), gs.y);
+		__m512d r2 = _mm512_add_pd(_mm512_mul_pd(dx, dx),
+						_mm512_mul_pd(dy, dy));
+		if (threeD) {
+			__m512d dz = _mm512_maskz_loadu_pd(valid,
+							spgrid.slotZ + s);
+			dz = _periodicAVX512(_mm512_sub_pd(dz, pz), gs.z);
+			r2 = _mm512_add_pd(r2, _mm512_mul_pd(dz, dz));
+		}
+
+		if (_mm512_mask_cmp_pd_mask(valid, r2, maxR2, _CMP_LT_OQ))
+			return true;
+	}
+	return false;
+}
+
+__attribute__((target("avx2")))
+static __inline__ __m256d _periodicAVX2(__m256d d, double period)
+{
+	__m256d p = _mm256_set1_pd(period);
+	__m256d low = _mm256_cmp_pd(d, _mm256_set1_pd(-period/2), _CMP_LT_OQ);
+	d = _mm256_add_pd(d, _mm256_and_pd(low, p));
+	__m256d high = _mm256_cmp_pd(d, _mm256_set1_pd(period/2), _CMP_GE_OQ);
+	return _mm256_sub_pd(d, _mm256_and_pd(high, p));
+}
+__attribute__((target("avx2")))
+static bool _overlapsInSlotsAVX2(Vec3 pos, double d2, int start, int end,
+						int skip, bool threeD)
+{
+	Vec3 gs = spgrid.gridSize;
+	__m256d px = _mm256_set1_pd(pos.x);
+	__m256d py = _mm256_set1_pd(pos.y);
+	__m256d pz = _mm256_set1_pd(pos.z);
+	__m256d maxR2 = _mm256_set1_pd(d2);
+	__m256i lanes = _mm256_set_epi64x(3, 2, 1, 0);
+	__m256i endSlot = _mm256_set1_epi64x(end);
+	__m256i skipSlot = _mm256_set1_epi64x(skip);
+
+	for (int s = start; s < end; s += 4) {
+		__m256i slot = _mm256_add_epi64(lanes, _mm256_set1_epi64x(s));
+		__m256i valid = _mm256_andnot_si256(
+				_mm256_cmpeq_epi64(slot, skipSlot),
+				_mm256_cmpgt_epi64(endSlot, slot));
+
+		__m256d dx = _mm256_maskload_pd(spgrid.slotX + s, valid);
+		__m256d dy = _mm256_maskload_pd(spgrid.slotY + s, valid);
+		dx = _periodicAVX2(_mm256_sub_pd(dx, px), gs.x);
+		dy = _periodicAVX2(_mm256_sub_pd(dy, py), gs.y);
+		__m256d r2 = _mm256_add_pd(_mm256_mul_pd(dx, dx),
+						_mm256_mul_pd(dy, dy));
+		if (threeD) {
+			__m256d dz = _mm256_maskload_pd(spgrid.slotZ + s, valid);
+			dz = _periodicAVX2(_mm256_sub_pd(dz, pz), gs.z);
+			r2 = _mm256_add_pd(r2, _mm256_mul_pd(dz, dz));
+		}
+
+		__m256d hit = _mm256_and_pd(_mm256_cmp_pd(r2, maxR2, _CMP_LT_OQ),
+						_mm256_castsi256_pd(valid));
+		if (_mm256_movemask_pd(hit))
+			return true;
+	}
+	return false;
+}
+#endif
+
+/* Returns true if a particle stored in box b, other than the one in slot 
+ * 'skip', is closer than sqrt(d2) to pos. */
+static __inline__ bool _overlapsInBox(Vec3 pos, double d2, int b, int skip,
+								bool threeD)
+{
+	int start = b << spgrid.boxCapacityShift;
+	int end = start + spgrid.boxCount[b];
+
+#ifdef SPGRID_X86_SIMD
+	/* Only worth it if there is something to batch. */
+	if (end - start >= SPGRID_SIMD_MIN_BATCH) {
+		if (spgrid.simd == SPGRID_AVX512)
+			return _overlapsInSlotsAVX512(pos, d2, start, end,
+								skip, threeD);
+		if (spgrid.simd == SPGRID_AVX2)
+			return _overlapsInSlotsAVX2(pos, d2, start, end,
+								skip, threeD);
+	}
+#endif
+
+	const double *x = spgrid.slotX, *y = spgrid.slotY, *z = spgrid.slotZ;
+	Vec3 gs = spgrid.gridSize;
+	for (int s = start; s < end; s++) {
+		double dx = _fastPeriodic(gs.x, x[s] - pos.x);
+		double dy = _fastPeriodic(gs.y, y[s] - pos.y);
+		double r2 = dx*dx + dy*dy;
+		if (threeD) {
+			double dz = _fastPeriodic(gs.z, z[s] - pos.z);
+			r2 += dz*dz;
+		}
+		if (r2 < d2  &&  s != skip)
+			return true;
+	}
+	return false;
+}
+static __inline__ bool _overlapsAny3D(Vec3 pos, double d2, int skip)
+{
+	int ix = (pos.x + spgrid.gridSize.x/2) / spgrid.boxSize;
+	int iy = (pos.y + spgrid.gridSize.y/2) / spgrid.boxSize;
+	int iz = (pos.z + spgrid.gridSize.z/2) / spgrid.boxSize;
+	assert(0 <= ix && ix < spgrid.nbx);
+	assert(0 <= iy && iy < spgrid.nby);
+	assert(0 <= iz && iz < spgrid.nbz);
+
+	int home = spgrid.xOffset[ix + 1] + spgrid.yOffset[iy + 1]
+						+ spgrid.zOffset[iz + 1];
+	if (_overlapsInBox(pos, d2, home, skip, true))
+		return true;
+	for (int n = 0; n < spgrid.stencilSize; n++) {
+		const int *o = spgrid.stencil[n];
+		int b = spgrid.xOffset[ix + o[0] + 1]
+		      + spgrid.yOffset[iy + o[1] + 1]
+		      + spgrid.zOffset[iz + o[2] + 1];
+		if (_overlapsInBox(pos, d2, b, skip, true))
+			return true;
+	}
+	return false;
+}
+/* The 2D version never looks at z: the grid is one box thick in z, and the 
+ * stencil has no offsets in z. */
+static __inline__ bool _overlapsAny2D(Vec3 pos, double d2, int skip)
+{
+	int ix = (pos.x + spgrid.gridSize.x/2) / spgrid.boxSize;
+	int iy = (pos.y + spgrid.gridSize.y/2) / spgrid.boxSize;
+	assert(0 <= ix && ix < spgrid.nbx);
+	assert(0 <= iy && iy < spgrid.nby);
+	assert(spgrid.nbz == 1);
+
+	int home = spgrid.xOffset[ix + 1] + spgrid.yOffset[iy + 1];
+	if (_overlapsInBox(pos, d2, home, skip, false))
+		return true;
+	for (int n = 0; n < spgrid.stencilSize; n++) {
+		const int *o = spgrid.stencil[n];
+		int b = spgrid.xOffset[ix + o[0] + 1]
+		      + spgrid.yOffset[iy + o[1] + 1];
+		if (_overlapsInBox(pos, d2, b, skip, false))
+			return true;
+	}
+	return false;
+}
+
+/* Returns true if a sphere with the given diameter at position pos would 
+ * overlap with a particle in the grid other than 'skip', ie if there is 
+ * such a particle that is closer than 'diameter' to pos (assuming all 
+ * particles have that same diameter).
+ * This works directly on the cell sorted positions, without any function 
+ * pointers, so use this instead of forEveryNeighbourOf in the hot path.
+ * Arguments:
+ *  - pos: Must be within the grid (see gridPeriodic()).
+ *  - diameter: Must be at most the box size.
+ *  - skip: Particle in the grid to ignore (eg the one that wants to move 
+ *    to pos), or NULL. */
+static __inline__ bool overlapsAnyParticle(Vec3 pos, double diameter,
+							const Particle *skip)
+{
+	assert(diameter <= spgrid.boxSize);
+
+	int skipSlot = -1;
+	if (skip != NULL) {
+		skipSlot = spgrid.particleSlot[skip - world.particles];
+		assert(skipSlot >= 0);
+	}
+
+	if (spgrid.twoDimensional)
+		return _overlapsAny2D(pos, SQUARE(diameter), skipSlot);
+	return _overlapsAny3D(pos, SQUARE(diameter), skipSlot);
+}
 
 #endif
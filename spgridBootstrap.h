@@ -1,2 +0,0 @@
-struct box; /* To break circular reference between Particle and Box */
-
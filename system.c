@@ -9,6 +9,11 @@ long getIteration(void)
 	return iteration;
 }
 
+void setIteration(long i)
+{
+	iteration = i;
+}
+
 /* Returns true if everything went according to plan. False if something 
  * unexpected happened. */
 bool run(Task *task)
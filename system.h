@@ -47,6 +47,10 @@ bool run(Task *task);
 /* Get the number of the last completed iteration. */
 long getIteration(void);
 
+/* Continue counting from the given iteration, eg after a restart. Call 
+ * this before run(). */
+void setIteration(long i);
+
 
 
 /* Exit the program with an error. Print the given message. */
@@ -0,0 +1,202 @@
+#include <stdlib.h>
+#include <string.h>
+#include "verlet.h"
+#include "spgrid.h"
+
+static double cutoff = 0; /* Largest distance we can answer queries for */
+static double skin = 0;
+static double listRadius2 = 0; /* (cutoff + skin)^2 */
+
+/* Per particle neighbour arrays. The neighbours of particle i are stored
+ * in neighbours[i * listCapacity] up to (but not including)
+ * neighbours[i * listCapacity + listCount[i]]. The lists are symmetric:
+ * particles i and j are in each others list iff their origins are closer
+ * than cutoff + skin. */
+static int *neighbours;
+static int *listCount;
+static int listCapacity = 0;
+static Vec3 *origin; /* Position of the particles at their last relist */
+
+static long numRebuilds = 0;
+static long numRelists = 0;
+static long numFallbacks = 0;
+
+
+/* Allocate room for 'capacity' neighbours per particle, and copy over the
+ * lists we already have. */
+static void resizeLists(int capacity)
+{
+	int n = world.numParticles;
+	int *lists = malloc(n * capacity * sizeof(*lists));
+	if (lists == NULL)
+		dieMem();
+	if (neighbours != NULL) {
+		for (int i = 0; i < n; i++)
+			memcpy(lists + i * capacity,
+					neighbours + i * listCapacity,
+					listCount[i] * sizeof(*lists));
+		free(neighbours);
+	}
+	neighbours = lists;
+	listCapacity = capacity;
+}
+
+static void addToList(int i, int j)
+{
+	if (UNLIKELY(listCount[i] >= listCapacity))
+		resizeLists(2 * listCapacity);
+	neighbours[i * listCapacity + listCount[i]] = j;
+	listCount[i]++;
+}
+
+/* Remove j from the list of i, by moving the last entry in its place. */
+static void removeFromList(int i, int j)
+{
+	int *list = neighbours + i * listCapacity;
+	int last = listCount[i] - 1;
+	for (int k = 0; k <= last; k++) {
+		if (list[k] != j)
+			continue;
+		list[k] = list[last];
+		listCount[i]--;
+		return;
+	}
+	assert(false); /* Lists aren't symmetric! */
+}
+
+bool allocVerletLists(double cutoffDistance, double skinDistance)
+{
+	assert(neighbours == NULL);
+	assert(cutoffDistance > 0 && skinDistance > 0);
+	/* Relisting a particle looks for current positions within
+	 * cutoff + 3/2 skin, see relistParticle(). */
+	assert(spgrid.boxSize >= cutoffDistance + 1.5 * skinDistance);
+
+	cutoff = cutoffDistance;
+	skin = skinDistance;
+	listRadius2 = SQUARE(cutoff + skin);
+
+	int n = world.numParticles;
+	listCount = calloc(n, sizeof(*listCount));
+	origin = malloc(n * sizeof(*origin));
+	if (listCount == NULL || origin == NULL)
+		return false;
+	/* Hard spheres don't get much more neighbours than this within
+	 * cutoff + skin. We grow if needed anyway. */
+	resizeLists(16);
+
+	numRebuilds = 0;
+	numRelists = 0;
+	numFallbacks = 0;
+	rebuildVerletLists();
+	return true;
+}
+
+void freeVerletLists(void)
+{
+	free(neighbours);
+	free(listCount);
+	free(origin);
+	neighbours = NULL;
+	listCount = NULL;
+	origin = NULL;
+	listCapacity = 0;
+}
+
+static void listPair(Particle *p1, Particle *p2, void *data)
+{
+	UNUSED(data);
+
+	if (nearestImageDistance2(p1->pos, p2->pos) >= listRadius2)
+		return;
+
+	int i = p1 - world.particles;
+	int j = p2 - world.particles;
+	addToList(i, j);
+	addToList(j, i);
+}
+
+void rebuildVerletLists(void)
+{
+	for (int i = 0; i < world.numParticles; i++) {
+		listCount[i] = 0;
+		origin[i] = world.particles[i].pos;
+	}
+	forEveryPairD(&listPair, NULL);
+	numRebuilds++;
+}
+
+static bool relistNeighbour(Particle *p1, Particle *p2, void *data)
+{
+	UNUSED(data);
+
+	int i = p1 - world.particles;
+	int j = p2 - world.particles;
+	if (nearestImageDistance2(origin[i], origin[j]) < listRadius2) {
+		addToList(i, j);
+		addToList(j, i);
+	}
+	return true;
+}
+
+/* Rebuild the list of particle i around its current position. The other
+ * particles keep their origin, so this keeps the lists of everyone else
+ * valid.
+ * Those other particles are within skin/2 of their origin, so the ones
+ * we need are within cutoff + 3/2 skin of i, and the grid neighbours
+ * cover that. */
+static void relistParticle(int i)
+{
+	int *list = neighbours + i * listCapacity;
+	for (int k = 0; k < listCount[i]; k++)
+		removeFromList(list[k], i);
+	listCount[i] = 0;
+
+	origin[i] = world.particles[i].pos;
+	forEveryNeighbourOfD(&world.particles[i], &relistNeighbour, NULL);
+	numRelists++;
+}
+
+bool verletOverlaps(const Particle *p, Vec3 pos, double diameter)
+{
+	assert(diameter <= cutoff);
+	int i = p - world.particles;
+
+	/* The list is only complete for positions within skin/2 of the
+	 * origin. (The other particles are within skin/2 of theirs, see
+	 * verletParticleMoved().) */
+	if (UNLIKELY(nearestImageDistance2(pos, origin[i])
+						>= SQUARE(skin / 2))) {
+		numFallbacks++;
+		return overlapsAnyParticle(pos, diameter, p);
+	}
+
+	double d2 = SQUARE(diameter);
+	const int *list = neighbours + i * listCapacity;
+	for (int k = 0; k < listCount[i]; k++) {
+		Vec3 pos2 = world.particles[list[k]].pos;
+		if (nearestImageDistance2(pos, pos2) < d2)
+			return true;
+	}
+	return false;
+}
+
+void verletParticleMoved(const Particle *p)
+{
+	int i = p - world.particles;
+	if (nearestImageDistance2(p->pos, origin[i]) >= SQUARE(skin / 2))
+		relistParticle(i);
+}
+
+long verletNumRebuilds(void)
+{
+	return numRebuilds;
+}
+long verletNumRelists(void)
+{
+	return numRelists;
+}
+long verletNumFallbacks(void)
+{
+	return numFallbacks;
+}
@@ -0,0 +1,50 @@
+#ifndef _VERLET_H_
+#define _VERLET_H_
+
+/* Verlet neighbour lists on top of the spgrid.
+ *
+ * Every particle has an 'origin' (its position when its list was last
+ * built) and a list of all particles whose origin is closer than
+ * cutoff + skin to its own. As long as every particle is within skin/2 of
+ * its origin, the list of a particle holds everything that can be within
+ * the cutoff of it, so an overlap test only needs to look at the (few)
+ * listed particles instead of at all particles in the neighbouring boxes.
+ *
+ * When a particle moves further than skin/2 from its origin, only the
+ * list of that particle gets rebuilt (with the cell lists of the spgrid)
+ * around its new position. With single particle moves, a full rebuild 
+ * every time some particle crosses the limit would happen all the time 
+ * in big systems. */
+
+#include "world.h"
+
+/* Allocates and builds the Verlet lists for all particles in the world.
+ * Precondition: All particles are in the spgrid, and the boxes of the
+ * grid are at least cutoff + 3/2 skin big.
+ * Returns true on succes, false on failure. */
+bool allocVerletLists(double cutoff, double skin);
+
+/* Frees the Verlet lists. */
+void freeVerletLists(void);
+
+/* Rebuild the lists of all particles from their current positions. */
+void rebuildVerletLists(void);
+
+/* Returns true if particle p, when moved to pos, would be closer than
+ * 'diameter' to any other particle. This only checks the Verlet list of
+ * p, unless pos is too far from the position of p at the last rebuild,
+ * in which case we fall back to overlapsAnyParticle().
+ * Precondition: diameter <= cutoff, and pos is within the grid. */
+bool verletOverlaps(const Particle *p, Vec3 pos, double diameter);
+
+/* Has to be called after particle p got moved (and reboxed). Rebuilds the
+ * list of p when it got too far from its origin. */
+void verletParticleMoved(const Particle *p);
+
+/* Statistics */
+long verletNumRebuilds(void);
+long verletNumRelists(void); /* Number of single particle list rebuilds */
+long verletNumFallbacks(void); /* Number of verletOverlaps() that fell back
+				  to the grid */
+
+#endif
@@ -8,6 +8,8 @@ bool allocWorld(int numParticles, double worldSize, bool twoDimensional)
 	world.particles = calloc(numParticles, sizeof(*world.particles));
 	if (world.particles == NULL)
 		return false;
+	for (int i = 0; i < numParticles; i++)
+		world.particles[i].id = i;
 	world.numParticles = numParticles;
 	world.worldSize = worldSize;
 	world.twoDimensional = twoDimensional;
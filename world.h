@@ -1,13 +1,16 @@
 #ifndef _WORLD_H_
 #define _WORLD_H_
 #include "system.h"
-#include "spgridBootstrap.h"
 
 typedef struct particle
 {
-	Vec3 pos; /* Position */
-	struct particle *prev, *next; /* Previous/Next particle in box */
-	struct box *myBox; /* The space patition box that I am in */
+	Vec3 pos; /* Position. Call reboxParticle() after changing this! */
+	int image[3]; /* Number of times the particle crossed the periodic 
+			 boundary along each axis (in the positive direction 
+			 minus in the negative one). Kept up to date by the 
+			 spgrid, see unwrappedPosition(). */
+	int id; /* Stays with the particle when sortParticlesSpatially() 
+		   reorders world.particles, unlike its index there. */
 } Particle;
 
 typedef struct world